@@ -3,13 +3,86 @@
 #include <string>
 #include <vector>
 #include <sstream>
+#include <fstream>
 #include <cstdint>
 #include <utility>
+#include <memory>
 #include <unordered_map>
+#include <limits>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <functional>
+#include <condition_variable>
 
 // config
-extern std::unordered_map<std::string, std::vector<int>> global_config;
-std::unordered_map<std::string, std::vector<int>> read_config(const std::string& filename, bool verbose);
+// detector geometry and run settings, read and checked once by read_config() and passed by const reference to the modules,
+// so the loops read plain fields instead of looking up the keys. the keys of the config file are the upper case field names,
+// e.g. MAX_FRAMES_SIZE is max_frames_size. the keys only needed by some modules are checked there with require().
+struct RunConfig {
+    // detector shape
+    int n_panels = 0;
+    int n_crystals = 0;
+    int n_rows_premerge = 0;
+    int n_cols_premerge = 0;
+    int n_pixels_premerge = 0;
+    int n_readout_pixels = 0;
+    int n_readout_groups = 0;
+    int n_rows = 0;
+    int n_cols = 0;
+    int n_pixels = 0;
+    int row_merge_fold = 1;
+    int col_merge_fold = 1;
+    int row_merge_index = 0;
+    int col_merge_index = 0;
+    // crystals of a panel (optional)
+    int panel_crystal_rows = 0;
+    int panel_crystal_cols = 0;
+    std::vector<int> panel_crystal_layout;
+    // spectrum bins
+    int adu_min = 0;
+    int adu_max = 0;
+    int n_bins = 0;
+    // algorithm parameters
+    std::vector<float> secondary_thresholds;  // [crystal_id]
+    int max_event_pixels = 0;
+    // cluster histograms (optional)
+    float cluster_energy_min = 0;
+    float cluster_energy_max = 0;
+    int cluster_energy_bins = 0;
+    int max_multiplicity = 0;
+    // running settings
+    int max_frames_size = 0;
+    int n_threads = 1;
+    int block_frames = 256;  // frames of one crystal clustered by one task, set by plan_flows()
+    bool thread_pinning = false;  // PIN_THREADS = 1 pins the threads to CPUs (optional)
+
+    // derived from the above
+    std::vector<int> pixel_order;  // [position in a crystal's part of a raw frame] post-merge pixel id, -1 for merged pixels
+    size_t frame_size() const { return static_cast<size_t>(n_crystals) * n_pixels_premerge; }                  // values of a raw frame
+    // [crystal_id] plane of the crystal in a flow and [plane] crystal id. all crystals are read unless set_active_crystals()
+    // keeps only some of them, the reader and the flow buffers then skip the others (their plane is -1)
+    std::vector<int> crystals_planes;
+    std::vector<int> planes_crystals;
+    int n_planes() const { return static_cast<int>(planes_crystals.size()); }
+    size_t flow_size() const { return static_cast<size_t>(n_planes()) * max_frames_size * n_pixels; }          // values of a flow of the read crystals
+    size_t plane_offset(int crystal_id) const { return static_cast<size_t>(crystals_planes[crystal_id]) * max_frames_size * n_pixels; }  // of a crystal in a flow
+    void set_active_crystals(const std::vector<int>& crystal_ids);
+    // [thread] NUMA node of each pinned thread, set by pin_threads(), empty if the threads are not pinned.
+    // the planes of the crystals are split over the nodes in order, each node processes the crystals whose frames are in its memory
+    std::vector<int> threads_nodes;
+    int n_nodes() const { return threads_nodes.empty() ? 1 : threads_nodes.back() + 1; }
+    int thread_node(int thread_i) const { return threads_nodes.empty() ? 0 : threads_nodes[thread_i]; }
+    int plane_node(int plane) const { return static_cast<int>(static_cast<int64_t>(plane) * n_nodes() / n_planes()); }
+    int crystal_node(int crystal_id) const { return plane_node(crystals_planes[crystal_id]); }
+
+    // throws if one of the keys was not in the config file
+    void require(const std::vector<std::string>& required_keys) const;
+    std::vector<std::string> keys;
+};
+RunConfig read_config(const std::string& filename, bool verbose);
 
 // basics
 std::vector<float> create_bins(unsigned int n_bins, float low, float high);
@@ -19,25 +92,507 @@ int read_pixels_calibrations(const std::string filename,
     std::vector<std::vector<float>>& pixels_peaks,
     std::vector<uint8_t>& pixels_isvalids,
     std::vector<float>& pixels_thresholds);
-int read_rawfile_to_crystals_frames_images(const std::string& rawfile, const int start_frame_id, const int end_frame_id, uint16_t* crystals_frames_images);
+int read_rawfile_to_crystals_frames_images(const RunConfig& config, const std::string& rawfile, const int start_frame_id, const int end_frame_id, uint16_t* crystals_frames_images);
+size_t rawfile_read_buffer_bytes(const RunConfig& config);
+
+// the buffers of a command reading the raw files by flows: fixed_bytes, plus frame_bytes for every frame of a flow
+struct FlowMemory {
+    size_t fixed_bytes = 0;
+    size_t frame_bytes = 0;
+};
+// sets MAX_FRAMES_SIZE from the memory budget (0 for a part of the available RAM, capped by MAX_FRAMES_SIZE) and
+// the frames of a clustering block from the L3 cache, and logs the plan
+int plan_flows(RunConfig& config, const FlowMemory& memory, const std::vector<std::string>& rawfiles, const size_t max_memory);
+size_t parse_memory_size(const std::string& text);
+
+// a whole file mapped into memory, read-only or writable (changes are written back to the file)
+class MappedFile {
+public:
+    MappedFile(const std::string& path, bool writable);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    uint8_t* data() const { return ptr; }
+    size_t size() const { return file_size; }
+
+private:
+    uint8_t* ptr = nullptr;
+    size_t file_size = 0;
+    void* map_handle = nullptr;  // only used on Windows
+};
+
+// pixel-major copy of a raw file, written by the transpose command next to the raw file as {rawfile}.tpx
+// the frames are cut into blocks of block_frames frames (the last one may be shorter), and within a block the values of
+// each crystal and pixel (post-merge pixel ids) over the frames of the block are stored one after another,
+// so the time series of a pixel is read in one contiguous piece per block.
+class TransposedRawfile {
+public:
+    static std::string filename_of(const std::string& rawfile) { return rawfile + ".tpx"; }
+    // whether the transposed file exists and still matches the raw file and the config
+    static bool available(const RunConfig& config, const std::string& rawfile);
+    TransposedRawfile(const std::string& rawfile);
+    size_t n_frames() const { return total_frames; }
+    // copy the values of a pixel in the frames [0, n_frames())
+    int read_pixel(const int crystal_id, const int pixel_id, uint16_t* values) const;
+
+private:
+    MappedFile mapped;
+    uint32_t n_crystals = 0;
+    uint32_t n_pixels = 0;
+    uint32_t block_frames = 0;
+    uint64_t total_frames = 0;
+};
+
+// runs jobs one after another on a single writer thread, in the order they were submitted, so that the HDF5 library is
+// only called from one thread while the caller goes on with the next flow. submit() blocks while max_pending jobs are
+// waiting. a job owns what it writes, or the caller keeps it alive until wait() on the id returned by submit().
+// an exception thrown by a job is rethrown by the next submit(), wait() or finish(), the later jobs are dropped.
+// the destructor runs the remaining jobs.
+class AsyncWriter {
+public:
+    AsyncWriter(const size_t max_pending);
+    ~AsyncWriter();
+    AsyncWriter(const AsyncWriter&) = delete;
+    AsyncWriter& operator=(const AsyncWriter&) = delete;
+    size_t submit(std::function<void()> job);
+    // wait until the job with this id is done
+    void wait(const size_t job_id);
+    // wait until all submitted jobs are done
+    void finish();
+
+private:
+    void run();
+    const size_t max_pending;
+    std::deque<std::function<void()>> jobs;
+    size_t n_submitted = 0;
+    size_t n_done = 0;
+    bool stopping = false;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::thread thread;
+};
+
+// large buffers
+// an uninitialized allocation backed by huge pages when possible: explicit huge pages (MAP_HUGETLB, or large pages on
+// Windows), then transparent huge pages (madvise MADV_HUGEPAGE), then normal pages. fewer pages take fewer TLB entries
+// for the linear scans and the scattered writes over the planes of the crystals.
+class LargeBuffer {
+public:
+    enum class Pages { huge, transparent_huge, normal };
+    LargeBuffer() = default;
+    explicit LargeBuffer(const size_t size);
+    ~LargeBuffer();
+    LargeBuffer(LargeBuffer&& other) noexcept;
+    LargeBuffer& operator=(LargeBuffer&& other) noexcept;
+    LargeBuffer(const LargeBuffer&) = delete;
+    LargeBuffer& operator=(const LargeBuffer&) = delete;
+    void* data() const { return pointer; }
+    size_t size() const { return n_bytes; }
+    Pages pages() const { return kind; }
+    const char* pages_name() const;
+
+private:
+    void free();
+    void* pointer = nullptr;
+    size_t n_bytes = 0;
+    size_t mapped_bytes = 0;
+    Pages kind = Pages::normal;
+};
+
+// a LargeBuffer taken from the process-wide pool of released buffers at least as large, or allocated if there is none,
+// and given back to the pool when destroyed, so that the flows and raw files of a command reuse their buffers
+class PooledBuffer {
+public:
+    explicit PooledBuffer(const size_t size);
+    ~PooledBuffer();
+    PooledBuffer(PooledBuffer&&) = default;
+    void* data() const { return buffer.data(); }
+    const char* pages_name() const { return buffer.pages_name(); }
+
+private:
+    LargeBuffer buffer;
+};
+// the numbers of buffers allocated by their pages and reused
+std::string buffer_pool_summary();
+// the released buffers kept in the pool are freed, oldest first, beyond max_bytes, set by plan_flows() to the planned buffers
+void set_buffer_pool_limit(const size_t max_bytes);
+// frees the released buffers and resets the limit and the counts, between the commands of a server
+void clear_buffer_pool();
+
+// counts the data TLB load misses of the N_THREADS OpenMP threads from the construction, the calling thread is the first
+// of them. it uses the hardware counters of perf_event_open on Linux and is not available() where they cannot be opened
+class TlbMissCounter {
+public:
+    explicit TlbMissCounter(const RunConfig& config);
+    ~TlbMissCounter();
+    TlbMissCounter(const TlbMissCounter&) = delete;
+    TlbMissCounter& operator=(const TlbMissCounter&) = delete;
+    bool available() const { return !fds.empty(); }
+    uint64_t read() const;
+
+private:
+    std::vector<int> fds;
+};
+
+// NUMA
+// pins the threads to the CPUs if PIN_THREADS is set, spread over the NUMA nodes, and sets threads_nodes
+int pin_threads(RunConfig& config);
+
+// the frames of a flow of the read crystals (flow_size() values) in a pooled large buffer. they are not zero-filled by the
+// allocating thread but first touched in parallel, each crystal by the threads of its node, so that its pages are in the
+// memory of the node processing it
+class FlowBuffer {
+public:
+    explicit FlowBuffer(const RunConfig& config);
+    uint16_t* data() { return static_cast<uint16_t*>(values.data()); }
+    const uint16_t* data() const { return static_cast<const uint16_t*>(values.data()); }
+
+private:
+    PooledBuffer values;
+};
+
+// hands out the tasks to the threads of a parallel region, tasks_nodes[task_i] is the node whose memory the task reads.
+// a thread takes the tasks of its node in order and then helps the other nodes, without pinned threads this is the same
+// as schedule(dynamic, 1). next() returns -1 when all tasks are taken.
+class NodeTaskQueue {
+public:
+    NodeTaskQueue(const RunConfig& config, const std::vector<int>& tasks_nodes);
+    int next(const int thread_i);
+
+private:
+    const RunConfig& config;
+    std::vector<std::vector<int>> nodes_tasks;
+    std::unique_ptr<std::atomic<size_t>[]> cursors;
+};
 
 // auxiliary processing
-std::vector<size_t> compute_adu_lookup_table(const std::vector<float>& bins);
+std::vector<size_t> compute_adu_lookup_table(const RunConfig& config, const std::vector<float>& bins);
 int compute_pixel_order(int n_cols_premerge, int n_rows_premerge, int n_readout_pixels, int n_readout_groups, int n_pixels_premerge, int n_pixels,
     int row_merge_fold, int col_merge_fold, int row_merge_index, int col_merge_index, int n_cols, int* pixel_order);
 
+// clusters
+// a batch of clusters stored as flat arrays (CSR layout), the pixels of the i-th cluster are
+// pixel_ids[offsets[i]:offsets[i+1]], and the same range of adus and energies.
+// clear() keeps the capacity, so a batch reused for every flow works as an arena: once it has grown
+// to the size of a busy flow, clustering no longer allocates.
+struct ClusterBatch {
+    std::vector<int> frame_ids;
+    std::vector<uint32_t> offsets{ 0 };
+    std::vector<uint16_t> pixel_ids;
+    std::vector<uint16_t> adus;
+    std::vector<float> energies;
+
+    size_t size() const { return frame_ids.size(); }
+    uint32_t cluster_size(size_t i) const { return offsets[i + 1] - offsets[i]; }
+    void add_pixel(int pixel_id, uint16_t adu, float energy) {
+        pixel_ids.push_back(static_cast<uint16_t>(pixel_id));
+        adus.push_back(adu);
+        energies.push_back(energy);
+    }
+    void close_cluster(int frame_id) {
+        frame_ids.push_back(frame_id);
+        offsets.push_back(static_cast<uint32_t>(pixel_ids.size()));
+    }
+    void clear() {
+        frame_ids.clear();
+        offsets.resize(1);
+        pixel_ids.clear();
+        adus.clear();
+        energies.clear();
+    }
+};
+
+// sparse index stored next to a cluster file as {cluster file}.idx
+// records are grouped into blocks of block_records records that never span two raw files,
+// each block keeps where it starts and the ranges of its frame ids and total energies,
+// so a query only has to read the blocks that can contain matching clusters.
+struct ClusterIndexBlock {
+    uint64_t byte_offset;
+    uint64_t first_record;
+    uint32_t n_records;
+    uint32_t file_index;
+    int32_t min_frame_id;
+    int32_t max_frame_id;
+    float min_energy;
+    float max_energy;
+};
+struct ClusterIndexFile {
+    uint64_t byte_offset;
+    uint64_t first_record;
+    std::string rawfile;
+};
+struct ClusterIndex {
+    uint32_t block_records = 1024;
+    uint64_t n_records = 0;
+    uint64_t n_bytes = 0;
+    std::vector<ClusterIndexFile> files;
+    std::vector<ClusterIndexBlock> blocks;
+};
+int write_cluster_index(const std::string& filename, const ClusterIndex& index);
+int read_cluster_index(const std::string& filename, ClusterIndex& index);
+
+// output of raw2clusters, the batches of every flow are written crystal by crystal in the order of the frames,
+// flush() is called at the end of every flow and close() at the end of the run
+class ClusterOutput {
+public:
+    virtual ~ClusterOutput() = default;
+    virtual int begin_rawfile(const std::string& rawfile) = 0;  // the following clusters come from this raw file
+    virtual int write(int crystal_id, const ClusterBatch& batch) = 0;
+    virtual int flush() = 0;
+    virtual int close() = 0;
+};
+
+// writes clusters into one file per crystal and cluster size, all files are opened once per run
+// every batch is routed to the files in one pass through large write buffers
+// clusters with more than max_event_pixels pixels go to clusters_crystal_{}_pixel_large{}.bin
+// when the files are cleared, an index of every file is written on close()
+// the files of other units than crystals (e.g. clusters_panel_{}_pixel_{}.bin) are named by another stem
+class ClusterWriter : public ClusterOutput {
+public:
+    ClusterWriter(const std::string& folder, const std::vector<int>& crystal_ids, int max_event_pixels,
+        const std::string& suffix, bool clear_file, const std::string& stem = "clusters_crystal");
+    ~ClusterWriter();
+    int begin_rawfile(const std::string& rawfile) override;
+    int write(int crystal_id, const ClusterBatch& batch) override;
+    int flush() override;
+    int close() override;
+
+private:
+    struct Bucket {
+        std::string filename;
+        std::ofstream stream;
+        std::vector<char> buffer;
+        ClusterIndex index;
+    };
+    int max_event_pixels;
+    bool indexed;
+    bool closed = false;
+    std::vector<std::vector<Bucket>> crystals_buckets;  // [crystal_id][cluster size - 1], the last one is for large clusters
+    int flush_bucket(Bucket& bucket);
+};
+
+// writes the clusters of each crystal into clusters_crystal_{}{}.h5 as columns, which are extendible, chunked and compressed
+// 1-D datasets. one row per cluster: frame_id, file_index (index of the raw file), size and offset (position of the first
+// pixel in the pixel columns), and one row per pixel: pixel_id, adu and energy. rawfiles lists the raw files.
+// the batches of a flow are collected and appended to the datasets once per flow by flush().
+namespace HighFive { class File; }
+class ClusterH5Writer : public ClusterOutput {
+public:
+    ClusterH5Writer(const std::string& folder, const std::vector<int>& crystal_ids, const std::string& suffix,
+        const std::string& stem = "clusters_crystal");
+    ~ClusterH5Writer();
+    int begin_rawfile(const std::string& rawfile) override;
+    int write(int crystal_id, const ClusterBatch& batch) override;
+    int flush() override;
+    int close() override;
+
+private:
+    struct CrystalColumns {
+        std::unique_ptr<HighFive::File> file;
+        uint64_t n_pixels_written = 0;
+        std::vector<int> frame_ids;
+        std::vector<uint16_t> file_indices;
+        std::vector<uint16_t> sizes;
+        std::vector<uint64_t> offsets;
+        std::vector<uint16_t> pixel_ids;
+        std::vector<uint16_t> adus;
+        std::vector<float> energies;
+    };
+    std::vector<std::string> rawfiles;
+    bool closed = false;
+    std::vector<CrystalColumns> crystals_columns;
+};
+
+// compact encoding of the clusters of each crystal in clusters_crystal_{}{}.cbin, written and read block by block.
+// within a block, frame ids are delta-varint encoded, pixel ids are stored as zigzag-varint offsets from the first pixel,
+// and adus as varints. energies are either omitted and recomputed from the calibration when decoding ("omit"),
+// or stored as varints of fixed-point units of COMPACT_ENERGY_UNIT keV ("fixed").
+const float COMPACT_ENERGY_UNIT = 0.001f;
+class ClusterCompactWriter : public ClusterOutput {
+public:
+    ClusterCompactWriter(const std::string& folder, const std::vector<int>& crystal_ids, const std::string& suffix,
+        const std::string& energy_encoding, const std::string& stem = "clusters_crystal");
+    ~ClusterCompactWriter();
+    int begin_rawfile(const std::string& rawfile) override;
+    int write(int crystal_id, const ClusterBatch& batch) override;
+    int flush() override;
+    int close() override;
+
+private:
+    struct CrystalStream {
+        std::ofstream stream;
+        std::vector<uint8_t> block;
+        uint32_t n_records = 0;
+        int last_frame_id = 0;
+    };
+    bool store_energies;
+    bool closed = false;
+    std::vector<CrystalStream> crystals_streams;
+    int write_block(CrystalStream& crystal_stream);
+};
+
+class ClusterCompactReader {
+public:
+    explicit ClusterCompactReader(const std::string& filename);
+    int crystal_id() const { return file_crystal_id; }
+    bool has_energies() const { return store_energies; }
+    // decode the next block into batch (cleared first), energies are left empty if they are not stored
+    // a block announcing a new raw file sets rawfile and leaves batch empty, returns false at the end of the file
+    bool read_block(ClusterBatch& batch, std::string& rawfile);
+
+private:
+    std::ifstream stream;
+    std::vector<uint8_t> block;
+    int file_crystal_id;
+    bool store_energies;
+};
+
+// merges the clusters of adjacent crystals of the panel which touch each other across the crystal edges in the same frame.
+// the crystals are tiled as a grid of PANEL_CRYSTAL_ROWS x PANEL_CRYSTAL_COLS crystals, PANEL_CRYSTAL_LAYOUT lists the crystal
+// id at each tile row by row (-1 for an empty tile). the stitched clusters use panel pixel ids
+// (tile_row * N_ROWS + row) * (PANEL_CRYSTAL_COLS * N_COLS) + tile_col * N_COLS + col, clusters that touch no other crystal
+// are only converted to panel pixel ids. a pixel shared by the halos of joined clusters is written once.
+class ClusterStitcher {
+public:
+    // all crystal_ids must be in PANEL_CRYSTAL_LAYOUT. only the pixels at or above crystals_thresholds[crystal_i][pixel_id]
+    // join clusters across the edges, so the halo pixels of the clusters do not
+    ClusterStitcher(const RunConfig& config, const std::vector<int>& crystal_ids, const std::vector<std::vector<float>>& crystals_thresholds,
+        const int connectivity);
+    // crystals_batches[crystal_i] are the frame ordered clusters of the same frames of each crystal in crystal_ids
+    int stitch(const std::vector<const ClusterBatch*>& crystals_batches, ClusterBatch& panel_batch) const;
+
+private:
+    int connectivity;
+    int n_rows, n_cols;
+    int n_tile_rows, n_tile_cols;
+    int n_panel_rows, n_panel_cols;
+    std::vector<int> crystals_tile_rows, crystals_tile_cols;  // [crystal_i] tile of the crystal in crystal_ids
+    std::vector<std::vector<float>> crystals_thresholds;
+};
+
+// links the clusters of one crystal in nearby frames into events: a cluster joins the open event (or merges the open events)
+// having an above-threshold pixel in common with it at most window frames before. an event is closed and written once
+// none of its pixels were hit in the last window frames. the batches are given in the order of the frames and the state is
+// kept from one batch to the next, so events span the blocks and the flows. finish() closes all events at the end of a raw file.
+// an event is written as a cluster record at its first frame, with one entry per pixel: the hits of a pixel in several frames
+// are summed. the events are written in the order of their first frames.
+class ClusterTemporalLinker {
+public:
+    ClusterTemporalLinker(const int window, const std::vector<float>& pixels_thresholds);
+    int link(const ClusterBatch& batch, ClusterBatch& events);
+    int finish(ClusterBatch& events);
+
+private:
+    struct Event {
+        int first_frame_id;
+        int last_frame_id;
+        std::vector<uint16_t> pixel_ids;
+        std::vector<uint16_t> adus;
+        std::vector<float> energies;
+    };
+    int window;
+    std::vector<float> pixels_thresholds;
+    std::vector<int> pixels_last_frame_ids;  // last frame an above-threshold pixel was hit
+    std::vector<int> pixels_events;          // event of that hit
+    std::vector<int> pixels_entries;         // entry of the pixel in the event being written, -1 otherwise
+    std::vector<Event> events_pool;
+    std::vector<int> free_events;
+    std::vector<int> open_events;
+    std::vector<int> closed_events;          // closed and waiting for the open events that start before them
+    std::vector<int> linked_events;
+    int close_events(const int frame_id, ClusterBatch& events);
+    int write_event(const Event& event, ClusterBatch& events);
+};
+
+// trigger of the frames exported by raw2clusters: a frame is triggered by a cluster of at least min_size pixels whose total
+// energy is in [energy_min, energy_max), and is exported together with the pre frames before and the post frames after it
+struct FrameTrigger {
+    bool enabled = false;
+    int min_size = 1;
+    float energy_min = 0;
+    float energy_max = std::numeric_limits<float>::max();
+    int pre = 0;
+    int post = 0;
+};
+
+// writes the triggered frames of each crystal into triggered_frames_crystal_{}{}.h5 with the datasets frames [n, N_PIXELS] (extendible,
+// chunked and compressed), frame_id and file_index (index of the raw file, rawfiles lists the raw files) of every frame.
+// add_flow() is called for every flow in the order of the frames. the last pre frames of a flow are kept for the triggers at the
+// start of the next flow, and the post frames of the triggers at the end of a flow are taken from the next flow of the same raw file.
+class TriggeredFramesWriter {
+public:
+    TriggeredFramesWriter(const std::string& folder, const std::vector<int>& crystal_ids, const std::string& suffix,
+        const FrameTrigger& trigger, const int n_pixels);
+    ~TriggeredFramesWriter();
+    int begin_rawfile(const std::string& rawfile);
+    // frames_images holds the n_frames frames of the crystal from start_frame_id on, the batches hold its clusters in frame order
+    int add_flow(const int crystal_id, const uint16_t* frames_images, const int start_frame_id, const int n_frames,
+        const std::vector<const ClusterBatch*>& batches);
+    int close();
+
+private:
+    struct CrystalFrames {
+        std::unique_ptr<HighFive::File> file;
+        std::vector<uint16_t> tail_images;  // the last pre frames seen, not yet written
+        std::vector<int> tail_frame_ids;
+        int last_written_frame_id = -1;
+        int post_end_frame_id = -1;         // the frames up to this one follow a trigger
+        std::vector<uint16_t> images;       // staged rows of one flow
+        std::vector<int> frame_ids;
+        std::vector<uint16_t> file_indices;
+    };
+    FrameTrigger trigger;
+    size_t n_pixels;
+    std::vector<std::string> rawfiles;
+    std::vector<CrystalFrames> crystals_frames;
+    std::vector<char> selecteds;
+    bool closed = false;
+};
+
+int decode_clusters(const RunConfig& config, const std::vector<std::string>& compact_files, const std::vector<std::string>& crystals_calibration_files,
+    const std::string& crystals_cluster_folder);
+
+int query_clusters(const std::vector<std::string>& cluster_files, const int file_index, const int start_frame_id, const int end_frame_id,
+    const float min_energy, const float max_energy, const std::string& output_file);
+int recalibrate_clusters(const RunConfig& config, const std::vector<std::string>& cluster_files, const std::string& calibration_file, const std::string& output_folder);
+
 // functional modules
-int raw2frames(const std::vector<std::string> rawfiles, const std::string crystals_frames_folder);
-int raw2spectra(const std::vector<std::string> rawfiles, const std::string crystals_spectra_folder);
-int raw2scatters(const std::vector<std::string>& rawfiles, const std::string crystals_scatters_folder,
-    const std::vector<std::string>& crystals_calibration_files, const std::string process_type);
-int raw2clusters(const std::vector<std::string> rawfiles, const std::string crystals_cluster_folder,
+int raw2frames(const RunConfig& config, const std::vector<std::string> rawfiles, const std::string crystals_frames_folder, const std::string export_mode);
+int raw2spectra(const RunConfig& config, const std::vector<std::string> rawfiles, const std::string crystals_spectra_folder);
+int raw2scatters(const RunConfig& config, const std::vector<std::string>& rawfiles, const std::string crystals_scatters_folder,
+    const std::vector<std::string>& crystals_calibration_files, const std::string process_type, const int cap, const unsigned int seed);
+int raw2clusters(const RunConfig& config, const std::vector<std::string> rawfiles, const std::string crystals_cluster_folder,
     const std::vector<std::string> crystals_calibration_files, const std::vector<std::string> crystals_threshold_files,
-    const bool plot_frames_and_prevent_clear, const bool extended_mode);
+    const bool plot_frames_and_prevent_clear, const int connectivity, const int halo_radius, const std::string output_format,
+    const std::string energy_encoding, const bool histograms_only, const bool stitch, const int temporal_window,
+    const FrameTrigger& frame_trigger);
+
+int transpose(const RunConfig& config, const std::vector<std::string>& rawfiles);
+
+// the stages of the modules on frames in memory, for the Python module
+// the frames images are n_frames frames of one crystal, pixels_spectra holds its N_PIXELS spectra of N_BINS bins and the frame ids of the clusters count from 0
+int frames_images_to_pixels_spectra(const RunConfig& config, const uint16_t* frames_images, const int n_frames, int* pixels_spectra);
+int frames_images_to_clusters(const RunConfig& config, const uint16_t* frames_images, const int n_frames, const int crystal_id,
+    const std::string& calibration_file, const std::string& threshold_file, const int connectivity, const int halo_radius, ClusterBatch& batch);
+
+// the buffers of the functional modules, for plan_flows()
+FlowMemory raw2frames_memory(const RunConfig& config);
+FlowMemory raw2spectra_memory(const RunConfig& config);
+FlowMemory raw2scatters_memory(const RunConfig& config, const int cap);
+FlowMemory raw2clusters_memory(const RunConfig& config, const bool stitch, const int temporal_window, const FrameTrigger& frame_trigger);
+FlowMemory transpose_memory(const RunConfig& config);
 
 // instant API
 // int instant_read(const std::vector<std::string>& rawfiles, const int crystal_id, const int row, const int col, std::string type, std::string output_folder);
-int instant_read_batch(const std::vector<std::string>& rawfiles, const std::vector<int>& crystal_ids, const std::vector<int>& rows, const std::vector<int>& cols, std::string type, std::string output_folder);
+// the values of the pixels over the frames of all raw files, multiple_pixel_values[pixel_i][frame]
+int read_single_pixel_batch(const RunConfig& config, const std::vector<std::string>& rawfiles, const std::vector<int>& crystal_ids, const std::vector<int>& rows, const std::vector<int>& cols, std::vector<std::vector<uint16_t>>& multiple_pixel_values);
+int instant_read_batch(const RunConfig& config, const std::vector<std::string>& rawfiles, const std::vector<int>& crystal_ids, const std::vector<int>& rows, const std::vector<int>& cols, std::string type, std::string output_folder);
+
+// serve
+// runs the jobs sent to a local Unix socket one after another by run_job, which is given the arguments of a command.
+// the config, the pinned threads, the calibration files and the pooled buffers of the process are kept between the jobs
+int serve(const std::string& socket_path, const std::function<int(const std::vector<std::string>&)>& run_job);
 
 // string format
 // template <typename... Args>
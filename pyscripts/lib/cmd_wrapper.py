@@ -1,7 +1,28 @@
+import time
+import socket
+import pathlib
 import subprocess
 
+def run_job(socket_path, args):
+    # send the command to a running "alpha serve" (see serve) and print its output as it comes,
+    # the relative paths of the arguments are relative to the working directory of the server
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as client:
+        client.connect(socket_path)
+        client.sendall(("".join(arg + "\n" for arg in args) + "\n").encode())
+        last_line = None
+        for line in client.makefile("r", encoding="utf-8", errors="replace"):
+            if last_line is not None:
+                print(last_line, end="")
+            last_line = line
+    if last_line is None or not last_line.startswith("exit "):
+        raise RuntimeError("The server closed the connection before the end of the job")
+    return int(last_line[len("exit "):])
+
 def run_cmd(args, kwargs):
+    if kwargs.get('socket') is not None:
+        return run_job(kwargs.get('socket'), args)
     args_config = [] if kwargs.get('config') is None else ['--config', kwargs.get('config')]
+    args_config += [] if kwargs.get('max_memory') is None else ['--max-memory', str(kwargs.get('max_memory'))]
     full_args = ["alpha.exe"] + args_config + args
     cwd = '.' if kwargs.get('cwd') is None else str(kwargs.get('cwd'))
     print("===== Running command: =====")
@@ -16,10 +37,11 @@ def run_cmd(args, kwargs):
     #     print(f"Error occurred: {result.stderr}")
     # return result
 
-def raw2frames(rawfiles, frames_folder, **kwargs):
+def raw2frames(rawfiles, frames_folder, mode="flow", **kwargs):
     args = ["raw2frames"] \
     + ["-i"] + rawfiles \
-    + ["-o", frames_folder]
+    + ["-o", frames_folder] \
+    + ["-m", mode]
     run_cmd(args, kwargs)
 
 def raw2spectra(rawfiles, crystals_spectra_folder, **kwargs):
@@ -29,19 +51,66 @@ def raw2spectra(rawfiles, crystals_spectra_folder, **kwargs):
     + ["-o", crystals_spectra_folder]
     run_cmd(args, kwargs)
 
-def raw2scatters(rawfiles, crystals_scatters_folder, crystals_calibrations, mode, **kwargs):
+def raw2scatters(rawfiles, crystals_scatters_folder, crystals_calibrations, mode, cap=0, seed=0, **kwargs):
     args = ["raw2scatters"] \
         + ["-i"] + rawfiles \
         + ["-o", crystals_scatters_folder] \
         + [elem for calib in crystals_calibrations for elem in ("-c", calib)] \
-        + ["-m", mode]
+        + ["-m", mode] \
+        + ["--cap", str(cap), "--seed", str(seed)]
     run_cmd(args, kwargs)
 
-def raw2clusters(rawfiles, crystals_clusters_folder, crystals_calibrations, crystals_thresholds, extended_mode, **kwargs):
+def raw2clusters(rawfiles, crystals_clusters_folder, crystals_calibrations, crystals_thresholds, extended_mode, connectivity=4, halo=0, output_format="bin", energy_encoding="fixed", histograms_only=False, stitch=False, temporal_window=0, trigger_frames=False, trigger_min_size=1, trigger_energy=(0, 1e30), trigger_pre=0, trigger_post=0, **kwargs):
     args = ["raw2clusters"] \
     + ["-i"] + rawfiles \
     + ["-o", crystals_clusters_folder] \
     + [elem for crystal_calibration in crystals_calibrations for elem in ("-c", crystal_calibration)] \
     + [elem for crystal_threshold in crystals_thresholds for elem in ("-t", crystal_threshold)] \
-    + (["--extended_mode"] if extended_mode else [])
-    run_cmd(args, kwargs)
\ No newline at end of file
+    + (["--extended_mode"] if extended_mode else []) \
+    + ["--connectivity", str(connectivity), "--halo", str(halo)] \
+    + ["--format", output_format, "--energy_encoding", energy_encoding] \
+    + (["--histograms_only"] if histograms_only else []) \
+    + (["--stitch"] if stitch else []) \
+    + ["--temporal_window", str(temporal_window)] \
+    + (["--trigger_frames", "--trigger_min_size", str(trigger_min_size), "--trigger_energy", f"{trigger_energy[0]},{trigger_energy[1]}",
+        "--trigger_pre", str(trigger_pre), "--trigger_post", str(trigger_post)] if trigger_frames else [])
+    run_cmd(args, kwargs)
+
+
+def recalibrate_clusters(cluster_files, calibration, output_folder=None, **kwargs):
+    args = ["recalibrate-clusters"] \
+    + ["-i"] + cluster_files \
+    + ["-c", calibration] \
+    + (["-o", output_folder] if output_folder else [])
+    run_cmd(args, kwargs)
+
+def transpose(rawfiles, **kwargs):
+    args = ["transpose"] \
+    + ["-i"] + rawfiles
+    run_cmd(args, kwargs)
+
+def instant(rawfiles, crystal_ids, rows, cols, data_type, output_folder, **kwargs):
+    args = ["instant"] \
+    + ["-i"] + rawfiles \
+    + ["--crystal_ids", ",".join(str(crystal_id) for crystal_id in crystal_ids)] \
+    + ["--rows", ",".join(str(row) for row in rows)] \
+    + ["--cols", ",".join(str(col) for col in cols)] \
+    + ["-t", data_type, "-o", output_folder]
+    run_cmd(args, kwargs)
+
+def serve(socket_path, **kwargs):
+    # start "alpha serve" in the background, the commands above are sent to it with socket=socket_path.
+    # the config and memory budget of the server are used for all jobs
+    args_config = [] if kwargs.get('config') is None else ['--config', kwargs.get('config')]
+    args_config += [] if kwargs.get('max_memory') is None else ['--max-memory', str(kwargs.get('max_memory'))]
+    cwd = '.' if kwargs.get('cwd') is None else str(kwargs.get('cwd'))
+    process = subprocess.Popen(["alpha.exe"] + args_config + ["serve", "-s", socket_path], cwd=cwd)
+    # the config is read and the socket created before the first job can be sent
+    socket_file = pathlib.Path(cwd) / socket_path
+    while not socket_file.exists() and process.poll() is None:
+        time.sleep(0.1)
+    return process
+
+def stop_server(socket_path):
+    # the server stops after the jobs sent before
+    return run_job(socket_path, ["shutdown"])
@@ -123,6 +123,78 @@ def read_clusters_fast(filename):
 
     return clusters
 
+def read_cluster_index(filename):
+    """
+    Read the index written by raw2clusters next to each cluster file ({cluster file}.idx)
+
+    Returns a dictionary with
+        'files':  list of (byte_offset, first_record, rawfile), where each raw file starts in the cluster file
+        'blocks': structured array with byte_offset, first_record, n_records, file_index,
+                  min_frame_id, max_frame_id, min_energy, max_energy of every block of records
+    """
+    with open(filename, 'rb') as f:
+        magic, version, block_records, n_files, n_blocks, n_records, n_bytes = struct.unpack("<4sIIIQQQ", f.read(40))
+        if magic != b"CIDX" or version != 1:
+            raise ValueError(f"Not a cluster index file: {filename}")
+        files = []
+        for _ in range(n_files):
+            byte_offset, first_record, path_length = struct.unpack("<QQI", f.read(20))
+            files.append((byte_offset, first_record, f.read(path_length).decode()))
+        block_dtype = np.dtype([('byte_offset', '<u8'), ('first_record', '<u8'), ('n_records', '<u4'), ('file_index', '<u4'),
+                                ('min_frame_id', '<i4'), ('max_frame_id', '<i4'), ('min_energy', '<f4'), ('max_energy', '<f4')])
+        blocks = np.fromfile(f, dtype=block_dtype, count=n_blocks)
+    return {'block_records': block_records, 'n_records': n_records, 'n_bytes': n_bytes, 'files': files, 'blocks': blocks}
+
+def read_clusters_h5(filename, n_pixels=None):
+    """
+    Reader for the columnar output of raw2clusters --format h5 (clusters_crystal_{c}.h5)
+
+    Returns a dictionary with one entry per cluster in 'frame_ids', 'file_indices', 'sizes' and 'offsets',
+    and the flat pixel columns 'pixel_ids', 'adus' and 'energies'; the pixels of cluster i are
+    [offsets[i], offsets[i] + sizes[i]). With n_pixels given, only clusters of that size are returned,
+    and the pixel columns are reshaped to (n_pixels, n_clusters) like read_clusters_fast.
+    """
+    import h5py
+
+    with h5py.File(filename, 'r') as f:
+        clusters = {
+            'frame_ids': f['frame_id'][:],
+            'file_indices': f['file_index'][:],
+            'sizes': f['size'][:],
+            'offsets': f['offset'][:],
+            'rawfiles': [name.decode() if isinstance(name, bytes) else name for name in f['rawfiles'][:]],
+        }
+        pixel_ids, adus, energies = f['pixel_id'][:], f['adu'][:], f['energy'][:]
+
+    if n_pixels is None:
+        clusters.update({'pixel_ids': pixel_ids, 'adus': adus, 'energies': energies})
+        return clusters
+
+    selected = clusters['sizes'] == n_pixels
+    pixel_indices = clusters['offsets'][selected][None, :] + np.arange(n_pixels)[:, None]
+    for key in ['frame_ids', 'file_indices', 'sizes', 'offsets']:
+        clusters[key] = clusters[key][selected]
+    clusters.update({
+        'pixel_ids': pixel_ids[pixel_indices].astype(np.int32),
+        'adus': adus[pixel_indices].astype(np.int32),
+        'energies': energies[pixel_indices],
+    })
+    return clusters
+
+def read_cluster_histograms(filename):
+    """
+    Reader for the histograms written by raw2clusters (cluster_histograms_crystal_{c}.h5)
+
+    Returns a dictionary with 'energy_bins' (left edges of the total energy bins), 'energy_vs_size'
+    (counts of shape (MAX_EVENT_PIXELS + 1, n_bins), row k for clusters of k + 1 pixels and the last row
+    for larger clusters), 'pixels_single_counts' (single-pixel clusters per pixel) and 'multiplicity'
+    (frames by number of clusters, the last bin includes all larger numbers).
+    """
+    import h5py
+
+    with h5py.File(filename, 'r') as f:
+        return {key: f[key][:] for key in ('energy_bins', 'energy_vs_size', 'pixels_single_counts', 'multiplicity')}
+
 def write_clusters(filename, clusters):
     with open(filename, "wb") as file:
         for cluster in clusters:
@@ -150,4 +222,4 @@ if __name__ == "__main__":
         adus = clusters_dict['adus'][:, i]
         energies = clusters_dict['energies'][:, i]
         cluster = Cluster(frame_id, pixel_ids, adus, energies)
-        print(cluster)
\ No newline at end of file
+        print(cluster)
@@ -2,7 +2,8 @@ import h5py
 import numpy as np
 import matplotlib.pyplot as plt
 
-from lib.read_clusters import read_clusters_fast
+import os
+from lib.read_clusters import read_clusters_fast, read_cluster_index
 
 # frames_filepath = r"H:\alpha_spect_mini\20241120_EneCalib_Co57_150fps_-500V_7hrs\panel_1\crystals_frames\frames_0_40000_crystal_0.h5"
 # calibrations_filepath = r"H:\alpha_spect_mini\calibration_results\panel_1\calibration_crystal_0_new.h5"
@@ -23,9 +24,14 @@ with h5py.File(calibrations_filepath, 'r') as f:
 erg_frames = frames * slopes.T + intercepts.T  # Convert to energy using calibration of crystal 1
 
 clusters_npixels_dict = {}
+first_file_ending_indices = {}
 for n_pixels in range(1, 10):
     clusters_filepath = clusters_folderpath + rf"\clusters_crystal_0_pixel_{n_pixels}.bin"
     clusters_npixels_dict[n_pixels] = read_clusters_fast(clusters_filepath)
+    # the index tells where the clusters of the second raw file start, older outputs have no index
+    if os.path.exists(clusters_filepath + ".idx"):
+        files = read_cluster_index(clusters_filepath + ".idx")['files']
+        first_file_ending_indices[n_pixels] = files[1][1] if len(files) > 1 else len(clusters_npixels_dict[n_pixels]['frame_ids'])
 
 bad_pixels = np.where(~isvalids)[0]
 bad_pixels_rows = bad_pixels // shape[1]
@@ -44,7 +50,10 @@ for frame_id in range(0, n_frames):
     # Get clusters corresponding to this frame
     for n_pixels in [1, 2, 3, 4, 5, 6, 7, 8, 9]:
         clusters_dict = clusters_npixels_dict[n_pixels]
-        first_file_ending_index = np.where(clusters_dict['frame_ids'][1:] < clusters_dict['frame_ids'][:-1])[0][0]
+        if n_pixels in first_file_ending_indices:
+            first_file_ending_index = first_file_ending_indices[n_pixels]
+        else:
+            first_file_ending_index = np.where(clusters_dict['frame_ids'][1:] < clusters_dict['frame_ids'][:-1])[0][0]
 
         cluster_indices = np.where(clusters_dict['frame_ids'] == frame_id)[0]
         cluster_indices = cluster_indices[cluster_indices < first_file_ending_index]
@@ -0,0 +1,68 @@
+#include <algorithm>
+#include <utility>
+#include <functional>
+
+#include "header.hpp"
+
+AsyncWriter::AsyncWriter(const size_t max_pending) : max_pending(std::max<size_t>(max_pending, 1)) {
+    thread = std::thread(&AsyncWriter::run, this);
+}
+
+AsyncWriter::~AsyncWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    thread.join();
+}
+
+size_t AsyncWriter::submit(std::function<void()> job) {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [&] { return jobs.size() < max_pending || error; });
+    if (error) std::rethrow_exception(error);
+    jobs.push_back(std::move(job));
+    changed.notify_all();
+    return n_submitted++;
+}
+
+void AsyncWriter::wait(const size_t job_id) {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [&] { return n_done > job_id || error; });
+    if (error) std::rethrow_exception(error);
+}
+
+void AsyncWriter::finish() {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [&] { return n_done == n_submitted || error; });
+    if (error) std::rethrow_exception(error);
+}
+
+void AsyncWriter::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        changed.wait(lock, [&] { return !jobs.empty() || stopping; });
+        if (jobs.empty()) return;
+        std::function<void()> job = std::move(jobs.front());
+        jobs.pop_front();
+        changed.notify_all();
+        const bool skip = static_cast<bool>(error);
+        lock.unlock();
+
+        // the job is also destroyed here, so the files and buffers it owns are released on the writer thread
+        std::exception_ptr job_error;
+        if (!skip) {
+            try {
+                job();
+            } catch (...) {
+                job_error = std::current_exception();
+            }
+        }
+        job = nullptr;
+
+        lock.lock();
+        if (job_error && !error) error = job_error;
+        n_done++;
+        changed.notify_all();
+    }
+}
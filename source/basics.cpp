@@ -1,6 +1,9 @@
 #include <vector>
 #include <string>
+#include <map>
+#include <mutex>
 #include <stdexcept>
+#include <filesystem>
 #include "highfive/HighFive.hpp"
 
 #include "header.hpp"
@@ -13,9 +16,49 @@ std::vector<float> create_bins(unsigned int n_bins, float low, float high) {
     return bins;
 }
 
+// the calibration and threshold files read by the process, kept while the file is unchanged (same size and write time),
+// so that the jobs of alpha serve read each file once
+struct FileStamp {
+    std::filesystem::file_time_type write_time;
+    uintmax_t size = 0;
+    bool operator==(const FileStamp& other) const { return write_time == other.write_time && size == other.size; }
+};
+struct CachedCalibrations {
+    FileStamp stamp;
+    std::vector<std::vector<float>> pixels_calibrations;
+    std::vector<std::vector<float>> pixels_peaks;
+    std::vector<uint8_t> pixels_isvalids;
+    std::vector<float> pixels_thresholds;
+    bool has_peaks = false, has_isvalids = false, has_thresholds = false;  // the optional datasets in the file
+};
+struct CachedThresholds {
+    FileStamp stamp;
+    std::vector<float> pixels_thresholds;
+};
+static std::mutex cache_mutex;
+static std::map<std::string, CachedCalibrations> cached_calibrations;
+static std::map<std::string, CachedThresholds> cached_thresholds;
+
+static FileStamp file_stamp(const std::string& filename) {
+    FileStamp stamp;
+    std::error_code error;
+    stamp.write_time = std::filesystem::last_write_time(filename, error);
+    stamp.size = std::filesystem::file_size(filename, error);
+    return stamp;
+}
+
 int read_pixels_thresholds(const std::string filename, std::vector<float>& pixels_thresholds) {
-    HighFive::File file(filename, HighFive::File::ReadOnly);
-    file.getDataSet("pixels_thresholds").read(pixels_thresholds);
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    const FileStamp stamp = file_stamp(filename);
+    auto it = cached_thresholds.find(filename);
+    if (it == cached_thresholds.end() || !(it->second.stamp == stamp)) {
+        CachedThresholds cached;
+        cached.stamp = stamp;
+        HighFive::File file(filename, HighFive::File::ReadOnly);
+        file.getDataSet("pixels_thresholds").read(cached.pixels_thresholds);
+        it = cached_thresholds.insert_or_assign(filename, std::move(cached)).first;
+    }
+    pixels_thresholds = it->second.pixels_thresholds;
     return 0;
 }
 
@@ -24,11 +67,28 @@ int read_pixels_calibrations(const std::string filename,
     std::vector<std::vector<float>>& pixels_peaks,
     std::vector<uint8_t>& pixels_isvalids,
     std::vector<float>& pixels_thresholds) {
-    HighFive::File file(filename, HighFive::File::ReadOnly);
-    file.getDataSet("pixels_calibrations").read(pixels_calibrations);
-    // optional datasets
-    if (file.exist("pixels_peaks")) file.getDataSet("pixels_peaks").read(pixels_peaks);
-    if (file.exist("pixels_isvalids")) file.getDataSet("pixels_isvalids").read(pixels_isvalids);
-    if (file.exist("pixels_thresholds")) file.getDataSet("pixels_thresholds").read(pixels_thresholds);
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    const FileStamp stamp = file_stamp(filename);
+    auto it = cached_calibrations.find(filename);
+    if (it == cached_calibrations.end() || !(it->second.stamp == stamp)) {
+        CachedCalibrations cached;
+        cached.stamp = stamp;
+        HighFive::File file(filename, HighFive::File::ReadOnly);
+        file.getDataSet("pixels_calibrations").read(cached.pixels_calibrations);
+        // optional datasets
+        cached.has_peaks = file.exist("pixels_peaks");
+        cached.has_isvalids = file.exist("pixels_isvalids");
+        cached.has_thresholds = file.exist("pixels_thresholds");
+        if (cached.has_peaks) file.getDataSet("pixels_peaks").read(cached.pixels_peaks);
+        if (cached.has_isvalids) file.getDataSet("pixels_isvalids").read(cached.pixels_isvalids);
+        if (cached.has_thresholds) file.getDataSet("pixels_thresholds").read(cached.pixels_thresholds);
+        it = cached_calibrations.insert_or_assign(filename, std::move(cached)).first;
+    }
+    // the optional datasets which are not in the file leave the vectors as they are
+    const CachedCalibrations& cached = it->second;
+    pixels_calibrations = cached.pixels_calibrations;
+    if (cached.has_peaks) pixels_peaks = cached.pixels_peaks;
+    if (cached.has_isvalids) pixels_isvalids = cached.pixels_isvalids;
+    if (cached.has_thresholds) pixels_thresholds = cached.pixels_thresholds;
     return 0;
 }
@@ -0,0 +1,279 @@
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <filesystem>
+#include <stdexcept>
+
+#include "header.hpp"
+
+// file layout: char[4] "CCMP", uint32 version, int32 crystal_id, uint32 store_energies, followed by blocks.
+// every block starts with uint8 type and uint32 payload size:
+//   type 0, a new raw file starts: the path of the raw file
+//   type 1, clusters: uint32 n_records, int32 first_frame_id, then for every record
+//           varint(frame_id - previous frame_id), varint(num_pixels), varint(first pixel_id),
+//           zigzag varint(pixel_id - first pixel_id) for the other pixels, varint(adu) for every pixel,
+//           and varint(round(energy / COMPACT_ENERGY_UNIT)) for every pixel if energies are stored.
+static const char COMPACT_MAGIC[4] = { 'C', 'C', 'M', 'P' };
+static const uint32_t COMPACT_VERSION = 1;
+static const uint8_t COMPACT_BLOCK_RAWFILE = 0;
+static const uint8_t COMPACT_BLOCK_CLUSTERS = 1;
+
+// a block is written when it holds this many records
+static const uint32_t COMPACT_BLOCK_RECORDS = 4096;
+
+static inline void put_varint(std::vector<uint8_t>& buffer, uint32_t value) {
+    while (value >= 0x80) {
+        buffer.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    buffer.push_back(static_cast<uint8_t>(value));
+}
+
+static inline uint32_t get_varint(const uint8_t*& position, const uint8_t* end) {
+    uint32_t value = 0;
+    for (int shift = 0; position < end && shift < 35; shift += 7) {
+        uint8_t byte = *position++;
+        value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+    throw std::runtime_error("Corrupted varint in compact cluster file");
+}
+
+static inline uint32_t zigzag(int32_t value) { return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31); }
+static inline int32_t unzigzag(uint32_t value) { return static_cast<int32_t>(value >> 1) ^ -static_cast<int32_t>(value & 1); }
+
+ClusterCompactWriter::ClusterCompactWriter(const std::string& folder, const std::vector<int>& crystal_ids, const std::string& suffix,
+    const std::string& energy_encoding, const std::string& stem) {
+
+    if (energy_encoding != "omit" && energy_encoding != "fixed")
+        throw std::invalid_argument("Energy encoding must be omit or fixed, got " + energy_encoding);
+    store_energies = energy_encoding == "fixed";
+
+    int n_crystals = 0;
+    for (auto crystal_id : crystal_ids) n_crystals = std::max(n_crystals, crystal_id + 1);
+    crystals_streams.resize(n_crystals);
+
+    for (auto crystal_id : crystal_ids) {
+        std::string cluster_file = format_string("{}\\{}_{}{}.cbin", folder, stem, crystal_id, suffix);
+        CrystalStream& crystal_stream = crystals_streams[crystal_id];
+        crystal_stream.stream.open(cluster_file, std::ios::binary | std::ios::trunc);
+        if (!crystal_stream.stream.is_open()) throw std::runtime_error("Cannot open: " + cluster_file);
+        const uint32_t store = store_energies ? 1 : 0;
+        const int32_t file_crystal_id = crystal_id;
+        crystal_stream.stream.write(COMPACT_MAGIC, 4);
+        crystal_stream.stream.write(reinterpret_cast<const char*>(&COMPACT_VERSION), 4);
+        crystal_stream.stream.write(reinterpret_cast<const char*>(&file_crystal_id), 4);
+        crystal_stream.stream.write(reinterpret_cast<const char*>(&store), 4);
+    }
+}
+
+ClusterCompactWriter::~ClusterCompactWriter() {
+    close();
+}
+
+int ClusterCompactWriter::write_block(CrystalStream& crystal_stream) {
+    if (crystal_stream.n_records == 0) return 0;
+    const uint32_t payload_size = static_cast<uint32_t>(crystal_stream.block.size());
+    crystal_stream.stream.put(static_cast<char>(COMPACT_BLOCK_CLUSTERS));
+    crystal_stream.stream.write(reinterpret_cast<const char*>(&payload_size), 4);
+    crystal_stream.stream.write(reinterpret_cast<const char*>(crystal_stream.block.data()), payload_size);
+    crystal_stream.block.clear();
+    crystal_stream.n_records = 0;
+    return 0;
+}
+
+int ClusterCompactWriter::begin_rawfile(const std::string& rawfile) {
+    // frame ids restart for every raw file, so blocks never span two raw files
+    for (auto& crystal_stream : crystals_streams) {
+        if (!crystal_stream.stream.is_open()) continue;
+        write_block(crystal_stream);
+        const uint32_t payload_size = static_cast<uint32_t>(rawfile.size());
+        crystal_stream.stream.put(static_cast<char>(COMPACT_BLOCK_RAWFILE));
+        crystal_stream.stream.write(reinterpret_cast<const char*>(&payload_size), 4);
+        crystal_stream.stream.write(rawfile.data(), payload_size);
+    }
+    return 0;
+}
+
+int ClusterCompactWriter::write(int crystal_id, const ClusterBatch& batch) {
+
+    CrystalStream& crystal_stream = crystals_streams[crystal_id];
+    if (!crystal_stream.stream.is_open()) throw std::runtime_error(format_string("No cluster file opened for crystal {}", crystal_id));
+
+    std::vector<uint8_t>& block = crystal_stream.block;
+    for (size_t cluster_i = 0; cluster_i < batch.size(); cluster_i++) {
+
+        // the block payload starts with n_records and first_frame_id, n_records is filled in when the block is complete
+        const int frame_id = batch.frame_ids[cluster_i];
+        if (crystal_stream.n_records == 0) {
+            block.resize(8);
+            std::memcpy(block.data() + 4, &frame_id, 4);
+            crystal_stream.last_frame_id = frame_id;
+        }
+
+        const uint32_t num_pixels = batch.cluster_size(cluster_i);
+        const size_t offset = batch.offsets[cluster_i];
+        const int seed_pixel_id = batch.pixel_ids[offset];
+        put_varint(block, static_cast<uint32_t>(frame_id - crystal_stream.last_frame_id));
+        put_varint(block, num_pixels);
+        put_varint(block, static_cast<uint32_t>(seed_pixel_id));
+        for (uint32_t pixel_i = 1; pixel_i < num_pixels; pixel_i++)
+            put_varint(block, zigzag(static_cast<int32_t>(batch.pixel_ids[offset + pixel_i]) - seed_pixel_id));
+        for (uint32_t pixel_i = 0; pixel_i < num_pixels; pixel_i++)
+            put_varint(block, batch.adus[offset + pixel_i]);
+        if (store_energies)
+            for (uint32_t pixel_i = 0; pixel_i < num_pixels; pixel_i++)
+                put_varint(block, static_cast<uint32_t>(std::lround(batch.energies[offset + pixel_i] / COMPACT_ENERGY_UNIT)));
+        crystal_stream.last_frame_id = frame_id;
+
+        crystal_stream.n_records++;
+        std::memcpy(block.data(), &crystal_stream.n_records, 4);
+        if (crystal_stream.n_records == COMPACT_BLOCK_RECORDS) write_block(crystal_stream);
+    }
+    return 0;
+}
+
+int ClusterCompactWriter::flush() {
+    for (auto& crystal_stream : crystals_streams)
+        if (crystal_stream.stream.is_open()) crystal_stream.stream.flush();
+    return 0;
+}
+
+int ClusterCompactWriter::close() {
+    if (closed) return 0;
+    for (auto& crystal_stream : crystals_streams) {
+        if (!crystal_stream.stream.is_open()) continue;
+        write_block(crystal_stream);
+        crystal_stream.stream.close();
+    }
+    closed = true;
+    return 0;
+}
+
+ClusterCompactReader::ClusterCompactReader(const std::string& filename) : stream(filename, std::ios::binary) {
+    if (!stream.is_open()) throw std::runtime_error("Cannot open: " + filename);
+    char magic[4];
+    uint32_t version, store;
+    int32_t crystal_id;
+    stream.read(magic, 4);
+    stream.read(reinterpret_cast<char*>(&version), 4);
+    stream.read(reinterpret_cast<char*>(&crystal_id), 4);
+    stream.read(reinterpret_cast<char*>(&store), 4);
+    if (!stream || std::memcmp(magic, COMPACT_MAGIC, 4) != 0 || version != COMPACT_VERSION)
+        throw std::runtime_error("Not a compact cluster file: " + filename);
+    file_crystal_id = crystal_id;
+    store_energies = store != 0;
+}
+
+bool ClusterCompactReader::read_block(ClusterBatch& batch, std::string& rawfile) {
+
+    batch.clear();
+    rawfile.clear();
+    char type;
+    uint32_t payload_size;
+    if (!stream.get(type)) return false;
+    stream.read(reinterpret_cast<char*>(&payload_size), 4);
+    block.resize(payload_size);
+    stream.read(reinterpret_cast<char*>(block.data()), payload_size);
+    if (!stream) throw std::runtime_error("Truncated compact cluster file");
+
+    if (type == COMPACT_BLOCK_RAWFILE) {
+        rawfile.assign(block.begin(), block.end());
+        return true;
+    }
+
+    const uint8_t* position = block.data() + 8;
+    const uint8_t* end = block.data() + block.size();
+    uint32_t n_records;
+    int frame_id;
+    std::memcpy(&n_records, block.data(), 4);
+    std::memcpy(&frame_id, block.data() + 4, 4);
+    for (uint32_t record_i = 0; record_i < n_records; record_i++) {
+        frame_id += static_cast<int>(get_varint(position, end));
+        const uint32_t num_pixels = get_varint(position, end);
+        const int seed_pixel_id = static_cast<int>(get_varint(position, end));
+        const size_t offset = batch.pixel_ids.size();
+        batch.pixel_ids.push_back(static_cast<uint16_t>(seed_pixel_id));
+        for (uint32_t pixel_i = 1; pixel_i < num_pixels; pixel_i++)
+            batch.pixel_ids.push_back(static_cast<uint16_t>(seed_pixel_id + unzigzag(get_varint(position, end))));
+        for (uint32_t pixel_i = 0; pixel_i < num_pixels; pixel_i++)
+            batch.adus.push_back(static_cast<uint16_t>(get_varint(position, end)));
+        if (store_energies)
+            for (uint32_t pixel_i = 0; pixel_i < num_pixels; pixel_i++)
+                batch.energies.push_back(get_varint(position, end) * COMPACT_ENERGY_UNIT);
+        batch.frame_ids.push_back(frame_id);
+        batch.offsets.push_back(static_cast<uint32_t>(offset + num_pixels));
+    }
+    return true;
+}
+
+// decode compact cluster files into the usual cluster files (one per crystal and cluster size, with index)
+// energies which are not stored are recomputed from the calibration file of the crystal, exactly as raw2clusters does
+int decode_clusters(const RunConfig& config, const std::vector<std::string>& compact_files, const std::vector<std::string>& crystals_calibration_files,
+    const std::string& crystals_cluster_folder) {
+
+    if (!std::filesystem::exists(crystals_cluster_folder))
+        std::filesystem::create_directory(crystals_cluster_folder);
+
+    for (const auto& compact_file : compact_files) {
+        ClusterCompactReader reader(compact_file);
+        const int crystal_id = reader.crystal_id();
+        std::cout << format_string("Decoding clusters of crystal {} from {} ...", crystal_id, compact_file) << std::endl;
+
+        // the stem and the suffix of the compact file (e.g. clusters_panel and _extended) are kept for the decoded files
+        const std::string file_stem = std::filesystem::path(compact_file).stem().string();
+        std::string stem = "clusters_crystal", suffix;
+        for (const std::string unit_stem : { "clusters_crystal", "clusters_panel" }) {
+            const std::string prefix = format_string("{}_{}", unit_stem, crystal_id);
+            if (file_stem.rfind(prefix, 0) != 0) continue;
+            stem = unit_stem;
+            suffix = file_stem.substr(prefix.size());
+        }
+
+        std::vector<float> pixels_slopes, pixels_offsets;
+        if (!reader.has_energies()) {
+            if (stem != "clusters_crystal")
+                throw std::invalid_argument("Energies are not stored, the panel clusters cannot be recalibrated: " + compact_file);
+            if (crystal_id >= static_cast<int>(crystals_calibration_files.size()) || crystals_calibration_files[crystal_id] == "skip")
+                throw std::invalid_argument(format_string("Energies are not stored, a calibration file is needed for crystal {}", crystal_id));
+            std::vector<std::vector<float>> pixels_calibrations, pixels_peaks;
+            std::vector<uint8_t> pixels_isvalids;
+            std::vector<float> pixels_thresholds;
+            read_pixels_calibrations(crystals_calibration_files[crystal_id], pixels_calibrations, pixels_peaks, pixels_isvalids, pixels_thresholds);
+            for (const auto& pixel_calibration : pixels_calibrations) {
+                pixels_slopes.push_back(pixel_calibration[0]);
+                pixels_offsets.push_back(pixel_calibration[1]);
+            }
+        }
+
+        ClusterWriter writer(crystals_cluster_folder, { crystal_id }, config.max_event_pixels, suffix, true, stem);
+
+        ClusterBatch batch;
+        std::string rawfile;
+        size_t n_clusters = 0;
+        while (reader.read_block(batch, rawfile)) {
+            if (!rawfile.empty()) {
+                writer.begin_rawfile(rawfile);
+                continue;
+            }
+            if (!reader.has_energies()) {
+                batch.energies.resize(batch.adus.size());
+                for (size_t pixel_i = 0; pixel_i < batch.adus.size(); pixel_i++) {
+                    const int pixel_id = batch.pixel_ids[pixel_i];
+                    float energy = pixels_slopes[pixel_id] * batch.adus[pixel_i] + pixels_offsets[pixel_id];
+                    batch.energies[pixel_i] = energy > 0 ? energy : 0;
+                }
+            }
+            writer.write(crystal_id, batch);
+            n_clusters += batch.size();
+        }
+        writer.close();
+        std::cout << format_string("Decoded {} clusters of crystal {}", n_clusters, crystal_id) << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,135 @@
+#include <string>
+#include <vector>
+#include <cctype>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <filesystem>
+#include <limits>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "header.hpp"
+
+// without --max-memory a flow may use this part of the available RAM, and never more frames than MAX_FRAMES_SIZE
+static const double DEFAULT_MEMORY_FRACTION = 0.75;
+// every task of a clustering block should keep its frames in its share of the L3 cache
+static const int MIN_BLOCK_FRAMES = 16;
+static const int MAX_BLOCK_FRAMES = 1024;
+
+static const size_t MB = static_cast<size_t>(1) << 20;
+
+// the RAM which can be allocated without swapping and the size of the L3 cache, 0 if unknown
+#ifdef _WIN32
+
+static size_t available_memory_bytes() {
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    if (!GlobalMemoryStatusEx(&status)) return 0;
+    return static_cast<size_t>(status.ullAvailPhys);
+}
+
+static size_t l3_cache_bytes() {
+    DWORD length = 0;
+    GetLogicalProcessorInformation(NULL, &length);
+    std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> infos(length / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+    if (infos.empty() || !GetLogicalProcessorInformation(infos.data(), &length)) return 0;
+    size_t size = 0;
+    for (const auto& info : infos)
+        if (info.Relationship == RelationCache && info.Cache.Level == 3) size = std::max<size_t>(size, info.Cache.Size);
+    return size;
+}
+
+#else
+
+static size_t available_memory_bytes() {
+    std::ifstream meminfo("/proc/meminfo");
+    std::string key, unit;
+    size_t value = 0;
+    while (meminfo >> key >> value >> unit)
+        if (key == "MemAvailable:") return value * 1024;
+    const long n_pages = sysconf(_SC_AVPHYS_PAGES), page_size = sysconf(_SC_PAGE_SIZE);
+    return n_pages > 0 && page_size > 0 ? static_cast<size_t>(n_pages) * page_size : 0;
+}
+
+static size_t l3_cache_bytes() {
+#ifdef _SC_LEVEL3_CACHE_SIZE
+    const long size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (size > 0) return static_cast<size_t>(size);
+#endif
+    std::ifstream cache("/sys/devices/system/cpu/cpu0/cache/index3/size");
+    size_t value = 0;
+    std::string unit;
+    if (!(cache >> value)) return 0;
+    cache >> unit;
+    return unit == "M" ? value * MB : value * 1024;
+}
+
+#endif
+
+// a size in MB, or with a K, M, G or T suffix
+size_t parse_memory_size(const std::string& text) {
+    size_t n_chars = 0;
+    double value = 0;
+    try {
+        value = std::stod(text, &n_chars);
+    } catch (const std::exception&) {
+        throw std::invalid_argument("Invalid memory size: " + text);
+    }
+    const std::string suffix = text.substr(n_chars);
+    const char unit = suffix.empty() ? 'M' : static_cast<char>(std::toupper(static_cast<unsigned char>(suffix[0])));
+    if (value <= 0 || suffix.size() > 2 || (suffix.size() == 2 && std::toupper(static_cast<unsigned char>(suffix[1])) != 'B'))
+        throw std::invalid_argument("Invalid memory size: " + text);
+    const size_t scales[] = { size_t(1) << 10, size_t(1) << 20, size_t(1) << 30, size_t(1) << 40 };
+    const std::string units = "KMGT";
+    if (units.find(unit) == std::string::npos) throw std::invalid_argument("Invalid memory size: " + text);
+    return static_cast<size_t>(value * scales[units.find(unit)]);
+}
+
+// the flow is as long as the budget allows after the buffers which do not depend on it, but never longer than the largest raw file.
+// the clustering blocks are sized so that the frames of all threads' blocks fit in the L3 cache.
+int plan_flows(RunConfig& config, const FlowMemory& memory, const std::vector<std::string>& rawfiles, const size_t max_memory) {
+
+    const size_t available = available_memory_bytes();
+    const size_t l3_size = l3_cache_bytes();
+    const size_t fixed_bytes = memory.fixed_bytes + rawfile_read_buffer_bytes(config);
+    const size_t frame_bytes = std::max<size_t>(memory.frame_bytes, 1);
+
+    size_t n_file_frames = 1;
+    for (const auto& rawfile : rawfiles) {
+        std::error_code error;
+        const size_t file_size = std::filesystem::file_size(rawfile, error);
+        if (!error) n_file_frames = std::max(n_file_frames, file_size / config.frame_size() / sizeof(uint16_t));
+    }
+
+    size_t n_frames = config.max_frames_size;
+    size_t budget = 0;
+    if (max_memory > 0 || available > 0) {
+        budget = max_memory > 0 ? max_memory : static_cast<size_t>(available * DEFAULT_MEMORY_FRACTION);
+        if (budget < fixed_bytes + frame_bytes)
+            throw std::runtime_error(format_string("The memory budget of {} MB is too small, at least {} MB are needed", budget / MB, (fixed_bytes + frame_bytes + MB - 1) / MB));
+        n_frames = (budget - fixed_bytes) / frame_bytes;
+        if (max_memory == 0) n_frames = std::min<size_t>(n_frames, config.max_frames_size);
+    }
+    n_frames = std::min({ n_frames, n_file_frames, static_cast<size_t>(std::numeric_limits<int>::max()) / config.n_pixels });
+    config.max_frames_size = static_cast<int>(n_frames);
+    set_buffer_pool_limit(fixed_bytes + n_frames * frame_bytes);
+
+    // the largest power of two that fits, 256 frames if the cache size is unknown
+    if (l3_size > 0) {
+        const size_t n_cache_frames = l3_size / config.n_threads / (static_cast<size_t>(config.n_pixels) * sizeof(uint16_t));
+        int block_frames = MIN_BLOCK_FRAMES;
+        while (block_frames * 2 <= MAX_BLOCK_FRAMES && static_cast<size_t>(block_frames) * 2 <= n_cache_frames) block_frames *= 2;
+        config.block_frames = block_frames;
+    }
+
+    std::cout << format_string("Flow plan: {} frames per flow, {} MB of buffers ({} MB fixed and {} MB for the frames)",
+        config.max_frames_size, (fixed_bytes + n_frames * frame_bytes) / MB, fixed_bytes / MB, n_frames * frame_bytes / MB) << std::endl;
+    std::cout << format_string("Flow plan: budget {} MB ({}), {} MB available, L3 cache {} KB, {} frames per block",
+        budget / MB, max_memory > 0 ? "--max-memory" : (budget > 0 ? "default" : "MAX_FRAMES_SIZE"), available / MB, l3_size / 1024, config.block_frames) << std::endl;
+    return 0;
+}
@@ -7,131 +7,112 @@
 #include <algorithm>
 #include <filesystem>
 #include <numeric>
-#include <windows.h>
+#include <memory>
+#include <omp.h>
 
 #include "header.hpp"
 
+// number of frames of one file read by one task
+static const size_t INSTANT_BLOCK_FRAMES = 4096;
 
+int read_single_pixel_batch(const RunConfig& config, const std::vector<std::string>& rawfiles, const std::vector<int>& crystal_ids, const std::vector<int>& rows, const std::vector<int>& cols, std::vector<std::vector<uint16_t>>& multiple_pixel_values) {
 
-uint16_t* mmap_windows(const std::string& path, size_t& file_size, HANDLE& hMap)
-{
-    HANDLE hFile = CreateFileA(path.c_str(),
-        GENERIC_READ, FILE_SHARE_READ,
-        NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    const std::vector<int>& pixel_order_vec = config.pixel_order;
 
-    if (hFile == INVALID_HANDLE_VALUE) {
-        return nullptr;
-    }
-
-    LARGE_INTEGER size;
-    if (!GetFileSizeEx(hFile, &size)) {
-        CloseHandle(hFile);
-        return nullptr;
-    }
-
-    file_size = static_cast<size_t>(size.QuadPart);   // 64-bit OK
-
-    hMap = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
-    CloseHandle(hFile);
-
-    if (!hMap) {
-        return nullptr;
-    }
-
-    return (uint16_t*)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
-}
-
-int read_single_pixel_batch(const std::vector<std::string>& rawfiles, const std::vector<int>& crystal_ids, const std::vector<int>& rows, const std::vector<int>& cols, std::vector<std::vector<uint16_t>>& multiple_pixel_values) {
-
-    static std::vector<int> pixel_order_vec(global_config["N_PIXELS_PREMERGE"][0]);
-    compute_pixel_order(
-        global_config["N_COLS_PREMERGE"][0], global_config["N_ROWS_PREMERGE"][0],
-        global_config["N_READOUT_PIXELS"][0], global_config["N_READOUT_GROUPS"][0],
-        global_config["N_PIXELS_PREMERGE"][0], global_config["N_PIXELS"][0],
-        global_config["ROW_MERGE_FOLD"][0], global_config["COL_MERGE_FOLD"][0],
-        global_config["ROW_MERGE_INDEX"][0], global_config["COL_MERGE_INDEX"][0],
-        global_config["N_COLS"][0],
-        pixel_order_vec.data()
-    );
-
-    // only the position of the pixel in the pixel array
-    int n_pixels = crystal_ids.size();
-    std::vector<int> pixel_position_offsets(n_pixels, 0);  // the offset of this pixel in the flattened pixel array
-    for (int i = 0; i < n_pixels; ++i) {
-        int pixel_id = rows[i] * global_config["N_COLS"][0] + cols[i];
-        for (int index = 0; index < global_config["N_PIXELS_PREMERGE"][0]; ++index) {
-            if (pixel_order_vec[index] == pixel_id) {
-                pixel_position_offsets[i] = index;
-                break;
-            }
-        }
-    }
+    // the position of each pixel in the pixel array, from the inverse of the pixel order
+    std::vector<int> pixels_positions(config.n_pixels, -1);
+    for (int index = 0; index < config.n_pixels_premerge; ++index)
+        if (pixel_order_vec[index] != -1) pixels_positions[pixel_order_vec[index]] = index;
 
     // cause every crystal's same position pixel is stored together
-    // the offset in every single file
+    // the offset in every single frame
+    int n_pixels = crystal_ids.size();
+    std::vector<size_t> pixel_position_offsets(n_pixels, 0);
     for (int i = 0; i < n_pixels; ++i) {
-        pixel_position_offsets[i] = pixel_position_offsets[i] * global_config["N_CRYSTALS"][0] + crystal_ids[i]; 
+        int pixel_id = rows[i] * config.n_cols + cols[i];
+        if (crystal_ids[i] < 0 || crystal_ids[i] >= config.n_crystals || rows[i] < 0 || rows[i] >= config.n_rows
+            || cols[i] < 0 || cols[i] >= config.n_cols || pixels_positions[pixel_id] == -1)
+            throw std::invalid_argument(format_string("Invalid pixel: crystal {}, row {}, col {}", crystal_ids[i], rows[i], cols[i]));
+        pixel_position_offsets[i] = static_cast<size_t>(pixels_positions[pixel_id]) * config.n_crystals + crystal_ids[i];
     }
 
-    // calculate total number of frames
-    std::vector<size_t> n_frames_per_file;
-    int offset_per_frame = global_config["N_CRYSTALS"][0] * global_config["N_PIXELS_PREMERGE"][0];
-    for (const auto& rawfile : rawfiles) {
-        std::ifstream file(rawfile, std::ios::binary);
-        if (!file.is_open()) {
+    // the pixels are read in the order of their offsets, so that every frame is walked forward
+    std::vector<int> sorted_pixels(n_pixels);
+    std::iota(sorted_pixels.begin(), sorted_pixels.end(), 0);
+    std::sort(sorted_pixels.begin(), sorted_pixels.end(), [&](int a, int b) { return pixel_position_offsets[a] < pixel_position_offsets[b]; });
+    std::vector<size_t> sorted_offsets(n_pixels);
+    for (int i = 0; i < n_pixels; ++i) sorted_offsets[i] = pixel_position_offsets[sorted_pixels[i]];
+
+    // map the files and calculate total number of frames, a missing file counts as a file without frames
+    const size_t offset_per_frame = config.frame_size();
+    std::vector<std::unique_ptr<MappedFile>> mapped_files(rawfiles.size());
+    std::vector<std::unique_ptr<TransposedRawfile>> transposed_files(rawfiles.size());
+    std::vector<size_t> n_frames_per_file(rawfiles.size(), 0);
+    for (size_t file_i = 0; file_i < rawfiles.size(); ++file_i) {
+        const auto& rawfile = rawfiles[file_i];
+        if (!std::filesystem::is_regular_file(rawfile)) {
             std::cerr << "Error opening file: " << rawfile << std::endl;
             continue;
         }
-        file.seekg(0, std::ios::end);
-        size_t file_size = file.tellg();
-        size_t n_frames_in_file = file_size / offset_per_frame / sizeof(uint16_t);
-        n_frames_per_file.push_back(n_frames_in_file);
-        file.close();
+        // the transposed copy of the raw file gives each pixel in one piece per block of frames
+        if (TransposedRawfile::available(config, rawfile)) {
+            transposed_files[file_i] = std::make_unique<TransposedRawfile>(rawfile);
+            n_frames_per_file[file_i] = transposed_files[file_i]->n_frames();
+        } else {
+            mapped_files[file_i] = std::make_unique<MappedFile>(rawfile, false);
+            n_frames_per_file[file_i] = mapped_files[file_i]->size() / offset_per_frame / sizeof(uint16_t);
+        }
     }
-    size_t n_frames_total = std::accumulate(n_frames_per_file.begin(), n_frames_per_file.end(), 0ULL);
+    std::vector<size_t> file_frame_start_indices(rawfiles.size() + 1, 0);
+    std::partial_sum(n_frames_per_file.begin(), n_frames_per_file.end(), file_frame_start_indices.begin() + 1);
+    const size_t n_frames_total = file_frame_start_indices.back();
 
     // resize the data structure to hold all pixel values
     multiple_pixel_values.assign(n_pixels, std::vector<uint16_t>(n_frames_total));
 
-    // read each pixel one by one
-    int file_frame_start_index = 0;
-    uint16_t pixel_value;
-    for (int file_i = 0; file_i < rawfiles.size(); ++file_i) {
-        const auto& rawfile = rawfiles[file_i];
-        std::cout << "Reading file " << file_i + 1 << " / " << rawfiles.size() << ": " << rawfile << "\n";
-
-        size_t file_size_get;
-        HANDLE hMap;
-        uint16_t* file_ptr = mmap_windows(rawfile, file_size_get, hMap);
-        if (file_size_get != n_frames_per_file[file_i] * offset_per_frame * sizeof(uint16_t)) {
-            std::cout << "sizeof(void*) = " << sizeof(void*) << "\n";
-            std::cerr << "Error: file size mismatch for file: " << rawfile << std::endl;
-            std::cerr << "Expected size: " << n_frames_per_file[file_i] * offset_per_frame << ", got: " << file_size_get << std::endl;
-            UnmapViewOfFile(file_ptr);
-            CloseHandle(hMap);
+    // the transposed files are read by tasks of one pixel of one file, the raw files by tasks of a block of frames of one file
+    std::vector<std::array<size_t, 3>> tasks;  // file_i, start frame, end frame (start pixel, end pixel of a transposed file)
+    for (size_t file_i = 0; file_i < rawfiles.size(); ++file_i) {
+        if (transposed_files[file_i]) {
+            for (int pixel_i = 0; pixel_i < n_pixels; ++pixel_i)
+                tasks.push_back({ file_i, static_cast<size_t>(pixel_i), static_cast<size_t>(pixel_i) + 1 });
             continue;
         }
-         
-        for (size_t frame_id = 0; frame_id < n_frames_per_file[file_i]; ++frame_id) {
-            file_ptr += offset_per_frame;  // move to the next frame start
-            for (int pixel_i = 0; pixel_i < n_pixels; ++pixel_i) {
-                multiple_pixel_values[pixel_i][file_frame_start_index + frame_id] = *(file_ptr + pixel_position_offsets[pixel_i]);
-            }
-        }
+        for (size_t start_frame = 0; start_frame < n_frames_per_file[file_i]; start_frame += INSTANT_BLOCK_FRAMES)
+            tasks.push_back({ file_i, start_frame, std::min(start_frame + INSTANT_BLOCK_FRAMES, n_frames_per_file[file_i]) });
+    }
 
-        UnmapViewOfFile(file_ptr);
-        CloseHandle(hMap);
-        file_frame_start_index += n_frames_per_file[file_i];
-        std::cout << "Finished reading file " << file_i + 1 << " / " << rawfiles.size() << "\n";
+    std::cout << format_string("Reading {} pixels over {} frames from {} files ...", n_pixels, n_frames_total, rawfiles.size()) << std::endl;
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(config.n_threads)
+    for (int task_i = 0; task_i < static_cast<int>(tasks.size()); ++task_i) {
+        const size_t file_i = tasks[task_i][0];
+        if (transposed_files[file_i]) {
+            for (size_t pixel_i = tasks[task_i][1]; pixel_i < tasks[task_i][2]; ++pixel_i)
+                transposed_files[file_i]->read_pixel(crystal_ids[pixel_i], rows[pixel_i] * config.n_cols + cols[pixel_i],
+                    multiple_pixel_values[pixel_i].data() + file_frame_start_indices[file_i]);
+            continue;
+        }
+        const uint16_t* file_ptr = reinterpret_cast<const uint16_t*>(mapped_files[file_i]->data());
+        const size_t file_frame_start_index = file_frame_start_indices[file_i];
+        for (size_t frame_id = tasks[task_i][1]; frame_id < tasks[task_i][2]; ++frame_id) {
+            const uint16_t* frame_ptr = file_ptr + frame_id * offset_per_frame;
+            for (int i = 0; i < n_pixels; ++i)
+                multiple_pixel_values[sorted_pixels[i]][file_frame_start_index + frame_id] = frame_ptr[sorted_offsets[i]];
+        }
     }
 
     return 0;
 }
 
-int instant_read_batch(const std::vector<std::string>& rawfiles, const std::vector<int>& crystal_ids, const std::vector<int>& rows, const std::vector<int>& cols, std::string type, std::string output_folder) {
+int instant_read_batch(const RunConfig& config, const std::vector<std::string>& rawfiles, const std::vector<int>& crystal_ids, const std::vector<int>& rows, const std::vector<int>& cols, std::string type, std::string output_folder) {
+
+    if (crystal_ids.size() != rows.size() || crystal_ids.size() != cols.size())
+        throw std::invalid_argument("The numbers of crystal ids, rows and columns must be the same");
+    if (!std::filesystem::exists(output_folder))
+        std::filesystem::create_directories(output_folder);
 
     std::vector<std::vector<uint16_t>> pixel_values;
-    read_single_pixel_batch(rawfiles, crystal_ids, rows, cols, pixel_values);
+    read_single_pixel_batch(config, rawfiles, crystal_ids, rows, cols, pixel_values);
 
     if (type == "scatter") {
         // compute and save scatter plot
@@ -139,21 +120,25 @@ int instant_read_batch(const std::vector<std::string>& rawfiles, const std::vect
             int crystal_id = crystal_ids[i];
             int row = rows[i];
             int col = cols[i];
-            std::string output_path = output_folder + "/crystal_" + std::to_string(crystal_id) + "_pixel_" + std::to_string(row) + "_" + std::to_string(col) + "_scatter.bin";
+            std::string output_path = (std::filesystem::path(output_folder) / format_string("crystal_{}_pixel_{}_{}_scatter.bin", crystal_id, row, col)).string();
             std::ofstream outfile(output_path, std::ios::binary);
             outfile.write(reinterpret_cast<const char*>(pixel_values[i].data()), pixel_values[i].size() * sizeof(uint16_t));
             outfile.close();
             std::cout << "Scatter data saved to " << output_path << "\n";
         }
     } else if (type == "spectrum") {
-        // compute and save spectrum plot
-        std::vector<float> bins = create_bins(global_config["N_BINS"][0], global_config["ADU_MIN"][0], global_config["ADU_MAX"][0]);
-        static const std::vector<size_t> lookup_table = compute_adu_lookup_table(bins);
-
-        std::vector<uint32_t> spectrum(global_config["N_BINS"][0], 0);
-        for (const auto& values : pixel_values) {
-            for (const auto& value : values) {
-                spectrum[lookup_table[static_cast<size_t>(value - global_config["ADU_MIN"][0])]]++;
+        // compute and save the spectrum of each pixel, values out of [ADU_MIN, ADU_MAX) are not counted
+        std::vector<float> bins = create_bins(config.n_bins, config.adu_min, config.adu_max);
+        const std::vector<size_t> lookup_table = compute_adu_lookup_table(config, bins);
+        const int adu_min = config.adu_min;
+        const int adu_max = config.adu_max;
+
+        std::vector<std::vector<uint32_t>> spectra(crystal_ids.size(), std::vector<uint32_t>(config.n_bins, 0));
+        #pragma omp parallel for num_threads(config.n_threads)
+        for (int i = 0; i < static_cast<int>(crystal_ids.size()); ++i) {
+            for (const auto& value : pixel_values[i]) {
+                if (value < adu_min || value >= adu_max) continue;
+                spectra[i][lookup_table[static_cast<size_t>(value - adu_min)]]++;
             }
         }
 
@@ -161,12 +146,12 @@ int instant_read_batch(const std::vector<std::string>& rawfiles, const std::vect
             int crystal_id = crystal_ids[i];
             int row = rows[i];
             int col = cols[i];
-            std::string output_path = output_folder + "/crystal_" + std::to_string(crystal_id) + "_pixel_" + std::to_string(row) + "_" + std::to_string(col) + "_spectrum.bin";
+            std::string output_path = (std::filesystem::path(output_folder) / format_string("crystal_{}_pixel_{}_{}_spectrum.bin", crystal_id, row, col)).string();
             std::ofstream outfile(output_path, std::ios::binary);
-            outfile.write(reinterpret_cast<const char*>(spectrum.data()), spectrum.size() * sizeof(uint32_t));
+            outfile.write(reinterpret_cast<const char*>(spectra[i].data()), spectra[i].size() * sizeof(uint32_t));
             outfile.close();
             std::cout << "Spectrum data saved to " << output_path << "\n";
         }
     }
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,225 @@
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <omp.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "header.hpp"
+
+static size_t round_up(const size_t size, const size_t alignment) {
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+#ifdef _WIN32
+
+// large pages need the "Lock pages in memory" privilege, without it VirtualAlloc fails and normal pages are used
+LargeBuffer::LargeBuffer(const size_t size) : n_bytes(size) {
+    if (size == 0) return;
+    const size_t large_page_size = GetLargePageMinimum();
+    if (large_page_size > 0) {
+        mapped_bytes = round_up(size, large_page_size);
+        pointer = VirtualAlloc(NULL, mapped_bytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        kind = Pages::huge;
+    }
+    if (pointer == nullptr) {
+        mapped_bytes = size;
+        pointer = VirtualAlloc(NULL, mapped_bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        kind = Pages::normal;
+    }
+    if (pointer == nullptr) throw std::bad_alloc();
+}
+
+void LargeBuffer::free() {
+    if (pointer != nullptr) VirtualFree(pointer, 0, MEM_RELEASE);
+    pointer = nullptr;
+}
+
+#else
+
+// explicit huge pages come from the pool reserved in /proc/sys/vm/nr_hugepages, if it is empty the mapping is aligned to
+// HUGE_PAGE_SIZE and marked for transparent huge pages
+static const size_t HUGE_PAGE_SIZE = static_cast<size_t>(2) << 20;
+
+LargeBuffer::LargeBuffer(const size_t size) : n_bytes(size) {
+    if (size == 0) return;
+    mapped_bytes = round_up(size, HUGE_PAGE_SIZE);
+    void* mapped = mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mapped != MAP_FAILED) {
+        pointer = mapped;
+        kind = Pages::huge;
+        return;
+    }
+
+    mapped = mmap(nullptr, mapped_bytes + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) throw std::bad_alloc();
+    char* start = static_cast<char*>(mapped);
+    char* aligned = reinterpret_cast<char*>(round_up(reinterpret_cast<uintptr_t>(start), HUGE_PAGE_SIZE));
+    if (aligned > start) munmap(start, aligned - start);
+    if (aligned + mapped_bytes < start + mapped_bytes + HUGE_PAGE_SIZE) munmap(aligned + mapped_bytes, start + HUGE_PAGE_SIZE - aligned);
+    pointer = aligned;
+    kind = Pages::normal;
+#ifdef MADV_HUGEPAGE
+    if (madvise(pointer, mapped_bytes, MADV_HUGEPAGE) == 0) kind = Pages::transparent_huge;
+#endif
+}
+
+void LargeBuffer::free() {
+    if (pointer != nullptr) munmap(pointer, mapped_bytes);
+    pointer = nullptr;
+}
+
+#endif
+
+LargeBuffer::~LargeBuffer() {
+    free();
+}
+
+LargeBuffer::LargeBuffer(LargeBuffer&& other) noexcept
+    : pointer(std::exchange(other.pointer, nullptr)), n_bytes(other.n_bytes), mapped_bytes(other.mapped_bytes), kind(other.kind) {
+}
+
+LargeBuffer& LargeBuffer::operator=(LargeBuffer&& other) noexcept {
+    if (this != &other) {
+        free();
+        pointer = std::exchange(other.pointer, nullptr);
+        n_bytes = other.n_bytes;
+        mapped_bytes = other.mapped_bytes;
+        kind = other.kind;
+    }
+    return *this;
+}
+
+const char* LargeBuffer::pages_name() const {
+    switch (kind) {
+    case Pages::huge: return "huge pages";
+    case Pages::transparent_huge: return "transparent huge pages";
+    default: return "normal pages";
+    }
+}
+
+// the pool of released buffers, oldest first, and the counts of the buffers handed out
+static std::mutex pool_mutex;
+static std::vector<LargeBuffer> pool_buffers;
+static size_t pool_bytes = 0;
+static size_t pool_max_bytes = std::numeric_limits<size_t>::max();
+static size_t n_pool_reuses = 0;
+static size_t pool_allocations[3] = { 0, 0, 0 };  // by LargeBuffer::Pages
+
+// frees the oldest released buffers until the pool fits in pool_max_bytes, with pool_mutex held
+static void trim_buffer_pool() {
+    size_t n_freed = 0;
+    while (n_freed < pool_buffers.size() && pool_bytes > pool_max_bytes) pool_bytes -= pool_buffers[n_freed++].size();
+    pool_buffers.erase(pool_buffers.begin(), pool_buffers.begin() + n_freed);
+}
+
+// the smallest released buffer large enough is taken, the buffer keeps its size when it is given back
+PooledBuffer::PooledBuffer(const size_t size) {
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        auto best = pool_buffers.end();
+        for (auto it = pool_buffers.begin(); it != pool_buffers.end(); ++it)
+            if (it->size() >= size && (best == pool_buffers.end() || it->size() < best->size())) best = it;
+        if (best != pool_buffers.end()) {
+            pool_bytes -= best->size();
+            buffer = std::move(*best);
+            pool_buffers.erase(best);
+            n_pool_reuses++;
+            return;
+        }
+    }
+    buffer = LargeBuffer(size);
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    pool_allocations[static_cast<int>(buffer.pages())]++;
+}
+
+PooledBuffer::~PooledBuffer() {
+    if (buffer.data() == nullptr) return;
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    pool_bytes += buffer.size();
+    pool_buffers.push_back(std::move(buffer));
+    trim_buffer_pool();
+}
+
+void set_buffer_pool_limit(const size_t max_bytes) {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    pool_max_bytes = max_bytes;
+    trim_buffer_pool();
+}
+
+void clear_buffer_pool() {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    pool_buffers.clear();
+    pool_bytes = 0;
+    pool_max_bytes = std::numeric_limits<size_t>::max();
+    n_pool_reuses = 0;
+    std::fill(std::begin(pool_allocations), std::end(pool_allocations), 0);
+}
+
+std::string buffer_pool_summary() {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    return format_string("{} buffers allocated ({} with huge pages, {} with transparent huge pages, {} with normal pages), {} reused",
+        pool_allocations[0] + pool_allocations[1] + pool_allocations[2], pool_allocations[static_cast<int>(LargeBuffer::Pages::huge)],
+        pool_allocations[static_cast<int>(LargeBuffer::Pages::transparent_huge)], pool_allocations[static_cast<int>(LargeBuffer::Pages::normal)], n_pool_reuses);
+}
+
+#ifdef _WIN32
+
+TlbMissCounter::TlbMissCounter(const RunConfig& /*config*/) {
+}
+
+TlbMissCounter::~TlbMissCounter() {
+}
+
+uint64_t TlbMissCounter::read() const {
+    return 0;
+}
+
+#else
+
+// every thread opens the counter of its own misses
+TlbMissCounter::TlbMissCounter(const RunConfig& config) {
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    std::vector<int> threads_fds(config.n_threads, -1);
+    #pragma omp parallel num_threads(config.n_threads)
+    threads_fds[omp_get_thread_num()] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    // the counts would be partial without the counters of all threads
+    const bool all_opened = std::find(threads_fds.begin(), threads_fds.end(), -1) == threads_fds.end();
+    for (int fd : threads_fds) {
+        if (all_opened) fds.push_back(fd);
+        else if (fd >= 0) close(fd);
+    }
+}
+
+TlbMissCounter::~TlbMissCounter() {
+    for (int fd : fds) close(fd);
+}
+
+uint64_t TlbMissCounter::read() const {
+    uint64_t n_misses = 0;
+    for (int fd : fds) {
+        uint64_t count = 0;
+        if (::read(fd, &count, sizeof(count)) == sizeof(count)) n_misses += count;
+    }
+    return n_misses;
+}
+
+#endif
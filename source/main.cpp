@@ -2,27 +2,31 @@
 #include <string>
 #include <fstream>
 #include <vector>
+#include <algorithm>
 #include "cxxopts.hpp"
 #include "header.hpp"
 
-int main(int argc, char* argv[]) {
-
-    if (argc <= 2) {
-        std::cout << "Usage: " << argv[0] << " <command> [options]\n";
-        std::cout << "Available commands: raw2spectra, raw2scatters, and raw2clusters\n";
-        return 0;
-    }
+// runs one command with its arguments, on a copy of the config since plan_flows() and set_active_crystals() change it for
+// the command. args[0] is the command name, which cxxopts skips as the program name, and the options follow it
+static int run_command(RunConfig config, const std::string& config_filepath, const size_t max_memory, const TlbMissCounter& tlb_misses,
+    const std::string& command, std::vector<char*> args) {
+
+    // the buffers and the TLB misses of the commands reading raw files by flows, the counters run for the whole process
+    // so only the misses since the start of this command are reported
+    const uint64_t tlb_misses_start = tlb_misses.read();
+    auto report_buffers = [&]() {
+        std::cout << "Buffers: " << buffer_pool_summary() << "\n";
+        if (tlb_misses.available()) std::cout << "dTLB load misses: " << tlb_misses.read() - tlb_misses_start << std::endl;
+        else std::cout << "dTLB load misses: not available" << std::endl;
+    };
+    // the crystals whose calibration file is not "skip", only they are read from the raw files
+    auto active_crystal_ids = [&](const std::vector<std::string>& crystals_calibration_files) {
+        std::vector<int> crystal_ids;
+        for (int crystal_id = 0; crystal_id < std::min<int>(config.n_crystals, crystals_calibration_files.size()); crystal_id++)
+            if (crystals_calibration_files[crystal_id] != "skip") crystal_ids.push_back(crystal_id);
+        return crystal_ids;
+    };
 
-    // Check for config argument
-    std::string config_filepath = "config.txt";
-    if (std::string(argv[1]) == "--config")
-        config_filepath = argv[2];
-    global_config = read_config(config_filepath, false);
-    
-    // Shift arguments if config is provided
-    int shift = (std::string(argv[1]) == "--config") ? 2 : 0;
-    std::string command = argv[1 + shift];  // the first is the subcommand
-    std::vector<char*> args(argv + 2 + shift, argv + argc); // the remaining arguments
     std::cout << "Executing command: " << command << " with config file: " << config_filepath << "\n" << std::endl;
 
     if (command == "raw2frames") {
@@ -30,10 +34,12 @@ int main(int argc, char* argv[]) {
         cxxopts::Options options("alpha raw2frames", "Convert rawfiles to frames");
         std::vector<std::string> rawfiles;
         std::string crystals_frames_folder;
+        std::string export_mode;
 
         options.add_options()
             ("i,input", "Raw input files", cxxopts::value<std::vector<std::string>>(rawfiles))
             ("o,output", "Output folder", cxxopts::value<std::string>(crystals_frames_folder)->default_value("frames"))
+            ("m,mode", "Export mode: flow (one file per flow and crystal) or file (one compressed file per raw file and crystal)", cxxopts::value<std::string>(export_mode)->default_value("flow"))
             ("h,help", "Print usage");
         options.parse_positional({"input"});
         auto result = options.parse(args.size(), args.data());
@@ -46,8 +52,11 @@ int main(int argc, char* argv[]) {
         for (const auto& file : rawfiles)
             std::cout << "- [" << file << "]" << std::endl;
         std::cout << "Output: " << crystals_frames_folder << "\n";
+        std::cout << "Mode: " << export_mode << "\n";
 
-        raw2frames(rawfiles, crystals_frames_folder);
+        plan_flows(config, raw2frames_memory(config), rawfiles, max_memory);
+        raw2frames(config, rawfiles, crystals_frames_folder, export_mode);
+        report_buffers();
 
         return 0;
     }
@@ -74,7 +83,9 @@ int main(int argc, char* argv[]) {
             std::cout << "- [" << file << "]" << std::endl;
         std::cout << "Output: " << crystals_spectra_folder << "\n";
 
-        raw2spectra(rawfiles, crystals_spectra_folder);
+        plan_flows(config, raw2spectra_memory(config), rawfiles, max_memory);
+        raw2spectra(config, rawfiles, crystals_spectra_folder);
+        report_buffers();
 
         return 0;
     } 
@@ -87,12 +98,16 @@ int main(int argc, char* argv[]) {
         std::vector<std::string> crystals_calibration_files;
         std::string crystals_scatters_folder;
         std::string mode;
+        int cap = 0;
+        unsigned int seed = 0;
 
         options.add_options()
             ("i,input", "Raw input files", cxxopts::value<std::vector<std::string>>(rawfiles))
             ("c,calibration", "Use calibration files", cxxopts::value<std::vector<std::string>>(crystals_calibration_files))
             ("o,output", "Output folder", cxxopts::value<std::string>(crystals_scatters_folder)->default_value("scatters"))
             ("m,mode", "Process mode", cxxopts::value<std::string>(mode)->default_value("random"))
+            ("cap", "Keep at most this many values per pixel, sampled uniformly over the run (0 for all values)", cxxopts::value<int>(cap)->default_value("0"))
+            ("seed", "Seed of the random pixel selection and sampling", cxxopts::value<unsigned int>(seed)->default_value("0"))
             ("h,help", "Print usage");
         options.parse_positional({"input", "calibration"});
         auto result = options.parse(args.size(), args.data());
@@ -110,9 +125,13 @@ int main(int argc, char* argv[]) {
             std::cout << "- [" << file << "]" << std::endl;
         std::cout << "Output: " << crystals_scatters_folder << "\n";
         std::cout << "Mode: " << mode << "\n";
+        if (cap > 0) std::cout << "Cap: " << cap << " values per pixel, seed: " << seed << "\n";
 
 
-        raw2scatters(rawfiles, crystals_scatters_folder, crystals_calibration_files, mode);
+        config.set_active_crystals(active_crystal_ids(crystals_calibration_files));
+        plan_flows(config, raw2scatters_memory(config, cap), rawfiles, max_memory);
+        raw2scatters(config, rawfiles, crystals_scatters_folder, crystals_calibration_files, mode, cap, seed);
+        report_buffers();
         return 0;
     }
 
@@ -124,13 +143,34 @@ int main(int argc, char* argv[]) {
         std::vector<std::string> crystals_threshold_files;
         std::string crystals_cluster_folder;
         bool extended_mode = false;
+        int connectivity = 4;
+        int halo_radius = 0;
+        std::string output_format;
+        std::string energy_encoding;
+        bool histograms_only = false;
+        bool stitch = false;
+        int temporal_window = 0;
+        FrameTrigger frame_trigger;
+        std::vector<float> trigger_energies;
 
         options.add_options()
             ("i,input", "Raw input files", cxxopts::value<std::vector<std::string>>(rawfiles))
             ("c,calibration", "Use calibration files", cxxopts::value<std::vector<std::string>>(crystals_calibration_files))
             ("t,threshold", "Use threshold files", cxxopts::value<std::vector<std::string>>(crystals_threshold_files))
             ("o,output", "Output folder", cxxopts::value<std::string>(crystals_cluster_folder)->default_value("clusters"))
-            ("e,extended_mode", "Enable output exteneded clusters", cxxopts::value<bool>(extended_mode)->default_value("false")->implicit_value("true"))
+            ("e,extended_mode", "Enable output exteneded clusters (same as --halo 1)", cxxopts::value<bool>(extended_mode)->default_value("false")->implicit_value("true"))
+            ("connectivity", "Pixels connectivity for clustering (4 or 8)", cxxopts::value<int>(connectivity)->default_value("4"))
+            ("halo", "Number of rings of neighboring pixels added to each cluster", cxxopts::value<int>(halo_radius)->default_value("0"))
+            ("f,format", "Output format: bin (one file per cluster size), h5 (columns in one file per crystal) or compact (encoded file per crystal)", cxxopts::value<std::string>(output_format)->default_value("bin"))
+            ("energy_encoding", "Energies in compact format: fixed (fixed-point) or omit (recomputed from calibration by decode-clusters)", cxxopts::value<std::string>(energy_encoding)->default_value("fixed"))
+            ("histograms_only", "Only write the cluster histograms, no cluster files", cxxopts::value<bool>(histograms_only)->default_value("false")->implicit_value("true"))
+            ("stitch", "Also write the clusters stitched across the crystal edges of the panel", cxxopts::value<bool>(stitch)->default_value("false")->implicit_value("true"))
+            ("temporal_window", "Also write the clusters linked across frames, over this number of frames (0 for none)", cxxopts::value<int>(temporal_window)->default_value("0"))
+            ("trigger_frames", "Also write the frames having a cluster that meets the trigger", cxxopts::value<bool>(frame_trigger.enabled)->default_value("false")->implicit_value("true"))
+            ("trigger_min_size", "Minimum number of pixels of a triggering cluster", cxxopts::value<int>(frame_trigger.min_size)->default_value("1"))
+            ("trigger_energy", "Total energy window of a triggering cluster: min,max", cxxopts::value<std::vector<float>>(trigger_energies)->default_value("0,1e30"))
+            ("trigger_pre", "Number of frames written before a triggered frame", cxxopts::value<int>(frame_trigger.pre)->default_value("0"))
+            ("trigger_post", "Number of frames written after a triggered frame", cxxopts::value<int>(frame_trigger.post)->default_value("0"))
             ("h,help", "Print usage");
         options.parse_positional({"input", "calibration", "threshold"});
         auto result = options.parse(args.size(), args.data());
@@ -149,11 +189,158 @@ int main(int argc, char* argv[]) {
         for (const auto& file : crystals_threshold_files)
             std::cout << "- [" << file << "]" << std::endl;
         std::cout << "Output: " << crystals_cluster_folder << "\n";
-        std::cout << "Extended mode: " << (extended_mode ? "true" : "false") << "\n";
+        if (extended_mode && halo_radius == 0) halo_radius = 1;
+        std::cout << "Extended mode: " << (halo_radius > 0 ? "true" : "false") << "\n";
+        std::cout << "Connectivity: " << connectivity << ", halo radius: " << halo_radius << "\n";
+        std::cout << "Output format: " << output_format << "\n";
+        if (output_format == "compact") std::cout << "Energy encoding: " << energy_encoding << "\n";
+        if (histograms_only) std::cout << "Histograms only: true\n";
+        if (stitch) std::cout << "Stitch crystals: true\n";
+        if (temporal_window > 0) std::cout << "Temporal window: " << temporal_window << " frames\n";
+        if (trigger_energies.size() != 2) {
+            std::cout << "Trigger energy window needs exactly 2 values\n";
+            return 1;
+        }
+        frame_trigger.energy_min = trigger_energies[0];
+        frame_trigger.energy_max = trigger_energies[1];
+        if (frame_trigger.enabled)
+            std::cout << "Trigger frames: clusters of at least " << frame_trigger.min_size << " pixels with energies from " << frame_trigger.energy_min
+                << " to " << frame_trigger.energy_max << ", " << frame_trigger.pre << " frames before and " << frame_trigger.post << " after\n";
+
+
+        config.set_active_crystals(active_crystal_ids(crystals_calibration_files));
+        plan_flows(config, raw2clusters_memory(config, stitch, temporal_window, frame_trigger), rawfiles, max_memory);
+        raw2clusters(config, rawfiles, crystals_cluster_folder,
+            crystals_calibration_files, crystals_threshold_files, true, connectivity, halo_radius, output_format, energy_encoding, histograms_only, stitch, temporal_window,
+            frame_trigger);
+        report_buffers();
+
+        return 0;
+    }
 
+    if (command == "query-clusters") {
 
-        raw2clusters(rawfiles, crystals_cluster_folder,
-            crystals_calibration_files, crystals_threshold_files, true, extended_mode);
+        cxxopts::Options options("alpha query-clusters", "Select clusters by frame range and energy window using the index files");
+        std::vector<std::string> cluster_files;
+        std::vector<int> frames;
+        std::vector<float> energies;
+        int file_index;
+        std::string output_file;
+
+        options.add_options()
+            ("i,input", "Cluster files", cxxopts::value<std::vector<std::string>>(cluster_files))
+            ("f,frames", "Frame range: start,end (end excluded)", cxxopts::value<std::vector<int>>(frames)->default_value("0,2147483647"))
+            ("e,energy", "Total energy window: min,max", cxxopts::value<std::vector<float>>(energies)->default_value("0,1e30"))
+            ("r,rawfile_index", "Index of the raw file the frames belong to, -1 for all", cxxopts::value<int>(file_index)->default_value("-1"))
+            ("o,output", "Output cluster file", cxxopts::value<std::string>(output_file)->default_value("query_clusters.bin"))
+            ("h,help", "Print usage");
+        options.parse_positional({"input"});
+        auto result = options.parse(args.size(), args.data());
+        if (result.count("help")) {
+            std::cout << options.help() << std::endl;
+            return 0;
+        }
+        if (frames.size() != 2 || energies.size() != 2) {
+            std::cout << "Frame range and energy window need exactly 2 values each\n";
+            return 1;
+        }
+
+        std::cout << "Found " << cluster_files.size() << " cluster files:" << std::endl;
+        for (const auto& file : cluster_files)
+            std::cout << "- [" << file << "]" << std::endl;
+        std::cout << "Raw file index: " << file_index << ", frames: " << frames[0] << " to " << frames[1]
+            << ", energy: " << energies[0] << " to " << energies[1] << "\n";
+        std::cout << "Output: " << output_file << "\n";
+
+        query_clusters(cluster_files, file_index, frames[0], frames[1], energies[0], energies[1], output_file);
+
+        return 0;
+    }
+
+    if (command == "decode-clusters") {
+
+        cxxopts::Options options("alpha decode-clusters", "Decode compact cluster files into cluster files per size");
+        std::vector<std::string> compact_files;
+        std::vector<std::string> crystals_calibration_files;
+        std::string crystals_cluster_folder;
+
+        options.add_options()
+            ("i,input", "Compact cluster files", cxxopts::value<std::vector<std::string>>(compact_files))
+            ("c,calibration", "Use calibration files (needed if energies were omitted)", cxxopts::value<std::vector<std::string>>(crystals_calibration_files))
+            ("o,output", "Output folder", cxxopts::value<std::string>(crystals_cluster_folder)->default_value("clusters"))
+            ("h,help", "Print usage");
+        options.parse_positional({"input"});
+        auto result = options.parse(args.size(), args.data());
+        if (result.count("help")) {
+            std::cout << options.help() << std::endl;
+            return 0;
+        }
+
+        std::cout << "Found " << compact_files.size() << " compact cluster files:" << std::endl;
+        for (const auto& file : compact_files)
+            std::cout << "- [" << file << "]" << std::endl;
+        std::cout << "Found " << crystals_calibration_files.size() << " calibration files:" << std::endl;
+        for (const auto& file : crystals_calibration_files)
+            std::cout << "- [" << file << "]" << std::endl;
+        std::cout << "Output: " << crystals_cluster_folder << "\n";
+
+        decode_clusters(config, compact_files, crystals_calibration_files, crystals_cluster_folder);
+
+        return 0;
+    }
+
+    if (command == "recalibrate-clusters") {
+
+        cxxopts::Options options("alpha recalibrate-clusters", "Recompute cluster energies with a new calibration file");
+        std::vector<std::string> cluster_files;
+        std::string calibration_file;
+        std::string output_folder;
+
+        options.add_options()
+            ("i,input", "Cluster files (.bin) of one crystal", cxxopts::value<std::vector<std::string>>(cluster_files))
+            ("c,calibration", "Use calibration file", cxxopts::value<std::string>(calibration_file))
+            ("o,output", "Output folder (rewrite the files in place if not given)", cxxopts::value<std::string>(output_folder)->default_value(""))
+            ("h,help", "Print usage");
+        options.parse_positional({"input"});
+        auto result = options.parse(args.size(), args.data());
+        if (result.count("help")) {
+            std::cout << options.help() << std::endl;
+            return 0;
+        }
+
+        std::cout << "Found " << cluster_files.size() << " cluster files:" << std::endl;
+        for (const auto& file : cluster_files)
+            std::cout << "- [" << file << "]" << std::endl;
+        std::cout << "Calibration: " << calibration_file << "\n";
+        std::cout << "Output: " << (output_folder.empty() ? "in place" : output_folder) << "\n";
+
+        recalibrate_clusters(config, cluster_files, calibration_file, output_folder);
+
+        return 0;
+    }
+
+    if (command == "transpose") {
+
+        cxxopts::Options options("alpha transpose", "Write a pixel-major copy of rawfiles ({rawfile}.tpx) for fast access to single pixels");
+        std::vector<std::string> rawfiles;
+
+        options.add_options()
+            ("i,input", "Raw input files", cxxopts::value<std::vector<std::string>>(rawfiles))
+            ("h,help", "Print usage");
+        options.parse_positional({"input"});
+        auto result = options.parse(args.size(), args.data());
+        if (result.count("help")) {
+            std::cout << options.help() << std::endl;
+            return 0;
+        }
+
+        std::cout << "Found " << rawfiles.size() << " raw files:" << std::endl;
+        for (const auto& file : rawfiles)
+            std::cout << "- [" << file << "]" << std::endl;
+
+        plan_flows(config, transpose_memory(config), rawfiles, max_memory);
+        transpose(config, rawfiles);
+        report_buffers();
 
         return 0;
     }
@@ -237,13 +424,74 @@ int main(int argc, char* argv[]) {
         std::cout << "Type: " << type << "\n";
         std::cout << "Output folder: " << output_folder << "\n";
 
-        instant_read_batch(rawfiles, crystal_ids, rows, cols, type, output_folder);
+        instant_read_batch(config, rawfiles, crystal_ids, rows, cols, type, output_folder);
 
         return 0;
     }    
 
     std::cout << "Unknown command: " << command << "\n";
-    std::cout << "Available commands: raw2spectra, raw2scatters, and raw2clusters\n";
+    std::cout << "Available commands: raw2frames, raw2spectra, raw2scatters, raw2clusters, query-clusters, decode-clusters, recalibrate-clusters, transpose, instant and serve\n";
     return 1;
 
 }
+
+int main(int argc, char* argv[]) {
+
+    if (argc <= 2) {
+        std::cout << "Usage: " << argv[0] << " [--config <file>] [--max-memory <size>] <command> [options]\n";
+        std::cout << "Available commands: raw2frames, raw2spectra, raw2scatters, raw2clusters, query-clusters, decode-clusters, recalibrate-clusters, transpose, instant and serve\n";
+        return 0;
+    }
+
+    // Check for the config and memory budget arguments, and shift the arguments past them
+    // the memory budget is in MB or with a K, M, G or T suffix, the flows are sized to fit in it (see plan_flows)
+    std::string config_filepath = "config.txt";
+    size_t max_memory = 0;
+    int shift = 0;
+    while (2 + shift < argc) {
+        const std::string option = argv[1 + shift];
+        if (option == "--config") config_filepath = argv[2 + shift];
+        else if (option == "--max-memory") max_memory = parse_memory_size(argv[2 + shift]);
+        else break;
+        shift += 2;
+    }
+    if (1 + shift >= argc) {
+        std::cout << "Missing command\n";
+        return 1;
+    }
+    RunConfig config = read_config(config_filepath, false);
+    pin_threads(config);
+    TlbMissCounter tlb_misses(config);
+
+    std::string command = argv[1 + shift];  // the first is the subcommand
+    std::vector<char*> args(argv + 1 + shift, argv + argc); // the subcommand and the remaining arguments
+
+    if (command == "serve") {
+
+        cxxopts::Options options("alpha serve", "Run the commands sent to a local Unix socket, keeping the config and calibrations between them");
+        std::string socket_path;
+
+        options.add_options()
+            ("s,socket", "Path of the Unix socket", cxxopts::value<std::string>(socket_path)->default_value("alpha.sock"))
+            ("h,help", "Print usage");
+        options.parse_positional({"socket"});
+        auto result = options.parse(args.size(), args.data());
+        if (result.count("help")) {
+            std::cout << options.help() << std::endl;
+            return 0;
+        }
+
+        std::cout << "Config file: " << config_filepath << "\n";
+        return serve(socket_path, [&](const std::vector<std::string>& job_args) {
+            if (job_args.empty()) throw std::invalid_argument("A job needs a command");
+            // the buffers of a job are freed when it ends, even on an error, and not kept while the server waits
+            struct PoolRelease { ~PoolRelease() { clear_buffer_pool(); } } pool_release;
+            std::vector<std::string> job_strings(job_args);
+            std::vector<char*> job_argv;
+            for (auto& arg : job_strings) job_argv.push_back(arg.data());
+            return run_command(config, config_filepath, max_memory, tlb_misses, job_args[0], job_argv);
+        });
+    }
+
+    return run_command(std::move(config), config_filepath, max_memory, tlb_misses, command, args);
+}
@@ -0,0 +1,78 @@
+#include <string>
+#include <cstdint>
+#include <stdexcept>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "header.hpp"
+
+// an empty file is not mapped, data() is then nullptr and size() is 0
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string& path, bool writable) {
+    HANDLE file_handle = CreateFileA(path.c_str(),
+        writable ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ, FILE_SHARE_READ,
+        NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file_handle == INVALID_HANDLE_VALUE) throw std::runtime_error("Cannot open: " + path);
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file_handle, &size)) {
+        CloseHandle(file_handle);
+        throw std::runtime_error("Cannot get the size of: " + path);
+    }
+    file_size = static_cast<size_t>(size.QuadPart);
+    if (file_size == 0) {
+        CloseHandle(file_handle);
+        return;
+    }
+
+    HANDLE handle = CreateFileMappingA(file_handle, NULL, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file_handle);
+    if (!handle) throw std::runtime_error("Cannot map: " + path);
+    ptr = static_cast<uint8_t*>(MapViewOfFile(handle, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0));
+    if (!ptr) {
+        CloseHandle(handle);
+        throw std::runtime_error("Cannot map: " + path);
+    }
+    map_handle = handle;
+}
+
+MappedFile::~MappedFile() {
+    if (ptr) UnmapViewOfFile(ptr);
+    if (map_handle) CloseHandle(static_cast<HANDLE>(map_handle));
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& path, bool writable) {
+    int fd = open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Cannot open: " + path);
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) {
+        close(fd);
+        throw std::runtime_error("Cannot get the size of: " + path);
+    }
+    file_size = static_cast<size_t>(file_stat.st_size);
+    if (file_size == 0) {
+        close(fd);
+        return;
+    }
+
+    void* mapped = mmap(nullptr, file_size, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);  // the mapping keeps the file open
+    if (mapped == MAP_FAILED) throw std::runtime_error("Cannot map: " + path);
+    ptr = static_cast<uint8_t*>(mapped);
+}
+
+MappedFile::~MappedFile() {
+    if (ptr) munmap(ptr, file_size);
+}
+
+#endif
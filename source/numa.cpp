@@ -0,0 +1,164 @@
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <atomic>
+#include <cctype>
+#include <algorithm>
+#include <iostream>
+#include <filesystem>
+#include <omp.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sched.h>
+#include <pthread.h>
+#endif
+
+#include "header.hpp"
+
+// the CPUs the process may run on and their NUMA nodes, and pinning the calling thread to one of them
+#ifdef _WIN32
+
+static std::vector<std::pair<int, int>> allowed_cpus_nodes() {
+    std::vector<std::pair<int, int>> cpus_nodes;
+    DWORD_PTR process_mask = 0, system_mask = 0;
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask)) return cpus_nodes;
+    for (int cpu = 0; cpu < static_cast<int>(sizeof(DWORD_PTR) * 8); cpu++) {
+        if (!(process_mask & (static_cast<DWORD_PTR>(1) << cpu))) continue;
+        UCHAR node = 0;
+        if (!GetNumaProcessorNode(static_cast<UCHAR>(cpu), &node) || node == 0xFF) node = 0;
+        cpus_nodes.emplace_back(cpu, node);
+    }
+    return cpus_nodes;
+}
+
+static bool pin_current_thread(const int cpu) {
+    return SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << cpu) != 0;
+}
+
+#else
+
+static std::vector<std::pair<int, int>> allowed_cpus_nodes() {
+    std::vector<std::pair<int, int>> cpus_nodes;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) != 0) return cpus_nodes;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &cpus)) continue;
+        // the node of a CPU is the nodeN entry in its sysfs folder
+        int node = 0;
+        std::error_code error;
+        for (const auto& entry : std::filesystem::directory_iterator(format_string("/sys/devices/system/cpu/cpu{}", cpu), error)) {
+            const std::string name = entry.path().filename().string();
+            if (name.size() > 4 && name.compare(0, 4, "node") == 0 && std::all_of(name.begin() + 4, name.end(), [](unsigned char c) { return std::isdigit(c); })) {
+                node = std::stoi(name.substr(4));
+                break;
+            }
+        }
+        cpus_nodes.emplace_back(cpu, node);
+    }
+    return cpus_nodes;
+}
+
+static bool pin_current_thread(const int cpu) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+}
+
+#endif
+
+// the threads are spread evenly over the allowed CPUs ordered by node, so that they are balanced across the nodes and the
+// neighboring threads share a node. the OpenMP runtime keeps its threads for the following parallel regions of the same size,
+// which is why every parallel region of the modules uses N_THREADS threads.
+int pin_threads(RunConfig& config) {
+
+    config.threads_nodes.clear();
+    if (!config.thread_pinning) return 0;
+
+    std::vector<std::pair<int, int>> cpus_nodes = allowed_cpus_nodes();
+    if (cpus_nodes.empty()) {
+        std::cout << "Cannot list the CPUs, the threads are not pinned" << std::endl;
+        return 0;
+    }
+    std::sort(cpus_nodes.begin(), cpus_nodes.end(), [](const auto& a, const auto& b) { return std::make_pair(a.second, a.first) < std::make_pair(b.second, b.first); });
+
+    const int n_threads = config.n_threads;
+    std::vector<int> threads_cpus(n_threads);
+    for (int thread_i = 0; thread_i < n_threads; thread_i++)
+        threads_cpus[thread_i] = static_cast<int>(static_cast<size_t>(thread_i) * cpus_nodes.size() / n_threads);
+
+    // the nodes are numbered from 0 in the order of the threads
+    std::vector<int> nodes;
+    config.threads_nodes.resize(n_threads);
+    for (int thread_i = 0; thread_i < n_threads; thread_i++) {
+        const int node = cpus_nodes[threads_cpus[thread_i]].second;
+        if (nodes.empty() || nodes.back() != node) nodes.push_back(node);
+        config.threads_nodes[thread_i] = static_cast<int>(nodes.size()) - 1;
+    }
+
+    int n_failed = 0;
+    #pragma omp parallel num_threads(n_threads) reduction(+:n_failed)
+    n_failed += !pin_current_thread(cpus_nodes[threads_cpus[omp_get_thread_num()]].first);
+    if (n_failed > 0) {
+        std::cout << format_string("Cannot pin {} of {} threads, the threads are not pinned", n_failed, n_threads) << std::endl;
+        config.threads_nodes.clear();
+        return 0;
+    }
+
+    std::string cpus;
+    for (int thread_i = 0; thread_i < n_threads; thread_i++)
+        cpus += format_string("{}{}", thread_i > 0 ? " " : "", cpus_nodes[threads_cpus[thread_i]].first);
+    std::cout << format_string("Pinned {} threads to CPUs {} on {} NUMA nodes", n_threads, cpus, nodes.size()) << std::endl;
+    return 0;
+}
+
+// the planes of a node are next to each other in the flow, and each thread of the node zero-fills its share of them
+FlowBuffer::FlowBuffer(const RunConfig& config) : values(config.flow_size() * sizeof(uint16_t)) {
+
+    if (config.n_planes() == 0) return;
+    const size_t n_plane_values = static_cast<size_t>(config.max_frames_size) * config.n_pixels;
+    #pragma omp parallel num_threads(config.n_threads)
+    {
+        const int thread_i = omp_get_thread_num();
+        const int node = config.thread_node(thread_i);
+        int n_node_threads = 0, node_thread_i = 0;
+        for (int other_i = 0; other_i < omp_get_num_threads(); other_i++) {
+            if (config.thread_node(other_i) != node) continue;
+            node_thread_i += other_i < thread_i;
+            n_node_threads++;
+        }
+        int first_plane = config.n_planes(), end_plane = 0;
+        for (int plane = 0; plane < config.n_planes(); plane++) {
+            if (config.plane_node(plane) != node) continue;
+            first_plane = std::min(first_plane, plane);
+            end_plane = plane + 1;
+        }
+        if (first_plane < end_plane) {
+            const size_t n_node_values = (end_plane - first_plane) * n_plane_values;
+            const size_t begin = first_plane * n_plane_values + n_node_values * node_thread_i / n_node_threads;
+            const size_t end = first_plane * n_plane_values + n_node_values * (node_thread_i + 1) / n_node_threads;
+            std::fill(data() + begin, data() + end, 0);
+        }
+    }
+}
+
+NodeTaskQueue::NodeTaskQueue(const RunConfig& config, const std::vector<int>& tasks_nodes)
+    : config(config), nodes_tasks(config.n_nodes()), cursors(new std::atomic<size_t>[config.n_nodes()]) {
+    for (int task_i = 0; task_i < static_cast<int>(tasks_nodes.size()); task_i++)
+        nodes_tasks[tasks_nodes[task_i]].push_back(task_i);
+    for (int node = 0; node < config.n_nodes(); node++) cursors[node] = 0;
+}
+
+int NodeTaskQueue::next(const int thread_i) {
+    const int n_nodes = config.n_nodes();
+    const int node = config.thread_node(thread_i);
+    for (int node_i = 0; node_i < n_nodes; node_i++) {
+        const int other = (node + node_i) % n_nodes;
+        if (cursors[other].load(std::memory_order_relaxed) >= nodes_tasks[other].size()) continue;
+        const size_t cursor = cursors[other].fetch_add(1);
+        if (cursor < nodes_tasks[other].size()) return nodes_tasks[other][cursor];
+    }
+    return -1;
+}
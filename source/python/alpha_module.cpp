@@ -0,0 +1,451 @@
+// the Python module "alpha" (make python), which runs the stages of the engine in the Python process:
+//
+//     engine = alpha.Engine("config.txt")
+//     frames = engine.read_frames(rawfile, 0, 1000)          # uint16 [crystal, frame, row, col]
+//     spectra = engine.spectra(frames[0])                    # int32 [pixel, bin], see engine.bins()
+//     clusters = engine.clusters(frames[0], 0, calibration)  # dict of the ClusterBatch columns
+//     values = engine.instant([rawfile], [0], [10], [20])    # list of uint16 [frame], one per pixel
+//
+// the results are C++ vectors moved into alpha.Array objects, which give their memory to Python through the buffer protocol,
+// and are returned as numpy arrays sharing that memory (or as alpha.Array if numpy is not installed). the frames passed in
+// are read through the buffer protocol as well, without a copy. the GIL is released while the engine computes.
+
+// Python.h must come first
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <memory>
+#include <iterator>
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+#include <filesystem>
+
+#include "header.hpp"
+
+static const int MAX_ARRAY_DIMS = 4;
+
+// numpy.asarray, or nullptr without numpy
+static PyObject* numpy_asarray = nullptr;
+
+// the C++ buffer of an array, any vector moved into it
+struct ArrayStorage {
+    virtual ~ArrayStorage() = default;
+};
+template <typename T>
+struct VectorStorage : ArrayStorage {
+    explicit VectorStorage(std::vector<T>&& values) : values(std::move(values)) {}
+    std::vector<T> values;
+};
+
+// the struct module format of the values
+template <typename T> constexpr const char* buffer_format();
+template <> constexpr const char* buffer_format<uint8_t>() { return "B"; }
+template <> constexpr const char* buffer_format<uint16_t>() { return "H"; }
+template <> constexpr const char* buffer_format<int32_t>() { return "i"; }
+template <> constexpr const char* buffer_format<uint32_t>() { return "I"; }
+template <> constexpr const char* buffer_format<float>() { return "f"; }
+
+struct ArrayObject {
+    PyObject_HEAD
+    ArrayStorage* storage;
+    void* data;
+    const char* format;
+    Py_ssize_t itemsize;
+    int ndim;
+    Py_ssize_t shape[MAX_ARRAY_DIMS];
+    Py_ssize_t strides[MAX_ARRAY_DIMS];
+};
+
+static void Array_dealloc(ArrayObject* self) {
+    delete self->storage;
+    Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+}
+
+static int Array_getbuffer(PyObject* object, Py_buffer* view, int flags) {
+    ArrayObject* self = reinterpret_cast<ArrayObject*>(object);
+    Py_ssize_t n_values = 1;
+    for (int dim = 0; dim < self->ndim; dim++) n_values *= self->shape[dim];
+    view->obj = object;
+    Py_INCREF(object);
+    view->buf = self->data;
+    view->len = n_values * self->itemsize;
+    view->readonly = 0;
+    view->itemsize = self->itemsize;
+    view->format = (flags & PyBUF_FORMAT) ? const_cast<char*>(self->format) : nullptr;
+    view->ndim = self->ndim;
+    view->shape = (flags & PyBUF_ND) ? self->shape : nullptr;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? self->strides : nullptr;
+    view->suboffsets = nullptr;
+    view->internal = nullptr;
+    return 0;
+}
+
+static PyBufferProcs Array_as_buffer = { Array_getbuffer, nullptr };
+
+// zero-initialized, the fields are set in PyInit_alpha
+static PyTypeObject ArrayType;
+
+// an array of the values in C order, which owns them from now on
+template <typename T>
+static PyObject* to_array(std::vector<T>&& values, const std::vector<Py_ssize_t>& shape) {
+    ArrayObject* array = PyObject_New(ArrayObject, &ArrayType);
+    if (array == nullptr) return nullptr;
+    VectorStorage<T>* storage = new VectorStorage<T>(std::move(values));
+    array->storage = storage;
+    // an empty vector may have no data, the buffer of an empty array still needs an address
+    static T empty_value;
+    array->data = storage->values.empty() ? &empty_value : storage->values.data();
+    array->format = buffer_format<T>();
+    array->itemsize = sizeof(T);
+    array->ndim = static_cast<int>(shape.size());
+    Py_ssize_t stride = sizeof(T);
+    for (int dim = array->ndim - 1; dim >= 0; dim--) {
+        array->shape[dim] = shape[dim];
+        array->strides[dim] = stride;
+        stride *= shape[dim];
+    }
+
+    if (numpy_asarray == nullptr) return reinterpret_cast<PyObject*>(array);
+    PyObject* numpy_array = PyObject_CallOneArg(numpy_asarray, reinterpret_cast<PyObject*>(array));
+    Py_DECREF(array);
+    return numpy_array;
+}
+
+// runs the engine without the GIL, its exceptions are raised as ValueError (invalid arguments), MemoryError or RuntimeError
+template <typename Compute>
+static bool run_without_gil(Compute&& compute) {
+    PyObject* error_type = nullptr;
+    std::string message;
+    Py_BEGIN_ALLOW_THREADS
+    try {
+        compute();
+    } catch (const std::invalid_argument& error) {
+        error_type = PyExc_ValueError;
+        message = error.what();
+    } catch (const std::bad_alloc&) {
+        error_type = PyExc_MemoryError;
+        message = "Out of memory";
+    } catch (const std::exception& error) {
+        error_type = PyExc_RuntimeError;
+        message = error.what();
+    }
+    Py_END_ALLOW_THREADS
+    if (error_type != nullptr) PyErr_SetString(error_type, message.c_str());
+    return error_type == nullptr;
+}
+
+// conversions of the arguments, they set a Python exception and return false on failure
+static bool to_string(PyObject* object, std::string& value) {
+    PyObject* path = PyOS_FSPath(object);
+    if (path == nullptr) return false;
+    const char* text = PyUnicode_Check(path) ? PyUnicode_AsUTF8(path) : nullptr;
+    if (text == nullptr && !PyErr_Occurred()) PyErr_SetString(PyExc_TypeError, "Expected a str path");
+    if (text != nullptr) value = text;
+    Py_DECREF(path);
+    return text != nullptr;
+}
+
+static bool to_strings(PyObject* object, std::vector<std::string>& values) {
+    PyObject* sequence = PySequence_Fast(object, "Expected a sequence of paths");
+    if (sequence == nullptr) return false;
+    values.resize(PySequence_Fast_GET_SIZE(sequence));
+    bool converted = true;
+    for (size_t i = 0; i < values.size() && converted; i++)
+        converted = to_string(PySequence_Fast_GET_ITEM(sequence, i), values[i]);
+    Py_DECREF(sequence);
+    return converted;
+}
+
+static bool to_ints(PyObject* object, std::vector<int>& values) {
+    PyObject* sequence = PySequence_Fast(object, "Expected a sequence of integers");
+    if (sequence == nullptr) return false;
+    values.resize(PySequence_Fast_GET_SIZE(sequence));
+    bool converted = true;
+    for (size_t i = 0; i < values.size() && converted; i++) {
+        values[i] = PyLong_AsLong(PySequence_Fast_GET_ITEM(sequence, i));
+        converted = !(values[i] == -1 && PyErr_Occurred());
+    }
+    Py_DECREF(sequence);
+    return converted;
+}
+
+// the frames of one crystal from an object with the buffer protocol, e.g. a C-contiguous uint16 numpy array of
+// n_frames x N_ROWS x N_COLS or n_frames x N_PIXELS values. the view is released by the destructor
+class FramesView {
+public:
+    FramesView(PyObject* object, const RunConfig& config) {
+        if (PyObject_GetBuffer(object, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0) return;
+        acquired = true;
+        const std::string format = view.format != nullptr ? view.format : "B";
+        if (view.itemsize != sizeof(uint16_t) || format.empty() || format.back() != 'H')
+            PyErr_SetString(PyExc_TypeError, "The frames must be uint16 values");
+        else if (view.len / view.itemsize % config.n_pixels != 0)
+            PyErr_SetString(PyExc_ValueError, format_string("The frames must have a multiple of {} values", config.n_pixels).c_str());
+        else
+            n_frames = static_cast<int>(view.len / view.itemsize / config.n_pixels);
+    }
+    ~FramesView() {
+        if (acquired) PyBuffer_Release(&view);
+    }
+    FramesView(const FramesView&) = delete;
+    FramesView& operator=(const FramesView&) = delete;
+    bool valid() const { return n_frames >= 0; }
+    const uint16_t* data() const { return static_cast<const uint16_t*>(view.buf); }
+    int size() const { return n_frames; }
+
+private:
+    Py_buffer view{};
+    bool acquired = false;
+    int n_frames = -1;
+};
+
+// the engine keeps the config of a config file. unlike for the commands the threads are not pinned (PIN_THREADS), since the
+// first of them is the thread of the interpreter
+struct EngineObject {
+    PyObject_HEAD
+    RunConfig* config;
+};
+
+static void Engine_dealloc(EngineObject* self) {
+    delete self->config;
+    Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+}
+
+// the config is set once, the methods use it without the GIL so it cannot be replaced while they run
+static int Engine_init(EngineObject* self, PyObject* args, PyObject* kwds) {
+    static const char* keywords[] = { "config", nullptr };
+    PyObject* config_object = nullptr;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", const_cast<char**>(keywords), &config_object)) return -1;
+    if (self->config != nullptr) {
+        PyErr_SetString(PyExc_RuntimeError, "The engine is already initialized, create a new Engine for another config");
+        return -1;
+    }
+    std::string config_filepath = "config.txt";
+    if (config_object != nullptr && !to_string(config_object, config_filepath)) return -1;
+
+    RunConfig config;
+    if (!run_without_gil([&]() { config = read_config(config_filepath, false); })) return -1;
+    // another thread may have initialized the engine while the config was read
+    if (self->config != nullptr) {
+        PyErr_SetString(PyExc_RuntimeError, "The engine is already initialized, create a new Engine for another config");
+        return -1;
+    }
+    self->config = new RunConfig(std::move(config));
+    return 0;
+}
+
+static const RunConfig* engine_config(EngineObject* self) {
+    if (self->config == nullptr) PyErr_SetString(PyExc_RuntimeError, "The engine is not initialized");
+    return self->config;
+}
+
+static PyObject* Engine_layout(EngineObject* self, PyObject*) {
+    const RunConfig* config = engine_config(self);
+    if (config == nullptr) return nullptr;
+    std::vector<int32_t> pixel_order(config->pixel_order.begin(), config->pixel_order.end());
+    PyObject* pixel_order_array = to_array(std::move(pixel_order), { config->n_pixels_premerge });
+    if (pixel_order_array == nullptr) return nullptr;
+    return Py_BuildValue("{s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:N}",
+        "n_crystals", config->n_crystals, "n_rows", config->n_rows, "n_cols", config->n_cols, "n_pixels", config->n_pixels,
+        "n_pixels_premerge", config->n_pixels_premerge, "adu_min", config->adu_min, "adu_max", config->adu_max, "n_bins", config->n_bins,
+        "n_threads", config->n_threads, "pixel_order", pixel_order_array);
+}
+
+static PyObject* Engine_bins(EngineObject* self, PyObject*) {
+    const RunConfig* config = engine_config(self);
+    if (config == nullptr) return nullptr;
+    std::vector<float> bins;
+    if (!run_without_gil([&]() { bins = create_bins(config->n_bins, config->adu_min, config->adu_max); })) return nullptr;
+    return to_array(std::move(bins), { config->n_bins });
+}
+
+static PyObject* Engine_read_frames(EngineObject* self, PyObject* args, PyObject* kwds) {
+    static const char* keywords[] = { "rawfile", "start_frame", "end_frame", "crystal_ids", nullptr };
+    PyObject* rawfile_object = nullptr;
+    PyObject* crystal_ids_object = Py_None;
+    long long start_frame = 0, end_frame = -1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|LLO", const_cast<char**>(keywords), &rawfile_object, &start_frame, &end_frame, &crystal_ids_object))
+        return nullptr;
+    const RunConfig* engine = engine_config(self);
+    std::string rawfile;
+    std::vector<int> crystal_ids;
+    if (engine == nullptr || !to_string(rawfile_object, rawfile)) return nullptr;
+    if (crystal_ids_object != Py_None && !to_ints(crystal_ids_object, crystal_ids)) return nullptr;
+    if (crystal_ids_object == Py_None)
+        for (int crystal_id = 0; crystal_id < engine->n_crystals; crystal_id++) crystal_ids.push_back(crystal_id);
+
+    // the frames are read into a flow of exactly the frames asked for
+    RunConfig config = *engine;
+    std::vector<uint16_t> frames;
+    const bool read = run_without_gil([&]() {
+        config.set_active_crystals(crystal_ids);
+        const long long n_file_frames = static_cast<long long>(std::filesystem::file_size(rawfile) / config.frame_size() / sizeof(uint16_t));
+        if (end_frame < 0 || end_frame > n_file_frames) end_frame = n_file_frames;
+        if (start_frame < 0 || start_frame > end_frame)
+            throw std::invalid_argument(format_string("Invalid start frame {}, the file has {} frames", start_frame, n_file_frames));
+        config.max_frames_size = static_cast<int>(end_frame - start_frame);
+        frames.resize(config.flow_size());
+        if (config.max_frames_size > 0)
+            read_rawfile_to_crystals_frames_images(config, rawfile, static_cast<int>(start_frame), static_cast<int>(end_frame), frames.data());
+    });
+    if (!read) return nullptr;
+    return to_array(std::move(frames), { config.n_planes(), config.max_frames_size, config.n_rows, config.n_cols });
+}
+
+static PyObject* Engine_spectra(EngineObject* self, PyObject* args) {
+    PyObject* frames_object = nullptr;
+    if (!PyArg_ParseTuple(args, "O", &frames_object)) return nullptr;
+    const RunConfig* config = engine_config(self);
+    if (config == nullptr) return nullptr;
+    FramesView frames(frames_object, *config);
+    if (!frames.valid()) return nullptr;
+
+    std::vector<int32_t> pixels_spectra;
+    const bool computed = run_without_gil([&]() {
+        pixels_spectra.assign(static_cast<size_t>(config->n_pixels) * config->n_bins, 0);
+        frames_images_to_pixels_spectra(*config, frames.data(), frames.size(), pixels_spectra.data());
+    });
+    if (!computed) return nullptr;
+    return to_array(std::move(pixels_spectra), { config->n_pixels, config->n_bins });
+}
+
+static PyObject* Engine_clusters(EngineObject* self, PyObject* args, PyObject* kwds) {
+    static const char* keywords[] = { "frames", "crystal_id", "calibration", "threshold", "connectivity", "halo", nullptr };
+    PyObject* frames_object = nullptr;
+    PyObject* calibration_object = nullptr;
+    PyObject* threshold_object = nullptr;
+    int crystal_id = 0, connectivity = 4, halo_radius = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OiO|Oii", const_cast<char**>(keywords), &frames_object, &crystal_id, &calibration_object,
+        &threshold_object, &connectivity, &halo_radius))
+        return nullptr;
+    const RunConfig* config = engine_config(self);
+    std::string calibration_file, threshold_file = "from_calibration";
+    if (config == nullptr || !to_string(calibration_object, calibration_file)) return nullptr;
+    if (threshold_object != nullptr && threshold_object != Py_None && !to_string(threshold_object, threshold_file)) return nullptr;
+    FramesView frames(frames_object, *config);
+    if (!frames.valid()) return nullptr;
+
+    ClusterBatch batch;
+    const bool clustered = run_without_gil([&]() {
+        frames_images_to_clusters(*config, frames.data(), frames.size(), crystal_id, calibration_file, threshold_file, connectivity, halo_radius, batch);
+    });
+    if (!clustered) return nullptr;
+    const Py_ssize_t n_clusters = batch.size(), n_cluster_pixels = batch.pixel_ids.size(), n_offsets = batch.offsets.size();
+    std::vector<int32_t> frame_ids(batch.frame_ids.begin(), batch.frame_ids.end());
+    // every column is checked, since Py_BuildValue would leak the others if one of them failed
+    PyObject* columns[] = {
+        to_array(std::move(frame_ids), { n_clusters }),
+        to_array(std::move(batch.offsets), { n_offsets }),
+        to_array(std::move(batch.pixel_ids), { n_cluster_pixels }),
+        to_array(std::move(batch.adus), { n_cluster_pixels }),
+        to_array(std::move(batch.energies), { n_cluster_pixels })
+    };
+    PyObject* result = nullptr;
+    if (std::find(std::begin(columns), std::end(columns), nullptr) == std::end(columns))
+        result = Py_BuildValue("{s:O,s:O,s:O,s:O,s:O}",
+            "frame_ids", columns[0], "offsets", columns[1], "pixel_ids", columns[2], "adus", columns[3], "energies", columns[4]);
+    for (PyObject* column : columns) Py_XDECREF(column);
+    return result;
+}
+
+static PyObject* Engine_instant(EngineObject* self, PyObject* args) {
+    PyObject *rawfiles_object = nullptr, *crystal_ids_object = nullptr, *rows_object = nullptr, *cols_object = nullptr;
+    if (!PyArg_ParseTuple(args, "OOOO", &rawfiles_object, &crystal_ids_object, &rows_object, &cols_object)) return nullptr;
+    const RunConfig* config = engine_config(self);
+    std::vector<std::string> rawfiles;
+    std::vector<int> crystal_ids, rows, cols;
+    if (config == nullptr || !to_strings(rawfiles_object, rawfiles) || !to_ints(crystal_ids_object, crystal_ids)
+        || !to_ints(rows_object, rows) || !to_ints(cols_object, cols))
+        return nullptr;
+
+    std::vector<std::vector<uint16_t>> pixels_values;
+    const bool read = run_without_gil([&]() {
+        if (crystal_ids.size() != rows.size() || crystal_ids.size() != cols.size())
+            throw std::invalid_argument("The numbers of crystal ids, rows and columns must be the same");
+        read_single_pixel_batch(*config, rawfiles, crystal_ids, rows, cols, pixels_values);
+    });
+    if (!read) return nullptr;
+    PyObject* list = PyList_New(pixels_values.size());
+    if (list == nullptr) return nullptr;
+    for (size_t pixel_i = 0; pixel_i < pixels_values.size(); pixel_i++) {
+        const Py_ssize_t n_frames = pixels_values[pixel_i].size();
+        PyObject* array = to_array(std::move(pixels_values[pixel_i]), { n_frames });
+        if (array == nullptr) {
+            Py_DECREF(list);
+            return nullptr;
+        }
+        PyList_SET_ITEM(list, pixel_i, array);
+    }
+    return list;
+}
+
+static PyMethodDef Engine_methods[] = {
+    { "layout", reinterpret_cast<PyCFunction>(Engine_layout), METH_NOARGS,
+        "layout()\n\nThe detector shape, spectrum bins and pixel order (post-merge pixel id of each position of a crystal's part of a raw frame, -1 for merged pixels)." },
+    { "bins", reinterpret_cast<PyCFunction>(Engine_bins), METH_NOARGS,
+        "bins()\n\nThe lower edges of the N_BINS spectrum bins from ADU_MIN to ADU_MAX." },
+    { "read_frames", reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)(void)>(Engine_read_frames)), METH_VARARGS | METH_KEYWORDS,
+        "read_frames(rawfile, start_frame=0, end_frame=-1, crystal_ids=None)\n\nThe frames [start_frame, end_frame) of a raw file as uint16 [crystal, frame, row, col], of all crystals or of crystal_ids in this order." },
+    { "spectra", reinterpret_cast<PyCFunction>(Engine_spectra), METH_VARARGS,
+        "spectra(frames)\n\nThe int32 [pixel, bin] spectra of the frames of one crystal (uint16, n_frames x N_PIXELS values), like raw2spectra." },
+    { "clusters", reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)(void)>(Engine_clusters)), METH_VARARGS | METH_KEYWORDS,
+        "clusters(frames, crystal_id, calibration, threshold='from_calibration', connectivity=4, halo=0)\n\n"
+        "The clusters of the frames of one crystal, like raw2clusters, as a dict of columns: frame_ids (from 0) and offsets of the clusters, "
+        "the pixels of cluster i are [offsets[i], offsets[i + 1]) of pixel_ids, adus and energies." },
+    { "instant", reinterpret_cast<PyCFunction>(Engine_instant), METH_VARARGS,
+        "instant(rawfiles, crystal_ids, rows, cols)\n\nThe uint16 values of each pixel over the frames of all raw files, like instant, one array per pixel." },
+    { nullptr, nullptr, 0, nullptr }
+};
+
+static PyTypeObject EngineType;
+
+static PyModuleDef alpha_module;
+
+PyMODINIT_FUNC PyInit_alpha(void) {
+
+    Py_SET_REFCNT(&ArrayType, 1);
+    ArrayType.tp_name = "alpha.Array";
+    ArrayType.tp_basicsize = sizeof(ArrayObject);
+    ArrayType.tp_dealloc = reinterpret_cast<destructor>(Array_dealloc);
+    ArrayType.tp_as_buffer = &Array_as_buffer;
+    ArrayType.tp_flags = Py_TPFLAGS_DEFAULT;
+    ArrayType.tp_doc = "Values owned by the engine, shown through the buffer protocol (numpy.asarray or memoryview).";
+
+    Py_SET_REFCNT(&EngineType, 1);
+    EngineType.tp_name = "alpha.Engine";
+    EngineType.tp_basicsize = sizeof(EngineObject);
+    EngineType.tp_dealloc = reinterpret_cast<destructor>(Engine_dealloc);
+    EngineType.tp_flags = Py_TPFLAGS_DEFAULT;
+    EngineType.tp_doc = "Engine(config='config.txt')\n\nThe stages of the engine with the config of a config file.";
+    EngineType.tp_methods = Engine_methods;
+    EngineType.tp_init = reinterpret_cast<initproc>(Engine_init);
+    EngineType.tp_new = PyType_GenericNew;
+
+    alpha_module.m_base = PyModuleDef_HEAD_INIT;
+    alpha_module.m_name = "alpha";
+    alpha_module.m_doc = "The stages of the alpha engine on numpy arrays.";
+    alpha_module.m_size = -1;
+
+    if (PyType_Ready(&ArrayType) < 0 || PyType_Ready(&EngineType) < 0) return nullptr;
+    PyObject* module = PyModule_Create(&alpha_module);
+    if (module == nullptr) return nullptr;
+    Py_INCREF(&ArrayType);
+    Py_INCREF(&EngineType);
+    if (PyModule_AddObject(module, "Array", reinterpret_cast<PyObject*>(&ArrayType)) < 0
+        || PyModule_AddObject(module, "Engine", reinterpret_cast<PyObject*>(&EngineType)) < 0) {
+        Py_DECREF(module);
+        return nullptr;
+    }
+
+    PyObject* numpy = PyImport_ImportModule("numpy");
+    if (numpy != nullptr) {
+        numpy_asarray = PyObject_GetAttrString(numpy, "asarray");
+        Py_DECREF(numpy);
+    }
+    PyErr_Clear();
+    return module;
+}
@@ -0,0 +1,92 @@
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <filesystem>
+#include <chrono>
+#include <limits>
+#include <stdexcept>
+
+#include "header.hpp"
+
+// select the clusters of a frame range [start_frame_id, end_frame_id) and a total energy window [min_energy, max_energy]
+// from cluster files, and write them into output_file in the same format.
+// file_index selects the raw file the frames belong to (frame ids restart for every raw file), -1 means all raw files.
+// only the index blocks whose ranges overlap the query are read, files without an index are scanned completely and cannot
+// be filtered by raw file.
+int query_clusters(const std::vector<std::string>& cluster_files, const int file_index, const int start_frame_id, const int end_frame_id,
+    const float min_energy, const float max_energy, const std::string& output_file) {
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+
+    std::ofstream output(output_file, std::ios::binary | std::ios::trunc);
+    if (!output.is_open()) throw std::runtime_error("Cannot open: " + output_file);
+
+    size_t n_matched = 0, n_read_bytes = 0;
+    std::vector<char> block_data;
+    for (const auto& cluster_file : cluster_files) {
+
+        // without an index the whole file is a single block
+        ClusterIndex index;
+        std::string index_file = cluster_file + ".idx";
+        if (std::filesystem::exists(index_file)) {
+            read_cluster_index(index_file, index);
+        } else {
+            // the records do not tell which raw file their frame ids belong to, only the index does
+            if (file_index >= 0)
+                throw std::invalid_argument("Filtering by raw file needs the index, which is not found: " + index_file);
+            std::cout << "Warning: no index found, scanning the whole file: " << cluster_file << std::endl;
+            index.n_bytes = std::filesystem::file_size(cluster_file);
+            index.blocks.push_back({ 0, 0, 0, 0, std::numeric_limits<int32_t>::min(), std::numeric_limits<int32_t>::max(),
+                -std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity() });
+        }
+
+        std::ifstream file(cluster_file, std::ios::binary);
+        if (!file.is_open()) throw std::runtime_error("Cannot open: " + cluster_file);
+
+        for (size_t block_i = 0; block_i < index.blocks.size(); block_i++) {
+            const ClusterIndexBlock& block = index.blocks[block_i];
+            if (file_index >= 0 && block.file_index != static_cast<uint32_t>(file_index)) continue;
+            if (block.max_frame_id < start_frame_id || block.min_frame_id >= end_frame_id) continue;
+            if (block.max_energy < min_energy || block.min_energy > max_energy) continue;
+
+            // read the block at once and then check its records
+            const uint64_t block_end = block_i + 1 < index.blocks.size() ? index.blocks[block_i + 1].byte_offset : index.n_bytes;
+            block_data.resize(block_end - block.byte_offset);
+            file.seekg(block.byte_offset);
+            file.read(block_data.data(), block_data.size());
+            if (!file) throw std::runtime_error("Cluster file is shorter than its index: " + cluster_file);
+            n_read_bytes += block_data.size();
+
+            size_t position = 0;
+            while (position + 8 <= block_data.size()) {
+                int frame_id, num_pixels;
+                std::memcpy(&frame_id, block_data.data() + position, 4);
+                std::memcpy(&num_pixels, block_data.data() + position + 4, 4);
+                const size_t record_size = 8 + static_cast<size_t>(num_pixels) * 8;
+
+                if (frame_id >= start_frame_id && frame_id < end_frame_id) {
+                    float total_energy = 0;
+                    for (int pixel_i = 0; pixel_i < num_pixels; pixel_i++) {
+                        float energy;
+                        std::memcpy(&energy, block_data.data() + position + 8 + num_pixels * 4 + pixel_i * 4, 4);
+                        total_energy += energy;
+                    }
+                    if (total_energy >= min_energy && total_energy <= max_energy) {
+                        output.write(block_data.data() + position, record_size);
+                        n_matched++;
+                    }
+                }
+                position += record_size;
+            }
+        }
+    }
+
+    auto end_time = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed = end_time - start_time;
+    std::cout << format_string("Found {} clusters in {} files, {} bytes read, {} s elapsed. Saved to {}",
+        n_matched, cluster_files.size(), n_read_bytes, elapsed.count(), output_file) << std::endl;
+    return 0;
+}
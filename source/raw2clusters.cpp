@@ -7,311 +7,590 @@
 #include <fstream>
 #include <algorithm>
 #include <chrono>
+#include <stdexcept>
+#include <memory>
+#include <limits>
 #include <omp.h>
 
-#include "header.hpp"
+#include "highfive/HighFive.hpp"
 
-struct Cluster {
-    int frame_id;
-    std::vector<int> pixel_ids;
-    std::vector<uint16_t> adus;
-    std::vector<float> energies;
-    // bool selected;
-};
+#include "header.hpp"
 
+// the cluster batches are sized for this part of the pixels of every frame being in clusters, a busier flow grows them
+static const double CLUSTER_PIXELS_FRACTION = 0.05;
 
 // For one pixel, add its adjacent pixels to the list of adjacent pixels if they are not already checked
-int add_adjacent_pixels(int pixel_id, std::vector<int> &adjacent_pixel_ids, const std::vector<char> &pixels_ischeckeds, bool include_diagonal) {
-
-    std::vector<int> candidate_adjacent_pixel_ids;
-    if (include_diagonal) {
-        if (pixel_id % global_config["N_COLS"][0] == 0) {
-            candidate_adjacent_pixel_ids = { pixel_id + 1, 
-                pixel_id + global_config["N_COLS"][0], pixel_id + global_config["N_COLS"][0] + 1, 
-                pixel_id - global_config["N_COLS"][0], pixel_id - global_config["N_COLS"][0] + 1 };
-        } else if (pixel_id % global_config["N_COLS"][0] == global_config["N_COLS"][0] - 1) {
-            candidate_adjacent_pixel_ids = { pixel_id - 1,
-                pixel_id + global_config["N_COLS"][0], pixel_id + global_config["N_COLS"][0] - 1, 
-                pixel_id - global_config["N_COLS"][0], pixel_id - global_config["N_COLS"][0] - 1 };
-        } else 
-            candidate_adjacent_pixel_ids = { pixel_id - 1, pixel_id + 1, 
-                pixel_id + global_config["N_COLS"][0], pixel_id + global_config["N_COLS"][0] - 1, pixel_id + global_config["N_COLS"][0] + 1, 
-                pixel_id - global_config["N_COLS"][0], pixel_id - global_config["N_COLS"][0] - 1, pixel_id - global_config["N_COLS"][0] + 1 };
+// with connectivity 4 only the pixels sharing an edge are adjacent, with connectivity 8 the diagonal ones as well
+// (the order of the 4-connected pixels at the right edge is kept as before, so that outputs are reproduced exactly)
+int add_adjacent_pixels(int pixel_id, std::vector<int> &adjacent_pixel_ids, const std::vector<char> &pixels_ischeckeds, int connectivity,
+    const int n_rows, const int n_cols) {
+
+    const int row = pixel_id / n_cols;
+    const int col = pixel_id % n_cols;
+    auto add = [&](int d_row, int d_col) {
+        int new_row = row + d_row, new_col = col + d_col;
+        if (new_row < 0 || new_row >= n_rows || new_col < 0 || new_col >= n_cols) return;
+        int new_adjacent_pixel_id = new_row * n_cols + new_col;
+        if (!pixels_ischeckeds[new_adjacent_pixel_id]) adjacent_pixel_ids.push_back(new_adjacent_pixel_id);
+    };
+
+    if (connectivity == 8) {
+        add(0, -1); add(0, 1);
+        add(1, 0); add(1, -1); add(1, 1);
+        add(-1, 0); add(-1, -1); add(-1, 1);
+    } else if (col == n_cols - 1) {
+        add(0, -1); add(-1, 0); add(1, 0);
     } else {
-        if (pixel_id % global_config["N_COLS"][0] == 0) {  // pixel at the left edge, next pixel is the right edge of previous row
-            candidate_adjacent_pixel_ids = { pixel_id + 1, 
-                pixel_id + global_config["N_COLS"][0],
-                pixel_id - global_config["N_COLS"][0] };
-        } else if (pixel_id % global_config["N_COLS"][0] == global_config["N_COLS"][0] - 1) {  // pixel at the right edge, next pixel is the left edge of next row
-            candidate_adjacent_pixel_ids = { pixel_id - 1,
-                 pixel_id - global_config["N_COLS"][0], 
-                 pixel_id + global_config["N_COLS"][0] };
-        } else
-            candidate_adjacent_pixel_ids = { pixel_id - 1, pixel_id + 1, 
-                pixel_id + global_config["N_COLS"][0],
-                pixel_id - global_config["N_COLS"][0] };
+        add(0, -1); add(0, 1); add(1, 0); add(-1, 0);
     }
 
-    for (auto new_adjacent_pixel_id : candidate_adjacent_pixel_ids) {
-        if (new_adjacent_pixel_id >= 0 && new_adjacent_pixel_id < global_config["N_PIXELS"][0] && !pixels_ischeckeds[new_adjacent_pixel_id])
-            adjacent_pixel_ids.push_back(new_adjacent_pixel_id);
+    return 0;
+}
+
+
+// Add halo_radius rings of surrounding pixels (including the diagonal ones) to a cluster, no matter their values
+// pixels are marked as taken by stamping them with a new epoch for every cluster, so the marks never need clearing
+int add_halo_pixels(std::vector<int>& active_pixel_ids, const int halo_radius, std::vector<uint32_t>& pixels_epochs, uint32_t& epoch,
+    const int n_rows, const int n_cols) {
+
+    if (++epoch == 0) {  // the counter wrapped around, the old marks could be mistaken for new ones
+        std::fill(pixels_epochs.begin(), pixels_epochs.end(), 0);
+        epoch = 1;
+    }
+    for (auto active_pixel_id : active_pixel_ids) pixels_epochs[active_pixel_id] = epoch;
+
+    // every ring is made of the unmarked neighbours of the previous ring
+    size_t ring_start = 0;
+    for (int ring_i = 0; ring_i < halo_radius; ring_i++) {
+        const size_t ring_end = active_pixel_ids.size();
+        for (size_t active_i = ring_start; active_i < ring_end; active_i++) {
+            const int row = active_pixel_ids[active_i] / n_cols;
+            const int col = active_pixel_ids[active_i] % n_cols;
+            for (int d_row = -1; d_row <= 1; d_row++) {
+                for (int d_col = -1; d_col <= 1; d_col++) {
+                    int new_row = row + d_row, new_col = col + d_col;
+                    if (new_row < 0 || new_row >= n_rows || new_col < 0 || new_col >= n_cols) continue;
+                    int new_pixel_id = new_row * n_cols + new_col;
+                    if (pixels_epochs[new_pixel_id] == epoch) continue;
+                    pixels_epochs[new_pixel_id] = epoch;
+                    active_pixel_ids.push_back(new_pixel_id);
+                }
+            }
+        }
+        ring_start = ring_end;
     }
 
     return 0;
 }
 
 
-std::vector<Cluster> read_frames_images_to_clusters(const uint16_t* frames_images,
-    int n_frames,
-    const float* pixels_slopes,
-    const float* pixels_offsets,
-    const uint8_t* pixels_isvalids,
-    const float* pixels_thresholds,
-    const float* pixels_secondary_thresholds,
-    const int& global_start_frame_id,
-    const bool extended_mode) {
-
-    // distribute the frames to different threads
-    int n_frames_per_thread = n_frames / global_config["N_THREADS"][0];
-    std::vector<int> start_frame_ids(global_config["N_THREADS"][0]);
-    for (int thread_i = 0; thread_i < global_config["N_THREADS"][0]; thread_i++)
-        start_frame_ids[thread_i] = thread_i * n_frames_per_thread;
-    start_frame_ids.push_back(n_frames);
-
-    // find clusters in each frame in parallel
-    std::vector<std::vector<Cluster>> threads_clusters(global_config["N_THREADS"][0]);
-    #pragma omp parallel num_threads (global_config["N_THREADS"][0]) shared(start_frame_ids, pixels_slopes, pixels_offsets, pixels_isvalids, pixels_thresholds)
-    {
-        auto start_time = std::chrono::high_resolution_clock::now();
+// calibration and thresholds of one crystal, flattened for faster access in the clustering loop
+struct CrystalPixels {
+    int crystal_id;
+    std::vector<float> slopes;
+    std::vector<float> offsets;
+    std::vector<uint8_t> isvalids;
+    std::vector<float> thresholds;
+    std::vector<float> secondary_thresholds;
+};
+
+// read the calibration of a crystal, and its thresholds from the calibration file or from threshold_file unless it is
+// "from_calibration". the pixels without validity flags or thresholds in the files are invalid, with a zero threshold
+static CrystalPixels read_crystal_pixels(const RunConfig& config, const int crystal_id, const std::string& calibration_file, const std::string& threshold_file) {
+
+    const int n_pixels = config.n_pixels;
+    std::vector<std::vector<float>> pixels_calibrations(n_pixels);
+    std::vector<std::vector<float>> pixels_peaks(n_pixels);
+    CrystalPixels pixels;
+    pixels.crystal_id = crystal_id;
+    pixels.isvalids.assign(n_pixels, false);
+    pixels.thresholds.assign(n_pixels, 0);
+    read_pixels_calibrations(calibration_file, pixels_calibrations, pixels_peaks, pixels.isvalids, pixels.thresholds);
+    if (threshold_file != "from_calibration")
+        read_pixels_thresholds(threshold_file, pixels.thresholds);
+
+    // the flattened coefficients for faster access, and the secondary thresholds which ensure that there is at least 1 pixel
+    // in the cluster having energy larger than basic threshold + secondary threshold
+    pixels.slopes.resize(n_pixels);
+    pixels.offsets.resize(n_pixels);
+    pixels.secondary_thresholds.resize(n_pixels);
+    for (int pixel_id = 0; pixel_id < n_pixels; pixel_id++) {
+        pixels.slopes[pixel_id] = pixels_calibrations[pixel_id][0];
+        pixels.offsets[pixel_id] = pixels_calibrations[pixel_id][1];
+        pixels.secondary_thresholds[pixel_id] = pixels.thresholds[pixel_id] + config.secondary_thresholds[crystal_id] / pixels_calibrations[pixel_id][0];
+    }
+    return pixels;
+}
 
-        // get the start and end frame ids for this thread
-        int thread_id = omp_get_thread_num();
-        int start_frame_id = start_frame_ids[thread_id];
-        int end_frame_id = start_frame_ids[thread_id + 1];
+// working memory of one thread, allocated once per parallel region and reused for every frame
+struct ClusterScratch {
+    std::vector<char> pixels_ischeckeds;
+    std::vector<int> active_pixel_ids;
+    std::vector<int> adjacent_pixel_ids;
+    std::vector<uint32_t> pixels_epochs;
+    uint32_t epoch = 0;
+};
 
-        // std::vector<bool> pixels_ischeckeds(global_config["N_PIXELS"][0], false);
-        std::vector<char> pixels_ischeckeds(global_config["N_PIXELS"][0], 0);
+// histograms of the clusters of one crystal, accumulated while clustering so that spectra need no pass over the cluster files
+// energy_vs_size[size_i * n_energy_bins + bin_i] counts the clusters of size_i + 1 pixels by their total energy (the last row is for
+// the clusters larger than MAX_EVENT_PIXELS, energies out of the bins are not counted), pixels_single_counts counts the single-pixel
+// clusters of each pixel and multiplicity counts the frames by their number of clusters (the last bin includes all larger numbers)
+struct ClusterHistograms {
+    float energy_low = 0;
+    float energy_high = 0;
+    int n_energy_bins = 0;
+    int max_event_pixels = 0;
+    std::vector<uint64_t> energy_vs_size;
+    std::vector<uint64_t> pixels_single_counts;
+    std::vector<uint64_t> multiplicity;
+
+    void init(const float low, const float high, const int n_bins, const int max_pixels, const int n_pixels, const int max_multiplicity) {
+        energy_low = low;
+        energy_high = high;
+        n_energy_bins = n_bins;
+        max_event_pixels = max_pixels;
+        energy_vs_size.assign(static_cast<size_t>(max_pixels + 1) * n_bins, 0);
+        pixels_single_counts.assign(n_pixels, 0);
+        multiplicity.assign(max_multiplicity + 1, 0);
+    }
+
+    void reset() {
+        std::fill(energy_vs_size.begin(), energy_vs_size.end(), 0);
+        std::fill(pixels_single_counts.begin(), pixels_single_counts.end(), 0);
+        std::fill(multiplicity.begin(), multiplicity.end(), 0);
+    }
+
+    // add the clusters of a batch holding the frames [start_frame_id, end_frame_id) in order
+    void add_batch(const ClusterBatch& batch, const int start_frame_id, const int end_frame_id) {
+        const float bin_scale = n_energy_bins / (energy_high - energy_low);
+        const int max_multiplicity = static_cast<int>(multiplicity.size()) - 1;
+        size_t cluster_i = 0;
         for (int frame_id = start_frame_id; frame_id < end_frame_id; frame_id++) {
+            int n_frame_clusters = 0;
+            for (; cluster_i < batch.size() && batch.frame_ids[cluster_i] == frame_id; cluster_i++, n_frame_clusters++) {
+                const int size = batch.cluster_size(cluster_i);
+                float energy = 0;
+                for (uint32_t pixel_i = batch.offsets[cluster_i]; pixel_i < batch.offsets[cluster_i + 1]; pixel_i++)
+                    energy += batch.energies[pixel_i];
+                const int size_i = std::min(size, max_event_pixels + 1) - 1;
+                const float bin = (energy - energy_low) * bin_scale;
+                if (bin >= 0 && bin < n_energy_bins)
+                    energy_vs_size[static_cast<size_t>(size_i) * n_energy_bins + static_cast<int>(bin)]++;
+                if (size == 1) pixels_single_counts[batch.pixel_ids[batch.offsets[cluster_i]]]++;
+            }
+            multiplicity[std::min(n_frame_clusters, max_multiplicity)]++;
+        }
+    }
 
-            // get the frame image and set the bad pixels to be already checked
-            const uint16_t* frame_image = frames_images + static_cast<size_t>(frame_id) * global_config["N_PIXELS"][0];
-            for (int pixel_id = 0; pixel_id < global_config["N_PIXELS"][0]; pixel_id++)
-                pixels_ischeckeds[pixel_id] = !pixels_isvalids[pixel_id] || (frame_image[pixel_id] < pixels_thresholds[pixel_id]);
-
-            // check each pixel in order
-            for (int pixel_id = 0; pixel_id < global_config["N_PIXELS"][0]; pixel_id++) {
-
-                // though this pixel may be lower than the primary threshold
-                // it may be included in the cluster because it can be larger than the secondary threshold
-                // so we do not set it to be checked
-                if (pixels_ischeckeds[pixel_id])
-                    continue;
-
-                // we first locate the center pixel, then put it into adjacent_pixel_ids
-                // when the vector is not empty, we will pop the first element and check it
-                // during checking, all other possible pixels will be added to the end of the vector
-                std::vector<int> active_pixel_ids = {};
-                std::vector<int> adjacent_pixel_ids = { pixel_id };
-                while (!adjacent_pixel_ids.empty()) {
-                    int adjacent_pixel_id = adjacent_pixel_ids.front();
-                    adjacent_pixel_ids.erase(adjacent_pixel_ids.begin());
-
-                    if (!pixels_ischeckeds[adjacent_pixel_id]) {
-                        active_pixel_ids.push_back(adjacent_pixel_id); // if not checked, then add to the cluster
-                        add_adjacent_pixels(adjacent_pixel_id, adjacent_pixel_ids, pixels_ischeckeds, false); // and add its adjacent pixels to the list of adjacent pixels
-                        pixels_ischeckeds[adjacent_pixel_id] = true;  // and set it to be checked
-                    }
-                }
+    void merge(const ClusterHistograms& other) {
+        for (size_t i = 0; i < energy_vs_size.size(); i++) energy_vs_size[i] += other.energy_vs_size[i];
+        for (size_t i = 0; i < pixels_single_counts.size(); i++) pixels_single_counts[i] += other.pixels_single_counts[i];
+        for (size_t i = 0; i < multiplicity.size(); i++) multiplicity[i] += other.multiplicity[i];
+    }
 
-                // check if the cluster meets the secondary threshold requirement
-                bool meets_secondary_threshold = false;
-                for (auto& active_pixel_id : active_pixel_ids) {
-                    if (frame_image[active_pixel_id] >= pixels_secondary_thresholds[active_pixel_id]) {
-                        meets_secondary_threshold = true;
-                        break;
-                    }
-                }
-                if (!meets_secondary_threshold) continue;
-
-                // calculate energy
-                // we should include a layer of calculation to expand the cluster a little bit
-                // to include adjacent pixels ADU may not be that large for the clustering, but necessary for the charge sharing
-                // since these newly added pixels are directly used for charge sharing correction
-                // we put them into the active_pixel_ids
-                // for (auto& active_pixel_id : active_pixel_ids)
-                //    add_adjacent_pixels(active_pixel_ids, active_pixel_ids, pixels_isvalids, true);
-                // pack all active pixels into a cluster
-                std::vector<uint16_t> adus;
-                std::vector<float> energies;
-                float total_energy = 0;
-
-                // // add all neighboring pixels
-                if (extended_mode) {
-                    std::vector<char> blank_pixels_ischeckeds(global_config["N_PIXELS"][0], false);
-                    for (auto& active_pixel_id : active_pixel_ids) blank_pixels_ischeckeds[active_pixel_id] = true;
-                    for (auto& active_pixel_id : active_pixel_ids)
-                        add_adjacent_pixels(active_pixel_id, active_pixel_ids, blank_pixels_ischeckeds, true);
-                }
+    void save(const std::string& filename) const {
+        HighFive::File file(filename, HighFive::File::ReadWrite | HighFive::File::Create | HighFive::File::Truncate);
+        file.createDataSet("energy_bins", create_bins(n_energy_bins, energy_low, energy_high));
+        std::vector<size_t> dims{ static_cast<size_t>(max_event_pixels + 1), static_cast<size_t>(n_energy_bins) };
+        auto dset = file.createDataSet<uint64_t>("energy_vs_size", HighFive::DataSpace(dims));
+        dset.write_raw(energy_vs_size.data());
+        file.createDataSet("pixels_single_counts", pixels_single_counts);
+        file.createDataSet("multiplicity", multiplicity);
+    }
+};
 
-                for (auto& active_pixel_id : active_pixel_ids) {
-                    adus.push_back(frame_image[active_pixel_id]);
-                    float energy = pixels_slopes[active_pixel_id] * frame_image[active_pixel_id] + pixels_offsets[active_pixel_id];
-                    energy = energy > 0 ? energy : 0;
-                    total_energy += energy;
-                    energies.push_back(energy);
-                }
-                Cluster cluster = { global_start_frame_id + frame_id, active_pixel_ids, adus, energies};
-                threads_clusters[thread_id].push_back(cluster);
+// find the clusters in one frame image and append them to the batch
+int read_frame_image_to_clusters(const RunConfig& config, const uint16_t* frame_image, const int frame_id, const CrystalPixels& pixels,
+    const int connectivity, const int halo_radius, ClusterScratch& scratch, ClusterBatch& batch) {
+
+    const int n_pixels = config.n_pixels;
+    const int n_rows = config.n_rows;
+    const int n_cols = config.n_cols;
+    std::vector<char>& pixels_ischeckeds = scratch.pixels_ischeckeds;
+    std::vector<int>& active_pixel_ids = scratch.active_pixel_ids;
+    std::vector<int>& adjacent_pixel_ids = scratch.adjacent_pixel_ids;
+
+    // set the bad pixels to be already checked
+    for (int pixel_id = 0; pixel_id < n_pixels; pixel_id++)
+        pixels_ischeckeds[pixel_id] = !pixels.isvalids[pixel_id] || (frame_image[pixel_id] < pixels.thresholds[pixel_id]);
+
+    // check each pixel in order
+    for (int pixel_id = 0; pixel_id < n_pixels; pixel_id++) {
+
+        // though this pixel may be lower than the primary threshold
+        // it may be included in the cluster because it can be larger than the secondary threshold
+        // so we do not set it to be checked
+        if (pixels_ischeckeds[pixel_id])
+            continue;
+
+        // we first locate the center pixel, then put it into adjacent_pixel_ids
+        // while there are unvisited elements, we take the first one and check it
+        // during checking, all other possible pixels will be added to the end of the vector
+        active_pixel_ids.clear();
+        adjacent_pixel_ids.assign(1, pixel_id);
+        for (size_t adjacent_i = 0; adjacent_i < adjacent_pixel_ids.size(); adjacent_i++) {
+            int adjacent_pixel_id = adjacent_pixel_ids[adjacent_i];
+
+            if (!pixels_ischeckeds[adjacent_pixel_id]) {
+                active_pixel_ids.push_back(adjacent_pixel_id); // if not checked, then add to the cluster
+                add_adjacent_pixels(adjacent_pixel_id, adjacent_pixel_ids, pixels_ischeckeds, connectivity, n_rows, n_cols); // and add its adjacent pixels to the list of adjacent pixels
+                pixels_ischeckeds[adjacent_pixel_id] = true;  // and set it to be checked
             }
-
-            // // print the progress
-            // if (frame_id % 5000 == 0 && frame_id != 0) {
-            //     auto end_time = std::chrono::high_resolution_clock::now();
-            //     auto duration = std::chrono::duration_cast<std::chrono::seconds>(end_time - start_time);
-            //     int seconds = duration.count();  // This will give you the duration in seconds as an integer
-            //     #pragma omp critical
-            //     std::cout << format_string("\tThread {} finished frame {} in {} s", thread_id, frame_id, seconds) << std::endl;
-            // }
         }
 
+        // check if the cluster meets the secondary threshold requirement
+        bool meets_secondary_threshold = false;
+        for (auto& active_pixel_id : active_pixel_ids) {
+            if (frame_image[active_pixel_id] >= pixels.secondary_thresholds[active_pixel_id]) {
+                meets_secondary_threshold = true;
+                break;
+            }
+        }
+        if (!meets_secondary_threshold) continue;
+
+        // calculate energy
+        // we should include a layer of calculation to expand the cluster a little bit
+        // to include adjacent pixels ADU may not be that large for the clustering, but necessary for the charge sharing
+        // since these newly added pixels are directly used for charge sharing correction
+        // we put them into the active_pixel_ids
+
+        // add the rings of neighboring pixels
+        if (halo_radius > 0)
+            add_halo_pixels(active_pixel_ids, halo_radius, scratch.pixels_epochs, scratch.epoch, n_rows, n_cols);
+
+        // pack all active pixels into the batch
+        for (auto& active_pixel_id : active_pixel_ids) {
+            float energy = pixels.slopes[active_pixel_id] * frame_image[active_pixel_id] + pixels.offsets[active_pixel_id];
+            energy = energy > 0 ? energy : 0;
+            batch.add_pixel(active_pixel_id, frame_image[active_pixel_id], energy);
+        }
+        batch.close_cluster(frame_id);
     }
-    std::vector<Cluster> clusters;
-    for (auto &thread_clusters : threads_clusters)
-        clusters.insert(clusters.end(), thread_clusters.begin(), thread_clusters.end());
 
-    return clusters;
+    return 0;
 }
 
 
-int save_clusters(const std::string filename, const std::vector<Cluster> &clusters, int pixel_n, bool append) {
-
-    if (!append)  // if not in append mode, then remove the file if it exists
-        std::remove(filename.c_str());
+// find the clusters of n_frames frames images of all given crystals
+// the work is cut into tasks of one crystal and a block of frames, which are handed out dynamically to the threads,
+// so threads finishing a quiet block (or a quiet crystal) pick up the next task instead of waiting. with pinned threads
+// the tasks of a crystal go to the threads of the NUMA node holding its frames first.
+// tasks_batches[crystal_i * n_blocks + block_i] holds the clusters of each task, the batches are kept by the caller and
+// reused for every flow. since tasks are ordered by crystal and then by frame, writing the batches of one crystal one
+// after another keeps the order of the frames.
+// every thread also adds its batches to its own histograms of each crystal, which are merged into crystals_histograms at the end.
+int read_crystals_frames_images_to_clusters(const RunConfig& config, const uint16_t* crystals_frames_images,
+    int n_frames,
+    const std::vector<CrystalPixels>& crystals_pixels,
+    const int& global_start_frame_id,
+    const int connectivity,
+    const int halo_radius,
+    const int n_block_frames,
+    std::vector<ClusterBatch>& tasks_batches,
+    std::vector<ClusterHistograms>& crystals_histograms) {
+
+    const int n_pixels = config.n_pixels;
+    const int n_blocks = (n_frames + n_block_frames - 1) / n_block_frames;
+    const int n_tasks = static_cast<int>(crystals_pixels.size()) * n_blocks;
+    if (tasks_batches.size() < static_cast<size_t>(n_tasks)) tasks_batches.resize(n_tasks);
+    std::vector<int> tasks_nodes(n_tasks);
+    for (int task_i = 0; task_i < n_tasks; task_i++) tasks_nodes[task_i] = config.crystal_node(crystals_pixels[task_i / n_blocks].crystal_id);
+    NodeTaskQueue queue(config, tasks_nodes);
+
+    #pragma omp parallel num_threads (config.n_threads)
+    {
+        ClusterScratch scratch;
+        scratch.pixels_ischeckeds.resize(n_pixels);
+        scratch.pixels_epochs.assign(n_pixels, 0);
+        std::vector<ClusterHistograms> thread_histograms(crystals_histograms);
+        for (auto& histograms : thread_histograms) histograms.reset();
+
+        const int thread_i = omp_get_thread_num();
+        for (int task_i = queue.next(thread_i); task_i >= 0; task_i = queue.next(thread_i)) {
+            const CrystalPixels& pixels = crystals_pixels[task_i / n_blocks];
+            const int start_frame_id = (task_i % n_blocks) * n_block_frames;
+            const int end_frame_id = std::min(start_frame_id + n_block_frames, n_frames);
+            const uint16_t* frames_images = crystals_frames_images + config.plane_offset(pixels.crystal_id);
+
+            ClusterBatch& batch = tasks_batches[task_i];
+            batch.clear();
+            for (int frame_id = start_frame_id; frame_id < end_frame_id; frame_id++) {
+                const uint16_t* frame_image = frames_images + static_cast<size_t>(frame_id) * n_pixels;
+                read_frame_image_to_clusters(config, frame_image, global_start_frame_id + frame_id, pixels, connectivity, halo_radius, scratch, batch);
+            }
+            thread_histograms[task_i / n_blocks].add_batch(batch, global_start_frame_id + start_frame_id, global_start_frame_id + end_frame_id);
+        }
 
-    std::ofstream file(filename, std::ios::binary | std::ios::app);
-    if (!file.is_open()) throw std::runtime_error("Cannot open: " + filename);
+        #pragma omp critical
+        for (size_t crystal_i = 0; crystal_i < crystals_histograms.size(); crystal_i++)
+            crystals_histograms[crystal_i].merge(thread_histograms[crystal_i]);
+    }
 
-    for (const auto& cluster : clusters) {
+    return 0;
+}
 
-        size_t num_pixels = cluster.pixel_ids.size();
-        if (pixel_n > 0 && num_pixels != static_cast<size_t>(pixel_n)) continue;
-        std::vector<uint16_t> pixel_ids_uint16(cluster.pixel_ids.begin(), cluster.pixel_ids.end()); // this is to make sure the memory alignment, since there are equal number of pixel_ids and adus
-        file.write(reinterpret_cast<const char*>(&cluster.frame_id), 4); // int, 4 bytes
-        file.write(reinterpret_cast<const char*>(&num_pixels), 4); // int, 4 bytes
 
-        file.write(reinterpret_cast<const char*>(pixel_ids_uint16.data()), num_pixels * sizeof(uint16_t));
-        file.write(reinterpret_cast<const char*>(cluster.adus.data()), num_pixels * sizeof(uint16_t));
-        file.write(reinterpret_cast<const char*>(cluster.energies.data()), num_pixels * sizeof(float));
+// find the clusters of n_frames frames images of one crystal with its calibration and thresholds, the frames are numbered from 0.
+// the blocks of frames are clustered in parallel and their batches joined in the order of the frames
+int frames_images_to_clusters(const RunConfig& config, const uint16_t* frames_images, const int n_frames, const int crystal_id,
+    const std::string& calibration_file, const std::string& threshold_file, const int connectivity, const int halo_radius, ClusterBatch& batch) {
+
+    if (connectivity != 4 && connectivity != 8)
+        throw std::invalid_argument(format_string("Connectivity must be 4 or 8, got {}", connectivity));
+    if (halo_radius < 0)
+        throw std::invalid_argument(format_string("Halo radius must not be negative, got {}", halo_radius));
+    if (crystal_id < 0 || crystal_id >= config.n_crystals)
+        throw std::invalid_argument(format_string("Invalid crystal id {}", crystal_id));
+    const CrystalPixels pixels = read_crystal_pixels(config, crystal_id, calibration_file, threshold_file);
+
+    const int n_pixels = config.n_pixels;
+    const int n_block_frames = config.block_frames;
+    const int n_blocks = (n_frames + n_block_frames - 1) / n_block_frames;
+    std::vector<ClusterBatch> blocks_batches(n_blocks);
+    #pragma omp parallel num_threads(config.n_threads)
+    {
+        ClusterScratch scratch;
+        scratch.pixels_ischeckeds.resize(n_pixels);
+        scratch.pixels_epochs.assign(n_pixels, 0);
+        #pragma omp for schedule(dynamic, 1)
+        for (int block_i = 0; block_i < n_blocks; block_i++) {
+            const int end_frame_id = std::min((block_i + 1) * n_block_frames, n_frames);
+            for (int frame_id = block_i * n_block_frames; frame_id < end_frame_id; frame_id++)
+                read_frame_image_to_clusters(config, frames_images + static_cast<size_t>(frame_id) * n_pixels, frame_id, pixels,
+                    connectivity, halo_radius, scratch, blocks_batches[block_i]);
+        }
     }
 
-    file.close();
+    batch.clear();
+    for (const auto& block_batch : blocks_batches) {
+        for (size_t cluster_i = 0; cluster_i < block_batch.size(); cluster_i++) {
+            for (uint32_t pixel_i = block_batch.offsets[cluster_i]; pixel_i < block_batch.offsets[cluster_i + 1]; pixel_i++)
+                batch.add_pixel(block_batch.pixel_ids[pixel_i], block_batch.adus[pixel_i], block_batch.energies[pixel_i]);
+            batch.close_cluster(block_batch.frame_ids[cluster_i]);
+        }
+    }
     return 0;
 }
 
-int raw2clusters(const std::vector<std::string> rawfiles, const std::string crystals_cluster_folder,
-    const std::vector<std::string> crystals_calibration_files, const std::vector<std::string> crystals_threshold_files, const bool clear_file, const bool extended_mode) {
+
+// the histograms with a copy per thread, the frames container and the cluster batches of the tasks, the output buffers and
+// the stitched and linked clusters, and the staged triggered frames which are at most a flow of the active crystals
+FlowMemory raw2clusters_memory(const RunConfig& config, const bool stitch, const int temporal_window, const FrameTrigger& frame_trigger) {
+    FlowMemory memory;
+    const size_t histograms_bytes = (static_cast<size_t>(config.max_event_pixels + 1) * config.cluster_energy_bins + config.n_pixels + config.max_multiplicity + 1) * sizeof(uint64_t);
+    memory.fixed_bytes = histograms_bytes * config.n_planes() * (config.n_threads + 1);
+    const size_t n_batches = 2 + stitch + (temporal_window > 0);
+    const size_t cluster_pixel_bytes = 2 * sizeof(uint16_t) + sizeof(float) + sizeof(int) + sizeof(uint32_t);
+    memory.frame_bytes = static_cast<size_t>(config.n_planes()) * config.n_pixels * sizeof(uint16_t)
+        + static_cast<size_t>(config.n_planes() * config.n_pixels * CLUSTER_PIXELS_FRACTION * cluster_pixel_bytes * n_batches);
+    if (frame_trigger.enabled) {
+        memory.fixed_bytes += static_cast<size_t>(config.n_planes()) * frame_trigger.pre * config.n_pixels * sizeof(uint16_t);
+        memory.frame_bytes += static_cast<size_t>(config.n_planes()) * config.n_pixels * sizeof(uint16_t);
+    }
+    return memory;
+}
+
+int raw2clusters(const RunConfig& config, const std::vector<std::string> rawfiles, const std::string crystals_cluster_folder,
+    const std::vector<std::string> crystals_calibration_files, const std::vector<std::string> crystals_threshold_files, const bool clear_file,
+    const int connectivity, const int halo_radius, const std::string output_format, const std::string energy_encoding, const bool histograms_only, const bool stitch, const int temporal_window,
+    const FrameTrigger& frame_trigger) {
+
+    if (connectivity != 4 && connectivity != 8)
+        throw std::invalid_argument(format_string("Connectivity must be 4 or 8, got {}", connectivity));
+    if (halo_radius < 0)
+        throw std::invalid_argument(format_string("Halo radius must not be negative, got {}", halo_radius));
+    if (temporal_window < 0)
+        throw std::invalid_argument(format_string("Temporal window must not be negative, got {}", temporal_window));
+    config.require({ "CLUSTER_ENERGY_MIN", "CLUSTER_ENERGY_MAX", "CLUSTER_ENERGY_BINS", "MAX_MULTIPLICITY" });
 
     // create output folder if not exists
     if (!std::filesystem::exists(crystals_cluster_folder))
         std::filesystem::create_directory(crystals_cluster_folder);
 
-    std::vector<std::vector<uint8_t>> crystals_pixels_isvalids(global_config["N_CRYSTALS"][0], std::vector<uint8_t>(global_config["N_PIXELS"][0], false));
-    std::vector<std::vector<std::vector<float>>> crystals_pixels_peaks(global_config["N_CRYSTALS"][0], std::vector<std::vector<float>>(global_config["N_PIXELS"][0]));
-    std::vector<std::vector<std::vector<float>>> crystals_pixels_calibrations(global_config["N_CRYSTALS"][0], std::vector<std::vector<float>>(global_config["N_PIXELS"][0]));
-    std::vector<std::vector<float>> crystals_pixels_thresholds(global_config["N_CRYSTALS"][0], std::vector<float>(global_config["N_PIXELS"][0], 0));
-    std::vector<std::vector<float>> crystals_pixels_secondary_thresholds(global_config["N_CRYSTALS"][0], std::vector<float>(global_config["N_PIXELS"][0], 0));
-    for (int crystal_id = 0; crystal_id < global_config["N_CRYSTALS"][0]; crystal_id++) {
+    // the calibration coefficients and thresholds of the active crystals
+    std::vector<CrystalPixels> crystals_pixels;
+    for (int crystal_id = 0; crystal_id < config.n_crystals; crystal_id++) {
         if (crystals_calibration_files[crystal_id] == "skip") continue;
         std::cout << format_string("Reading calibration and threshold files for crystal {} ...", crystal_id) << std::endl;
-        // read pixels calibrations and thresholds
-        read_pixels_calibrations(crystals_calibration_files[crystal_id],
-            crystals_pixels_calibrations[crystal_id],
-            crystals_pixels_peaks[crystal_id],
-            crystals_pixels_isvalids[crystal_id],
-            crystals_pixels_thresholds[crystal_id]);
-
-        // read pixels thresholds
-        if (crystals_threshold_files[crystal_id] != "from_calibration") {
-            read_pixels_thresholds(crystals_threshold_files[crystal_id], crystals_pixels_thresholds[crystal_id]);
-        }
-
-        // calculate secondary thresholds
-        for (int pixel_id = 0; pixel_id < global_config["N_PIXELS"][0]; pixel_id++) {
-            crystals_pixels_secondary_thresholds[crystal_id][pixel_id] = crystals_pixels_thresholds[crystal_id][pixel_id] + global_config["SECONDARY_THRESHOLD"][crystal_id] / crystals_pixels_calibrations[crystal_id][pixel_id][0]; // this is to ensure that thare is at least 1 pixel in the cluster having energy larger than basic threshold + secondary threshold
-        }
+        crystals_pixels.push_back(read_crystal_pixels(config, crystal_id, crystals_calibration_files[crystal_id], crystals_threshold_files[crystal_id]));
     }
 
 
-    // since the clusters can be very large. we need to use append mode to write them into files.
-    for (int crystal_id = 0; crystal_id < global_config["N_CRYSTALS"][0]; crystal_id++) {
-        if (crystals_calibration_files[crystal_id] == "skip") continue;
-        for (int pixel_n = 1; pixel_n <= global_config["MAX_EVENT_PIXELS"][0]; pixel_n++) {
-            std::string cluster_file = format_string("{}\\clusters_crystal_{}_pixel_{}.bin", crystals_cluster_folder, crystal_id, pixel_n);
-            if (extended_mode)
-                cluster_file = format_string("{}\\clusters_crystal_{}_pixel_{}_extended.bin", crystals_cluster_folder, crystal_id, pixel_n);
-            if (clear_file) std::ofstream file(cluster_file, std::ios::binary | std::ios::trunc); // 清空文件
+    // since the clusters can be very large, they are appended to the files after every flow.
+    // the files of all crystals and cluster sizes are opened only once for the whole run.
+    std::vector<int> active_crystal_ids;
+    for (int crystal_id = 0; crystal_id < config.n_crystals; crystal_id++)
+        if (crystals_calibration_files[crystal_id] != "skip") active_crystal_ids.push_back(crystal_id);
+    for (auto crystal_id : active_crystal_ids)
+        if (config.crystals_planes[crystal_id] < 0)
+            throw std::invalid_argument(format_string("Crystal {} has a calibration file but is not read, see RunConfig::set_active_crystals", crystal_id));
+    // extended clusters (with a halo) and 8-connected clusters are marked in the file names
+    std::string suffix = halo_radius == 0 ? "" : halo_radius == 1 ? "_extended" : format_string("_extended_{}", halo_radius);
+    if (connectivity == 8) suffix += "_conn8";
+    // the clusters, the stitched clusters and the temporal events are all written in the output format
+    auto make_cluster_output = [&](const std::vector<int>& unit_ids, const std::string& output_suffix, const std::string& stem) -> std::unique_ptr<ClusterOutput> {
+        if (output_format == "bin")
+            return std::make_unique<ClusterWriter>(crystals_cluster_folder, unit_ids, config.max_event_pixels, output_suffix, clear_file, stem);
+        if (output_format == "h5")
+            return std::make_unique<ClusterH5Writer>(crystals_cluster_folder, unit_ids, output_suffix, stem);
+        if (output_format == "compact")
+            return std::make_unique<ClusterCompactWriter>(crystals_cluster_folder, unit_ids, output_suffix, energy_encoding, stem);
+        throw std::invalid_argument("Unknown cluster output format: " + output_format);
+    };
+    // with histograms_only no cluster file is written at all
+    std::unique_ptr<ClusterOutput> cluster_output;
+    if (!histograms_only)
+        cluster_output = make_cluster_output(active_crystal_ids, suffix, "clusters_crystal");
+
+    // the clusters stitched across the crystals of the panel are written to clusters_panel_0{}, the invalid pixels never join them
+    std::unique_ptr<ClusterStitcher> stitcher;
+    std::unique_ptr<ClusterOutput> panel_output;
+    if (stitch) {
+        std::vector<std::vector<float>> crystals_thresholds;
+        for (const auto& pixels : crystals_pixels) {
+            crystals_thresholds.push_back(pixels.thresholds);
+            for (int pixel_id = 0; pixel_id < config.n_pixels; pixel_id++)
+                if (!pixels.isvalids[pixel_id]) crystals_thresholds.back()[pixel_id] = std::numeric_limits<float>::infinity();
         }
+        stitcher = std::make_unique<ClusterStitcher>(config, active_crystal_ids, crystals_thresholds, connectivity);
+        if (!histograms_only && output_format == "compact" && energy_encoding == "omit")
+            throw std::invalid_argument("The stitched clusters need their energies, use the fixed energy encoding");
+        if (!histograms_only)
+            panel_output = make_cluster_output({ 0 }, suffix, "clusters_panel");
+    }
+
+    const int n_pixels = config.n_pixels;
+
+    // histograms of the clusters of the active crystals over all raw files
+    std::vector<ClusterHistograms> crystals_histograms(crystals_pixels.size());
+    for (auto& histograms : crystals_histograms)
+        histograms.init(config.cluster_energy_min, config.cluster_energy_max, config.cluster_energy_bins,
+            config.max_event_pixels, n_pixels, config.max_multiplicity);
+
+    // the clusters linked across frames are written to clusters_crystal_{}{}_temporal, one linker per crystal
+    std::unique_ptr<ClusterOutput> temporal_output;
+    std::vector<ClusterTemporalLinker> crystals_linkers;
+    std::vector<ClusterBatch> crystals_temporal_batches(crystals_pixels.size());
+    if (temporal_window > 0 && !histograms_only) {
+        // the energies of the hits summed into one entry cannot be recomputed from the summed ADU
+        if (output_format == "compact" && energy_encoding == "omit")
+            throw std::invalid_argument("The temporal events need their energies, use the fixed energy encoding");
+        temporal_output = make_cluster_output(active_crystal_ids, suffix + "_temporal", "clusters_crystal");
+        for (const auto& pixels : crystals_pixels) crystals_linkers.emplace_back(temporal_window, pixels.thresholds);
     }
 
+    // the frames triggered by the clusters are written to triggered_frames_crystal_{}{}.h5
+    std::unique_ptr<TriggeredFramesWriter> triggered_output;
+    if (frame_trigger.enabled)
+        triggered_output = std::make_unique<TriggeredFramesWriter>(crystals_cluster_folder, active_crystal_ids, suffix, frame_trigger, n_pixels);
+
     // define the data container for frames images (flat)
-    const int n_crystals = global_config["N_CRYSTALS"][0];
-    const int max_frames = global_config["MAX_FRAMES_SIZE"][0];
-    const int n_pixels = global_config["N_PIXELS"][0];
-    std::vector<uint16_t> crystals_frames_images(static_cast<size_t>(n_crystals) * max_frames * n_pixels, 0);
+    FlowBuffer crystals_frames_images(config);
 
     // read raw files one by one
-    const int n_frame_pixels = global_config["N_CRYSTALS"][0] * global_config["N_PIXELS_PREMERGE"][0];
-    std::vector<std::vector<Cluster>> crystals_clusters(global_config["N_CRYSTALS"][0]);
+    // the cluster batches of each task are reused for every flow
+    const int n_frame_pixels = config.frame_size();
+    const int n_block_frames = config.block_frames;
+    std::vector<ClusterBatch> tasks_batches;
+    std::vector<ClusterBatch> blocks_panel_batches;
     for (auto& rawfile : rawfiles) {
 
         // read the rawfile by chunks
+        if (cluster_output) cluster_output->begin_rawfile(rawfile);
+        if (panel_output) panel_output->begin_rawfile(rawfile);
+        if (temporal_output) temporal_output->begin_rawfile(rawfile);
+        if (triggered_output) triggered_output->begin_rawfile(rawfile);
         std::ifstream file(rawfile, std::ios::binary | std::ios::ate);
         size_t file_size = file.tellg();
         size_t n_frames = file_size / n_frame_pixels / sizeof(uint16_t);
         file.close();
 
-        int n_flow_times = (n_frames + global_config["MAX_FRAMES_SIZE"][0] - 1) / global_config["MAX_FRAMES_SIZE"][0];
+        int n_flow_times = (n_frames + config.max_frames_size - 1) / config.max_frames_size;
         for (int flow_i = 0; flow_i < n_flow_times; flow_i++) {
-            int start_frame_id = flow_i * global_config["MAX_FRAMES_SIZE"][0];
-            int end_frame_id = start_frame_id + global_config["MAX_FRAMES_SIZE"][0] < n_frames ? start_frame_id + global_config["MAX_FRAMES_SIZE"][0] : n_frames;
-
-            read_rawfile_to_crystals_frames_images(rawfile, start_frame_id, end_frame_id, crystals_frames_images.data());
-
-            for (int crystal_id = 0; crystal_id < n_crystals; crystal_id++) {
-                if (crystals_calibration_files[crystal_id] == "skip") continue;
-                std::cout << format_string("Start clustering crystal {} from file {}, frames {} to {} ...", crystal_id, rawfile, start_frame_id, end_frame_id) << std::endl;
-                const int frames_in_chunk = end_frame_id - start_frame_id;
-                const uint16_t* frames_ptr = crystals_frames_images.data() + (static_cast<size_t>(crystal_id) * max_frames) * n_pixels;
-
-                // flatten calibration coefficients for faster access
-                std::vector<float> pixels_slopes(n_pixels), pixels_offsets(n_pixels);
-                for (int p = 0; p < n_pixels; ++p) {
-                    pixels_slopes[p] = crystals_pixels_calibrations[crystal_id][p][0];
-                    pixels_offsets[p] = crystals_pixels_calibrations[crystal_id][p][1];
+            int start_frame_id = flow_i * config.max_frames_size;
+            int end_frame_id = start_frame_id + config.max_frames_size < n_frames ? start_frame_id + config.max_frames_size : n_frames;
+
+            read_rawfile_to_crystals_frames_images(config, rawfile, start_frame_id, end_frame_id, crystals_frames_images.data());
+
+            // all active crystals are clustered together, so that the threads are balanced across crystals
+            std::cout << format_string("Start clustering {} crystals from file {}, frames {} to {} ...", crystals_pixels.size(), rawfile, start_frame_id, end_frame_id) << std::endl;
+            const int frames_in_chunk = end_frame_id - start_frame_id;
+            read_crystals_frames_images_to_clusters(config, crystals_frames_images.data(), frames_in_chunk, crystals_pixels,
+                start_frame_id, connectivity, halo_radius, n_block_frames, tasks_batches, crystals_histograms);
+
+            // write the batches in the order of the tasks, which gives the same order of the frames as clustering serially
+            const int n_blocks = (frames_in_chunk + n_block_frames - 1) / n_block_frames;
+            for (size_t crystal_i = 0; crystal_i < crystals_pixels.size(); crystal_i++) {
+                const int crystal_id = crystals_pixels[crystal_i].crystal_id;
+                size_t n_clusters = 0;
+                for (int block_i = 0; block_i < n_blocks; block_i++) {
+                    const ClusterBatch& batch = tasks_batches[crystal_i * n_blocks + block_i];
+                    if (cluster_output) cluster_output->write(crystal_id, batch);
+                    n_clusters += batch.size();
                 }
+                std::cout << format_string("Finish clustering crystal {} from file {}, frames {} to {}, Events per frames={} ...", crystal_id, rawfile, start_frame_id, end_frame_id, n_clusters / frames_in_chunk) << std::endl;
+            }
+            if (cluster_output) cluster_output->flush();
+
+            // the triggered frames are still in the container, so they are selected before the next flow is read
+            if (triggered_output) {
+                for (size_t crystal_i = 0; crystal_i < crystals_pixels.size(); crystal_i++) {
+                    const int crystal_id = crystals_pixels[crystal_i].crystal_id;
+                    std::vector<const ClusterBatch*> batches;
+                    for (int block_i = 0; block_i < n_blocks; block_i++)
+                        batches.push_back(&tasks_batches[crystal_i * n_blocks + block_i]);
+                    const uint16_t* frames_images = crystals_frames_images.data() + config.plane_offset(crystal_id);
+                    triggered_output->add_flow(crystal_id, frames_images, start_frame_id, frames_in_chunk, batches);
+                }
+            }
 
-                std::vector<Cluster> file_crystal_clusters = read_frames_images_to_clusters(
-                    frames_ptr, frames_in_chunk, pixels_slopes.data(), pixels_offsets.data(),
-                    crystals_pixels_isvalids[crystal_id].data(), crystals_pixels_thresholds[crystal_id].data(),
-                    crystals_pixels_secondary_thresholds[crystal_id].data(), start_frame_id, extended_mode);
-                crystals_clusters[crystal_id].insert(crystals_clusters[crystal_id].end(), file_crystal_clusters.begin(), file_crystal_clusters.end());
-
-                std::cout << format_string("Finish clustering crystal {} from file {}, frames {} to {}, Events per frames={} ...", crystal_id, rawfile, start_frame_id, end_frame_id, file_crystal_clusters.size() / frames_in_chunk) << std::endl;
+            // the blocks hold the same frames for all crystals, so they are stitched independently
+            if (panel_output) {
+                if (blocks_panel_batches.size() < static_cast<size_t>(n_blocks)) blocks_panel_batches.resize(n_blocks);
+                #pragma omp parallel for schedule(dynamic, 1) num_threads(config.n_threads)
+                for (int block_i = 0; block_i < n_blocks; block_i++) {
+                    std::vector<const ClusterBatch*> crystals_batches;
+                    for (size_t crystal_i = 0; crystal_i < crystals_pixels.size(); crystal_i++)
+                        crystals_batches.push_back(&tasks_batches[crystal_i * n_blocks + block_i]);
+                    blocks_panel_batches[block_i].clear();
+                    stitcher->stitch(crystals_batches, blocks_panel_batches[block_i]);
+                }
+                size_t n_clusters = 0;
+                for (int block_i = 0; block_i < n_blocks; block_i++) {
+                    panel_output->write(0, blocks_panel_batches[block_i]);
+                    n_clusters += blocks_panel_batches[block_i].size();
+                }
+                panel_output->flush();
+                std::cout << format_string("Finish stitching crystals from file {}, frames {} to {}, Events per frames={} ...", rawfile, start_frame_id, end_frame_id, n_clusters / frames_in_chunk) << std::endl;
             }
 
-            for (int crystal_id = 0; crystal_id < global_config["N_CRYSTALS"][0]; crystal_id++) {
-                if (crystals_calibration_files[crystal_id] == "skip") continue;
-                std::string cluster_file = format_string("{}\\clusters_crystal_{}.bin", crystals_cluster_folder, crystal_id);
-                for (int pixel_n = 1; pixel_n <= global_config["MAX_EVENT_PIXELS"][0]; pixel_n++) {
-                    std::string cluster_file = format_string("{}\\clusters_crystal_{}_pixel_{}.bin", crystals_cluster_folder, crystal_id, pixel_n);
-                    if (extended_mode)
-                        cluster_file = format_string("{}\\clusters_crystal_{}_pixel_{}_extended.bin", crystals_cluster_folder, crystal_id, pixel_n);
-                    save_clusters(cluster_file, crystals_clusters[crystal_id], pixel_n, true);
+            // the crystals are linked in parallel, each through all blocks in order, the open events of the last frames are
+            // kept for the next flow and closed at the end of the raw file
+            if (temporal_output) {
+                #pragma omp parallel for schedule(dynamic, 1) num_threads(config.n_threads)
+                for (int crystal_i = 0; crystal_i < static_cast<int>(crystals_pixels.size()); crystal_i++) {
+                    crystals_temporal_batches[crystal_i].clear();
+                    for (int block_i = 0; block_i < n_blocks; block_i++)
+                        crystals_linkers[crystal_i].link(tasks_batches[crystal_i * n_blocks + block_i], crystals_temporal_batches[crystal_i]);
+                    if (flow_i == n_flow_times - 1) crystals_linkers[crystal_i].finish(crystals_temporal_batches[crystal_i]);
                 }
-                crystals_clusters[crystal_id].clear();
+                for (size_t crystal_i = 0; crystal_i < crystals_pixels.size(); crystal_i++) {
+                    temporal_output->write(crystals_pixels[crystal_i].crystal_id, crystals_temporal_batches[crystal_i]);
+                    std::cout << format_string("Finish linking crystal {} from file {}, frames {} to {}, Events={} ...", crystals_pixels[crystal_i].crystal_id, rawfile, start_frame_id, end_frame_id, crystals_temporal_batches[crystal_i].size()) << std::endl;
+                }
+                temporal_output->flush();
             }
 
         }
     }
+    if (cluster_output) cluster_output->close();
+    if (panel_output) panel_output->close();
+    if (temporal_output) temporal_output->close();
+    if (triggered_output) triggered_output->close();
+
+    for (size_t crystal_i = 0; crystal_i < crystals_pixels.size(); crystal_i++) {
+        std::string filename = crystals_cluster_folder + "\\" + format_string("cluster_histograms_crystal_{}{}.h5", crystals_pixels[crystal_i].crystal_id, suffix);
+        crystals_histograms[crystal_i].save(filename);
+    }
     return 0;
 }
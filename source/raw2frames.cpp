@@ -7,29 +7,58 @@
 #include <filesystem>
 #include <cstdint>
 #include <stdexcept>
-#include <cstdlib>
+#include <functional>
 #include "highfive/HighFive.hpp"
 
 #include "header.hpp"
 
-int raw2frames(const std::vector<std::string> rawfiles, const std::string crystals_frames_folder) {
+// in the file export mode, the frames are stored in chunks of this many frames, compressed with this level
+static const hsize_t FRAMES_CHUNK_FRAMES = 64;
+static const unsigned FRAMES_DEFLATE_LEVEL = 4;
+// number of frames containers, a flow is read while up to FRAMES_WRITE_BUFFERS - 1 flows are written
+static const size_t FRAMES_WRITE_BUFFERS = 2;
+
+// the frames containers
+FlowMemory raw2frames_memory(const RunConfig& config) {
+    FlowMemory memory;
+    memory.frame_bytes = FRAMES_WRITE_BUFFERS * config.n_planes() * config.n_pixels * sizeof(uint16_t);
+    return memory;
+}
+
+// export modes:
+// flow: one file per flow and crystal, frames_{start}_{end}_crystal_{}.h5 with the frames of the flow
+// file: one file per raw file and crystal, frames_{raw file name}_crystal_{}.h5 with all frames of the raw file
+//       in an extendible dataset, chunked by FRAMES_CHUNK_FRAMES frames and compressed with shuffle and deflate
+int raw2frames(const RunConfig& config, const std::vector<std::string> rawfiles, const std::string crystals_frames_folder, const std::string export_mode) {
+
+    if (export_mode != "flow" && export_mode != "file")
+        throw std::invalid_argument("Unknown frames export mode: " + export_mode);
 
     // create output folder
     if (!std::filesystem::exists(crystals_frames_folder)) {
         std::filesystem::create_directories(crystals_frames_folder);
     }
 
-    // define the data container for frames images
-    uint16_t* crystals_frames_images = (uint16_t*) calloc(
-        static_cast<size_t>(global_config["N_CRYSTALS"][0]) * global_config["MAX_FRAMES_SIZE"][0] * global_config["N_PIXELS"][0],
-        sizeof(uint16_t)
-    );
+    // define the data containers for frames images, one per flow being written
+    // the flow read into one container is written by the writer thread while the next flow is read into the other one
+    const int n_crystals = config.n_crystals;
+    const size_t n_pixels = static_cast<size_t>(config.n_pixels);
+    // the offsets of the crystals in a container, copied into the jobs of the writer
+    std::vector<size_t> crystals_offsets(n_crystals);
+    for (int crystal_id = 0; crystal_id < n_crystals; ++crystal_id) crystals_offsets[crystal_id] = config.plane_offset(crystal_id);
+    std::vector<FlowBuffer> crystals_frames_images;
+    for (size_t buffer_i = 0; buffer_i < FRAMES_WRITE_BUFFERS; buffer_i++) crystals_frames_images.emplace_back(config);
+    std::vector<size_t> buffers_jobs(FRAMES_WRITE_BUFFERS, 0);
+    std::vector<char> buffers_used(FRAMES_WRITE_BUFFERS, false);
+    // all HDF5 calls are made by the jobs of the writer, declared after the buffers so it is done before they are freed
+    AsyncWriter writer(FRAMES_WRITE_BUFFERS - 1);
 
     // collapse each raw data file into a spectrum
     // In order to limit the size of these frames, they should be updated for every file;
     // otherwise, they will be very large after reading all files.
     // Everytime a file is read, we tally it immediately.
-    const size_t n_frame_pixels = global_config["N_CRYSTALS"][0] * global_config["N_PIXELS_PREMERGE"][0];
+    const size_t n_frame_pixels = config.frame_size();
+    size_t buffer_i = 0;
     for (auto& rawfile : rawfiles) {
 
         // since sometimes we deal with ultra-large rawfiles, we must read and analyze them in chunks.
@@ -40,38 +69,72 @@ int raw2frames(const std::vector<std::string> rawfiles, const std::string crysta
         file.close();
 
         // divide 1 file into multiple chunks and then read in parallel
-        int n_flow_times = (n_frames + global_config["MAX_FRAMES_SIZE"][0] - 1) / global_config["MAX_FRAMES_SIZE"][0];
+        int n_flow_times = (n_frames + config.max_frames_size - 1) / config.max_frames_size;
         std::cout << "Reading file: " << rawfile << ", total frames: " << n_frames << ", divided into " << n_flow_times << " flows." << std::endl;
+
+        // in the file mode, the files of the raw file are created empty and the frames of every flow are appended
+        // the files are shared by the jobs of the raw file and closed by its last job
+        auto crystals_files = std::make_shared<std::vector<std::unique_ptr<HighFive::File>>>();
+        if (export_mode == "file") {
+            const std::string rawfile_name = std::filesystem::path(rawfile).stem().string();
+            writer.submit([=]() {
+                for (int crystal_id = 0; crystal_id < n_crystals; ++crystal_id) {
+                    std::string out_path = crystals_frames_folder + "\\" + format_string("frames_{}_crystal_{}.h5", rawfile_name, crystal_id);
+                    auto out_file = std::make_unique<HighFive::File>(out_path, HighFive::File::ReadWrite | HighFive::File::Create | HighFive::File::Truncate);
+                    HighFive::DataSetCreateProps props;
+                    props.add(HighFive::Chunking(std::vector<hsize_t>{ FRAMES_CHUNK_FRAMES, n_pixels }));
+                    props.add(HighFive::Shuffle());
+                    props.add(HighFive::Deflate(FRAMES_DEFLATE_LEVEL));
+                    HighFive::DataSpace space({ 0, n_pixels }, { HighFive::DataSpace::UNLIMITED, n_pixels });
+                    out_file->createDataSet<uint16_t>("frames", space, props);
+                    crystals_files->push_back(std::move(out_file));
+                }
+            });
+        }
         for (int flow_i = 0; flow_i < n_flow_times; flow_i++) {
 
-            int start_frame_id = flow_i * global_config["MAX_FRAMES_SIZE"][0];
-            int end_frame_id = start_frame_id + global_config["MAX_FRAMES_SIZE"][0] < n_frames ? start_frame_id + global_config["MAX_FRAMES_SIZE"][0] : n_frames;
+            int start_frame_id = flow_i * config.max_frames_size;
+            int end_frame_id = start_frame_id + config.max_frames_size < n_frames ? start_frame_id + config.max_frames_size : n_frames;
 
-            read_rawfile_to_crystals_frames_images(rawfile, start_frame_id, end_frame_id, crystals_frames_images);
+            // the container is free again once the flow it held is written
+            if (buffers_used[buffer_i]) writer.wait(buffers_jobs[buffer_i]);
+            const uint16_t* frames_images = crystals_frames_images[buffer_i].data();
+            read_rawfile_to_crystals_frames_images(config, rawfile, start_frame_id, end_frame_id, crystals_frames_images[buffer_i].data());
 
             // save the frames using HighFive (HDF5 C++ wrapper)
+            // only the frames of this flow are written, not the rest of the container left from the previous flow
             const size_t frames_in_chunk = static_cast<size_t>(end_frame_id - start_frame_id);
-            const size_t n_pixels = static_cast<size_t>(global_config["N_PIXELS"][0]);
-            for (int crystal_id = 0; crystal_id < global_config["N_CRYSTALS"][0]; ++crystal_id) {
-                std::string out_path = crystals_frames_folder + "\\" + format_string("frames_{}_{}_crystal_{}.h5", start_frame_id, end_frame_id, crystal_id);
-                HighFive::File file(out_path, HighFive::File::ReadWrite | HighFive::File::Create | HighFive::File::Truncate);
-                
-                
-                std::vector<size_t> dims{ static_cast<size_t>(global_config["MAX_FRAMES_SIZE"][0]), n_pixels };
-                HighFive::DataSpace space(dims);
-                auto dset = file.createDataSet<uint16_t>("frames", space);
-                const uint16_t* data_ptr = crystals_frames_images + (static_cast<size_t>(crystal_id) * global_config["MAX_FRAMES_SIZE"][0]) * global_config["N_PIXELS"][0];
-                dset.write_raw(data_ptr);
-                // std::vector<size_t> offset = {0, 0};
-                // std::vector<size_t> count  = {frames_in_chunk, n_pixels};
-                // dset.select(offset, count).write(data_ptr);
+            std::function<void()> job;
+            if (export_mode == "file") {
+                job = [=]() {
+                    for (int crystal_id = 0; crystal_id < n_crystals; ++crystal_id) {
+                        auto dset = (*crystals_files)[crystal_id]->getDataSet("frames");
+                        dset.resize({ static_cast<size_t>(end_frame_id), n_pixels });
+                        const uint16_t* data_ptr = frames_images + crystals_offsets[crystal_id];
+                        dset.select({ static_cast<size_t>(start_frame_id), 0 }, { frames_in_chunk, n_pixels }).write_raw(data_ptr);
+                    }
+                };
+            } else {
+                job = [=]() {
+                    for (int crystal_id = 0; crystal_id < n_crystals; ++crystal_id) {
+                        std::string out_path = crystals_frames_folder + "\\" + format_string("frames_{}_{}_crystal_{}.h5", start_frame_id, end_frame_id, crystal_id);
+                        HighFive::File file(out_path, HighFive::File::ReadWrite | HighFive::File::Create | HighFive::File::Truncate);
+                        std::vector<size_t> dims{ frames_in_chunk, n_pixels };
+                        HighFive::DataSpace space(dims);
+                        auto dset = file.createDataSet<uint16_t>("frames", space);
+                        const uint16_t* data_ptr = frames_images + crystals_offsets[crystal_id];
+                        dset.write_raw(data_ptr);
+                    }
+                };
             }
+            buffers_jobs[buffer_i] = writer.submit(std::move(job));
+            buffers_used[buffer_i] = true;
+            buffer_i = (buffer_i + 1) % FRAMES_WRITE_BUFFERS;
 
         }
+        if (export_mode == "file") writer.submit([crystals_files]() { crystals_files->clear(); });
     }
+    writer.finish();
 
-
-
-    free(crystals_frames_images);
     return 0;
 }
@@ -6,21 +6,82 @@
 #include <iostream>
 #include <algorithm>
 #include <filesystem>
+#include <random>
+#include <omp.h>
 
 #include "header.hpp"
 
-int raw2scatters(const std::vector<std::string>& rawfiles, const std::string crystals_scatters_folder,
-    const std::vector<std::string>& crystals_calibration_files, const std::string process_type) {
+// the values of all pixels are kept in memory until they take this many bytes, then they are appended to the files
+static const size_t SCATTER_BUFFER_SIZE = static_cast<size_t>(1) << 28;
+// number of target pixels of one crystal gathered by one task
+static const int SCATTER_TASK_PIXELS = 64;
+
+// a target pixel and the values collected since its file was last written
+// with a cap, values is a reservoir of at most cap values sampled uniformly from all n_seens values of the pixel
+// (algorithm R), the generator of each pixel is seeded from the seed and the pixel, so the samples do not depend on the threads
+struct ScatterTarget {
+    int crystal_id;
+    int pixel_id;
+    std::string filename;
+    std::vector<uint16_t> values;
+    bool written = false;
+    uint64_t n_seens = 0;
+    std::mt19937_64 generator;
+
+    // returns whether the number of values grew
+    bool add(const uint16_t value, const size_t cap) {
+        n_seens++;
+        if (cap == 0 || values.size() < cap) {
+            values.push_back(value);
+            return true;
+        }
+        const uint64_t index = std::uniform_int_distribution<uint64_t>(0, n_seens - 1)(generator);
+        if (index < cap) values[index] = value;
+        return false;
+    }
+};
+
+// append the collected values of each target to its file, the targets are handed out to the threads by chunks of
+// SCATTER_TASK_PIXELS, so at most one file per thread is open at a time. files are created on the first write even if there is no value.
+int flush_scatter_targets(const RunConfig& config, std::vector<ScatterTarget>& targets) {
+    #pragma omp parallel for schedule(dynamic, SCATTER_TASK_PIXELS) num_threads(config.n_threads)
+    for (int target_i = 0; target_i < static_cast<int>(targets.size()); target_i++) {
+        ScatterTarget& target = targets[target_i];
+        if (target.values.empty() && target.written) continue;
+        std::ofstream scatter_ostream(target.filename, std::ios::binary | (target.written ? std::ios::app : std::ios::trunc));
+        scatter_ostream.write(reinterpret_cast<const char*>(target.values.data()), target.values.size() * sizeof(uint16_t));
+        target.values.clear();
+        target.written = true;
+    }
+    return 0;
+}
+
+// the buffered values, the targets with their generators and the frames container, at most every pixel of the read crystals
+// is a target. with a cap every target keeps at most cap values, without a cap the values never go over SCATTER_BUFFER_SIZE
+FlowMemory raw2scatters_memory(const RunConfig& config, const int cap) {
+    FlowMemory memory;
+    const size_t n_targets = static_cast<size_t>(config.n_planes()) * config.n_pixels;
+    memory.fixed_bytes = n_targets * sizeof(ScatterTarget) + (cap > 0 ? n_targets * cap * sizeof(uint16_t) : SCATTER_BUFFER_SIZE);
+    memory.frame_bytes = n_targets * sizeof(uint16_t);
+    return memory;
+}
+
+int raw2scatters(const RunConfig& config, const std::vector<std::string>& rawfiles, const std::string crystals_scatters_folder,
+    const std::vector<std::string>& crystals_calibration_files, const std::string process_type, const int cap, const unsigned int seed) {
+
+    if (cap < 0) throw std::invalid_argument(format_string("Cap must not be negative, got {}", cap));
 
 
     // read calibration file, here we mainly use the pixels_isvalids to select pixels to check
     // besides, it also servers to mark the peak positions on the scatter plot.
-    std::vector<std::vector<std::vector<float>>> crystals_pixels_peaks(global_config["N_CRYSTALS"][0], std::vector<std::vector<float>>(global_config["N_PIXELS"][0]));
-    std::vector<std::vector<std::vector<float>>> crystals_pixels_calibration(global_config["N_CRYSTALS"][0], std::vector<std::vector<float>>(global_config["N_PIXELS"][0]));
-    std::vector<std::vector<uint8_t>> crystals_pixels_isvalids(global_config["N_CRYSTALS"][0], std::vector<uint8_t>(global_config["N_PIXELS"][0], false));
-    std::vector<std::vector<float>> crystals_pixels_thresholds(global_config["N_CRYSTALS"][0], std::vector<float>(global_config["N_PIXELS"][0]));
-    for (int crystal_id = 0; crystal_id < global_config["N_CRYSTALS"][0]; crystal_id++) {
+    std::vector<std::vector<std::vector<float>>> crystals_pixels_peaks(config.n_crystals, std::vector<std::vector<float>>(config.n_pixels));
+    std::vector<std::vector<std::vector<float>>> crystals_pixels_calibration(config.n_crystals, std::vector<std::vector<float>>(config.n_pixels));
+    std::vector<std::vector<uint8_t>> crystals_pixels_isvalids(config.n_crystals, std::vector<uint8_t>(config.n_pixels, false));
+    std::vector<std::vector<float>> crystals_pixels_thresholds(config.n_crystals, std::vector<float>(config.n_pixels));
+    for (int crystal_id = 0; crystal_id < config.n_crystals; crystal_id++) {
         if (crystals_calibration_files[crystal_id] == "skip") continue;
+        if (config.crystals_planes[crystal_id] < 0)
+            throw std::invalid_argument(format_string("Crystal {} has a calibration file but is not read, see RunConfig::set_active_crystals", crystal_id));
         read_pixels_calibrations(crystals_calibration_files[crystal_id], 
             crystals_pixels_calibration[crystal_id],
             crystals_pixels_peaks[crystal_id],
@@ -28,54 +89,73 @@ int raw2scatters(const std::vector<std::string>& rawfiles, const std::string cry
             crystals_pixels_thresholds[crystal_id]);
     }
 
-    // select pixels to check
-    std::vector<std::vector<int>> crystals_target_ids(global_config["N_CRYSTALS"][0]);
-    for (int crystal_id = 0; crystal_id < global_config["N_CRYSTALS"][0]; crystal_id++) {
+    // select pixels to check, the random selections are reproducible with the same seed
+    std::mt19937 selection_generator(seed);
+    auto select_percent = [&](int percent) { return std::uniform_int_distribution<int>(0, 99)(selection_generator) < percent; };
+    std::vector<std::vector<int>> crystals_target_ids(config.n_crystals);
+    for (int crystal_id = 0; crystal_id < config.n_crystals; crystal_id++) {
         if (crystals_calibration_files[crystal_id] == "skip") continue;
-        for (int pixel_id = 0; pixel_id < global_config["N_PIXELS"][0]; pixel_id++) {
-            int row = pixel_id / global_config["N_COLS"][0];
-            int col = pixel_id % global_config["N_COLS"][0];
+        for (int pixel_id = 0; pixel_id < config.n_pixels; pixel_id++) {
+            int row = pixel_id / config.n_cols;
+            int col = pixel_id % config.n_cols;
             if (process_type == "all")
                 crystals_target_ids[crystal_id].push_back(pixel_id);
             else if (process_type == "all-stride" && (row % 5 == 0 && col % 5 == 0)) // if type is all-stride, then select 4% of pixels by stride
                 crystals_target_ids[crystal_id].push_back(pixel_id);
-            else if (process_type == "all-random" && (rand() % 100 < 5)) // if type is all-random, then randomly select 5% of pixels
+            else if (process_type == "all-random" && select_percent(5)) // if type is all-random, then randomly select 5% of pixels
                 crystals_target_ids[crystal_id].push_back(pixel_id);
-            else if (process_type == "valid-random" && crystals_pixels_isvalids[crystal_id][pixel_id] && (rand() % 100 < 5)) // randomly select 5% of the valid pixels
+            else if (process_type == "valid-random" && crystals_pixels_isvalids[crystal_id][pixel_id] && select_percent(5)) // randomly select 5% of the valid pixels
                 crystals_target_ids[crystal_id].push_back(pixel_id);
             else if (process_type == "invalid" && !crystals_pixels_isvalids[crystal_id][pixel_id])
                 crystals_target_ids[crystal_id].push_back(pixel_id);
         }
     }
 
-    // create the folder and open each file
+    // create the folder and list the targets crystal by crystal in the order of the pixels
     if (!std::filesystem::exists(crystals_scatters_folder))
         std::filesystem::create_directory(crystals_scatters_folder);
-    std::vector<std::vector<std::string>> crystals_pixels_scatter_files(global_config["N_CRYSTALS"][0]);
-    for (int crystal_id = 0; crystal_id < global_config["N_CRYSTALS"][0]; crystal_id++) {
-        for (int pixel_i = 0; pixel_i < crystals_target_ids[crystal_id].size(); pixel_i++) {
-            int pixel_id = crystals_target_ids[crystal_id][pixel_i];
-            std::string scatter_file = format_string("{}\\scatter_crystal_{}_pixel_{}.bin", crystals_scatters_folder, crystal_id, pixel_id);
-            if (std::filesystem::exists(scatter_file)) {
-                // std::cout << "Warning: scatter file already exists and will be overwritten: " << scatter_file << std::endl;
-                std::filesystem::remove(scatter_file);
-            }
-            crystals_pixels_scatter_files[crystal_id].push_back(scatter_file);
+    std::vector<ScatterTarget> targets;
+    std::vector<std::pair<size_t, size_t>> tasks_targets;  // [begin, end) of the targets of each task, within one crystal
+    for (int crystal_id = 0; crystal_id < config.n_crystals; crystal_id++) {
+        for (size_t pixel_i = 0; pixel_i < crystals_target_ids[crystal_id].size(); pixel_i++) {
+            if (pixel_i % SCATTER_TASK_PIXELS == 0) tasks_targets.emplace_back(targets.size(), targets.size());
+            ScatterTarget target;
+            target.crystal_id = crystal_id;
+            target.pixel_id = crystals_target_ids[crystal_id][pixel_i];
+            target.filename = format_string("{}\\scatter_crystal_{}_pixel_{}.bin", crystals_scatters_folder, crystal_id, target.pixel_id);
+            std::seed_seq pixel_seed{ seed, static_cast<unsigned int>(crystal_id), static_cast<unsigned int>(target.pixel_id) };
+            target.generator.seed(pixel_seed);
+            targets.push_back(std::move(target));
+            tasks_targets.back().second = targets.size();
         }
     }
 
     // define the data container for frames images (flat)
-    const int n_crystals = global_config["N_CRYSTALS"][0];
-    const int max_frames = global_config["MAX_FRAMES_SIZE"][0];
-    const int n_pixels = global_config["N_PIXELS"][0];
-    std::vector<uint16_t> crystals_frames_images(static_cast<size_t>(n_crystals) * max_frames * n_pixels, 0);
+    const int n_pixels = config.n_pixels;
+    FlowBuffer crystals_frames_images(config);
+    std::vector<int> tasks_nodes;
+    for (const auto& task_targets : tasks_targets)
+        tasks_nodes.push_back(config.crystal_node(targets[task_targets.first].crystal_id));
 
-    // furthermore, since collapsing into scatters requires continuous loading of rawfiles into frames
-    // the bottleneck is the reading speed of rawfiles which is already parallelized.
-    // the process of converting frames into scatters is actually easy and not suitable for parallelization.
-    // (expense for each pixel is small, but we can distribute multiple pixels into each thread) -- to be implemented in the future.
+    // the target pixels are distributed to the threads by tasks of SCATTER_TASK_PIXELS pixels of one crystal,
+    // each task walks the frames once and gathers the values of its pixels, which are next to each other in a frame.
+    // the values stay in memory over the flows and the files are only written when the buffers are full.
+    // with a cap, the reservoirs are sampled while reading and only written at the end.
+    const int adu_min = config.adu_min;
+    const int adu_max = config.adu_max;
+    size_t n_buffered_values = 0;
 
-    const size_t n_frame_pixels = global_config["N_CRYSTALS"][0] * global_config["N_PIXELS_PREMERGE"][0];
+    // without a cap the buffers never go over SCATTER_BUFFER_SIZE: the frames of a flow, or the targets of a transposed file,
+    // are gathered by slices of at most half of it, and the values are written before a slice that might not fit
+    const size_t max_buffered_values = SCATTER_BUFFER_SIZE / sizeof(uint16_t);
+    const size_t n_slice_values = max_buffered_values / 2;
+    auto make_room = [&](const size_t n_slice_max_values) {
+        if (cap > 0 || n_buffered_values + n_slice_max_values <= max_buffered_values) return;
+        flush_scatter_targets(config, targets);
+        n_buffered_values = 0;
+    };
+
+    const size_t n_frame_pixels = config.frame_size();
     for (auto& rawfile : rawfiles) {
 
         if (!std::filesystem::exists(rawfile))
@@ -88,32 +168,65 @@ int raw2scatters(const std::vector<std::string>& rawfiles, const std::string cry
         const size_t n_frames = file_size / n_frame_pixels / sizeof(uint16_t);
         file.close();
 
-        int n_flow_times = (n_frames + global_config["MAX_FRAMES_SIZE"][0] - 1) / global_config["MAX_FRAMES_SIZE"][0];
+        // the values of the pixels are read directly from the transposed copy of the raw file if there is one
+        if (TransposedRawfile::available(config, rawfile)) {
+            TransposedRawfile transposed(rawfile);
+            const size_t n_file_frames = std::max<size_t>(transposed.n_frames(), 1);
+            const int n_chunk_targets = static_cast<int>(std::clamp<size_t>(n_slice_values / n_file_frames, 1, std::max<size_t>(targets.size(), 1)));
+            std::cout << "Reading transposed file: " << TransposedRawfile::filename_of(rawfile) << ", total frames: " << transposed.n_frames() << std::endl;
+            for (int chunk_begin = 0; chunk_begin < static_cast<int>(targets.size()); chunk_begin += n_chunk_targets) {
+                const int chunk_end = std::min(chunk_begin + n_chunk_targets, static_cast<int>(targets.size()));
+                make_room(static_cast<size_t>(chunk_end - chunk_begin) * n_file_frames);
+                #pragma omp parallel reduction(+:n_buffered_values) num_threads(config.n_threads)
+                {
+                    std::vector<uint16_t> values(transposed.n_frames());
+                    #pragma omp for schedule(dynamic, SCATTER_TASK_PIXELS)
+                    for (int target_i = chunk_begin; target_i < chunk_end; target_i++) {
+                        transposed.read_pixel(targets[target_i].crystal_id, targets[target_i].pixel_id, values.data());
+                        for (auto value : values) {
+                            if (value >= adu_max || value < adu_min) continue;
+                            n_buffered_values += targets[target_i].add(value, cap);
+                        }
+                    }
+                }
+            }
+            continue;
+        }
+
+        int n_flow_times = (n_frames + config.max_frames_size - 1) / config.max_frames_size;
         std::cout << "Reading file: " << rawfile << ", total frames: " << n_frames << ", divided into " << n_flow_times << " flows." << std::endl;
         for (int flow_i = 0; flow_i < n_flow_times; flow_i++) {
-            int start_frame_id = flow_i * global_config["MAX_FRAMES_SIZE"][0];
-            int end_frame_id = start_frame_id + global_config["MAX_FRAMES_SIZE"][0] < n_frames ? start_frame_id + global_config["MAX_FRAMES_SIZE"][0] : n_frames;
-            read_rawfile_to_crystals_frames_images(rawfile, start_frame_id, end_frame_id, crystals_frames_images.data());
+            int start_frame_id = flow_i * config.max_frames_size;
+            int end_frame_id = start_frame_id + config.max_frames_size < n_frames ? start_frame_id + config.max_frames_size : n_frames;
+            read_rawfile_to_crystals_frames_images(config, rawfile, start_frame_id, end_frame_id, crystals_frames_images.data());
 
             const int frames_in_chunk = end_frame_id - start_frame_id;
-            for (int crystal_id = 0; crystal_id < n_crystals; crystal_id++) {
-                for (int pixel_i = 0; pixel_i < crystals_target_ids[crystal_id].size(); pixel_i++) {
-                    int pixel_id = crystals_target_ids[crystal_id][pixel_i];
-
-                    std::string scatter_file = crystals_pixels_scatter_files[crystal_id][pixel_i];
-                    std::ofstream scatter_ostream(scatter_file, std::ios::binary | std::ios::app);
-                    const uint16_t* frames_ptr = crystals_frames_images.data() + (static_cast<size_t>(crystal_id) * max_frames) * n_pixels;
-                    for (int frame_i = 0; frame_i < frames_in_chunk; frame_i++) {
-                        const uint16_t* frame_ptr = frames_ptr + static_cast<size_t>(frame_i) * n_pixels;
-                        uint16_t value = frame_ptr[pixel_id];
-                        if (value >= global_config["ADU_MAX"][0] || value < global_config["ADU_MIN"][0]) continue;
-                        scatter_ostream.write(reinterpret_cast<const char*>(&value), sizeof(uint16_t));
+            const int n_slice_frames = cap > 0 ? frames_in_chunk
+                : static_cast<int>(std::clamp<size_t>(n_slice_values / std::max<size_t>(targets.size(), 1), 1, std::max(frames_in_chunk, 1)));
+            for (int slice_begin = 0; slice_begin < frames_in_chunk; slice_begin += n_slice_frames) {
+                const int slice_end = std::min(slice_begin + n_slice_frames, frames_in_chunk);
+                make_room(static_cast<size_t>(slice_end - slice_begin) * targets.size());
+                NodeTaskQueue queue(config, tasks_nodes);
+                #pragma omp parallel reduction(+:n_buffered_values) num_threads(config.n_threads)
+                {
+                    const int thread_i = omp_get_thread_num();
+                    for (int task_i = queue.next(thread_i); task_i >= 0; task_i = queue.next(thread_i)) {
+                        const size_t begin = tasks_targets[task_i].first, end = tasks_targets[task_i].second;
+                        const uint16_t* frames_ptr = crystals_frames_images.data() + config.plane_offset(targets[begin].crystal_id);
+                        for (int frame_i = slice_begin; frame_i < slice_end; frame_i++) {
+                            const uint16_t* frame_ptr = frames_ptr + static_cast<size_t>(frame_i) * n_pixels;
+                            for (size_t target_i = begin; target_i < end; target_i++) {
+                                uint16_t value = frame_ptr[targets[target_i].pixel_id];
+                                if (value >= adu_max || value < adu_min) continue;
+                                n_buffered_values += targets[target_i].add(value, cap);
+                            }
+                        }
                     }
                 }
             }
         }
     }
-
+    flush_scatter_targets(config, targets);
 
     return 0;
 }
@@ -8,36 +8,42 @@
 #include <filesystem>
 #include <stdexcept>
 #include <algorithm>
+#include <omp.h>
 #include "highfive/HighFive.hpp"
 
 #include "header.hpp"
 
-std::vector<size_t> compute_adu_lookup_table(const std::vector<float>& bins) {
-    std::vector<size_t> adu_lookup_table(global_config["ADU_MAX"][0] - global_config["ADU_MIN"][0], 0);
-    for (int adu = global_config["ADU_MIN"][0]; adu < global_config["ADU_MAX"][0]; ++adu) {
+// number of pixels of one crystal whose spectra are filled by one task
+static const int SPECTRA_TASK_PIXELS = 256;
+
+std::vector<size_t> compute_adu_lookup_table(const RunConfig& config, const std::vector<float>& bins) {
+    std::vector<size_t> adu_lookup_table(config.adu_max - config.adu_min, 0);
+    for (int adu = config.adu_min; adu < config.adu_max; ++adu) {
         auto it = std::upper_bound(bins.begin(), bins.end(), adu);
-        adu_lookup_table[adu-global_config["ADU_MIN"][0]] = (it != bins.begin()) ? std::distance(bins.begin(), it) - 1 : 0;
+        adu_lookup_table[adu - config.adu_min] = (it != bins.begin()) ? std::distance(bins.begin(), it) - 1 : 0;
     }
     return adu_lookup_table;
 }
 
 
+// add the pixels [begin_pixel_id, end_pixel_id) of n_frames frames images of one crystal to their spectra
 int read_frames_images_to_pixels_spectra(
+    const RunConfig& config,
     const uint16_t* frames_images,
-    const std::vector<float>& /*bins*/,
     const std::vector<size_t>& lookup_table,
     int* pixels_spectra,
-    int n_frames) {
+    int n_frames,
+    int begin_pixel_id,
+    int end_pixel_id) {
 
-    const int n_pixels = global_config["N_PIXELS"][0];
-    const int adu_min = global_config["ADU_MIN"][0];
-    const int adu_max = global_config["ADU_MAX"][0];
-    const int n_bins = global_config["N_BINS"][0];
+    const int n_pixels = config.n_pixels;
+    const int adu_min = config.adu_min;
+    const int adu_max = config.adu_max;
+    const int n_bins = config.n_bins;
 
-    #pragma omp parallel for
     for (int frame_i = 0; frame_i < n_frames; ++frame_i) {
         const uint16_t* frame_image = frames_images + static_cast<size_t>(frame_i) * n_pixels;
-        for (int pixel_id = 0; pixel_id < n_pixels; ++pixel_id) {
+        for (int pixel_id = begin_pixel_id; pixel_id < end_pixel_id; ++pixel_id) {
             uint16_t value = frame_image[pixel_id];
             if (value >= adu_max || value < adu_min) continue;
             size_t bin_idx = lookup_table[static_cast<size_t>(value - adu_min)];
@@ -48,7 +54,28 @@ int read_frames_images_to_pixels_spectra(
     return 0;
 }
 
-int raw2spectra(const std::vector<std::string> rawfiles, const std::string crystals_spectra_folder) {
+// add n_frames frames images of one crystal to the spectra of its pixels, by tasks of SPECTRA_TASK_PIXELS pixels
+int frames_images_to_pixels_spectra(const RunConfig& config, const uint16_t* frames_images, const int n_frames, int* pixels_spectra) {
+
+    const std::vector<float> bins = create_bins(config.n_bins, config.adu_min, config.adu_max);
+    const std::vector<size_t> lookup_table = compute_adu_lookup_table(config, bins);
+    const int n_pixels = config.n_pixels;
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(config.n_threads)
+    for (int pixel_id = 0; pixel_id < n_pixels; pixel_id += SPECTRA_TASK_PIXELS)
+        read_frames_images_to_pixels_spectra(config, frames_images, lookup_table, pixels_spectra, n_frames,
+            pixel_id, std::min(pixel_id + SPECTRA_TASK_PIXELS, n_pixels));
+    return 0;
+}
+
+// the spectra and the frames container
+FlowMemory raw2spectra_memory(const RunConfig& config) {
+    FlowMemory memory;
+    memory.fixed_bytes = static_cast<size_t>(config.n_crystals) * config.n_pixels * config.n_bins * sizeof(int);
+    memory.frame_bytes = static_cast<size_t>(config.n_planes()) * config.n_pixels * sizeof(uint16_t);
+    return memory;
+}
+
+int raw2spectra(const RunConfig& config, const std::vector<std::string> rawfiles, const std::string crystals_spectra_folder) {
 
     // create output folder
     if (!std::filesystem::exists(crystals_spectra_folder)) {
@@ -56,24 +83,33 @@ int raw2spectra(const std::vector<std::string> rawfiles, const std::string cryst
     }
 
     // create data containers
-    const int n_crystals = global_config["N_CRYSTALS"][0];
-    const int n_pixels = global_config["N_PIXELS"][0];
-    const int n_bins = global_config["N_BINS"][0];
-    const int max_frames = global_config["MAX_FRAMES_SIZE"][0];
+    const int n_crystals = config.n_crystals;
+    const int n_pixels = config.n_pixels;
+    const int n_bins = config.n_bins;
     std::vector<int> crystals_pixels_spectra(static_cast<size_t>(n_crystals) * n_pixels * n_bins, 0);
 
     // precompute the lookup table for adu to bin index
-    std::vector<float> bins = create_bins(global_config["N_BINS"][0], global_config["ADU_MIN"][0], global_config["ADU_MAX"][0]);
-    static const std::vector<size_t> lookup_table = compute_adu_lookup_table(bins);
+    std::vector<float> bins = create_bins(config.n_bins, config.adu_min, config.adu_max);
+    const std::vector<size_t> lookup_table = compute_adu_lookup_table(config, bins);
 
     // define the data container for frames images (flat)
-    std::vector<uint16_t> crystals_frames_images(static_cast<size_t>(n_crystals) * max_frames * n_pixels, 0);
+    FlowBuffer crystals_frames_images(config);
+
+    // the spectra are filled by tasks of SPECTRA_TASK_PIXELS pixels of one crystal, so every spectrum is only added to by one thread
+    std::vector<std::array<int, 2>> tasks;  // crystal_id, first pixel id
+    std::vector<int> tasks_nodes;
+    for (int crystal_id = 0; crystal_id < n_crystals; ++crystal_id) {
+        for (int pixel_id = 0; pixel_id < n_pixels; pixel_id += SPECTRA_TASK_PIXELS) {
+            tasks.push_back({ crystal_id, pixel_id });
+            tasks_nodes.push_back(config.crystal_node(crystal_id));
+        }
+    }
 
     // collapse each raw data file into a spectrum
     // In order to limit the size of these frames, they should be updated for every file;
     // otherwise, they will be very large after reading all files.
     // Everytime a file is read, we tally it immediately.
-    const size_t n_frame_pixels = global_config["N_CRYSTALS"][0] * global_config["N_PIXELS_PREMERGE"][0];
+    const size_t n_frame_pixels = config.frame_size();
     for (auto& rawfile : rawfiles) {
 
         // since sometimes we deal with ultra-large rawfiles, we must read and analyze them in chunks.
@@ -84,19 +120,26 @@ int raw2spectra(const std::vector<std::string> rawfiles, const std::string cryst
         file.close();
 
         // divide 1 file into multiple chunks and then read in parallel
-        int n_flow_times = (n_frames + global_config["MAX_FRAMES_SIZE"][0] - 1) / global_config["MAX_FRAMES_SIZE"][0];
+        int n_flow_times = (n_frames + config.max_frames_size - 1) / config.max_frames_size;
         for (int flow_i = 0; flow_i < n_flow_times; flow_i++) {
 
-            int start_frame_id = flow_i * global_config["MAX_FRAMES_SIZE"][0];
-            int end_frame_id = start_frame_id + global_config["MAX_FRAMES_SIZE"][0] < n_frames ? start_frame_id + global_config["MAX_FRAMES_SIZE"][0] : n_frames;
+            int start_frame_id = flow_i * config.max_frames_size;
+            int end_frame_id = start_frame_id + config.max_frames_size < n_frames ? start_frame_id + config.max_frames_size : n_frames;
 
-            read_rawfile_to_crystals_frames_images(rawfile, start_frame_id, end_frame_id, crystals_frames_images.data());
+            read_rawfile_to_crystals_frames_images(config, rawfile, start_frame_id, end_frame_id, crystals_frames_images.data());
 
             const int frames_in_chunk = end_frame_id - start_frame_id;
-            for (int crystal_id = 0; crystal_id < n_crystals; ++crystal_id) {
-                const uint16_t* frames_ptr = crystals_frames_images.data() + (static_cast<size_t>(crystal_id) * max_frames) * n_pixels;
-                int* spectra_ptr = crystals_pixels_spectra.data() + (static_cast<size_t>(crystal_id) * n_pixels) * n_bins;
-                read_frames_images_to_pixels_spectra(frames_ptr, bins, lookup_table, spectra_ptr, frames_in_chunk);
+            NodeTaskQueue queue(config, tasks_nodes);
+            #pragma omp parallel num_threads(config.n_threads)
+            {
+                const int thread_i = omp_get_thread_num();
+                for (int task_i = queue.next(thread_i); task_i >= 0; task_i = queue.next(thread_i)) {
+                    const int crystal_id = tasks[task_i][0];
+                    const uint16_t* frames_ptr = crystals_frames_images.data() + config.plane_offset(crystal_id);
+                    int* spectra_ptr = crystals_pixels_spectra.data() + (static_cast<size_t>(crystal_id) * n_pixels) * n_bins;
+                    read_frames_images_to_pixels_spectra(config, frames_ptr, lookup_table, spectra_ptr, frames_in_chunk,
+                        tasks[task_i][1], std::min(tasks[task_i][1] + SPECTRA_TASK_PIXELS, n_pixels));
+                }
             }
 
         }
@@ -5,21 +5,24 @@
 #include <filesystem>
 #include <unordered_map>
 #include <vector>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
 
 #include "header.hpp"
 
-std::vector<int> split(const std::string& line) {
+std::vector<double> split(const std::string& line) {
     std::istringstream iss(line);
-    std::vector<int> tokens;
-    int token;
+    std::vector<double> tokens;
+    double token;
     while (iss >> token) {
         tokens.push_back(token);
     }
     return tokens;
 }
 
-std::unordered_map<std::string, std::vector<int>>  read_config(const std::string& filename, bool verbose) {
-    std::unordered_map<std::string, std::vector<int>> config;
+static std::unordered_map<std::string, std::vector<double>> read_config_values(const std::string& filename, bool verbose) {
+    std::unordered_map<std::string, std::vector<double>> config;
     if (!std::filesystem::exists(filename))
         throw std::invalid_argument("Config file does not exist: " + filename);
     if (std::filesystem::path(filename).extension() != ".txt")
@@ -56,7 +59,7 @@ std::unordered_map<std::string, std::vector<int>>  read_config(const std::string
         trim(value);
 
         // 拆分 value（支持多个值）
-        std::vector<int> values = split(value);
+        std::vector<double> values = split(value);
         config[key] = values;
     }
 
@@ -74,5 +77,108 @@ std::unordered_map<std::string, std::vector<int>>  read_config(const std::string
     return config;
 }
 
+void RunConfig::require(const std::vector<std::string>& required_keys) const {
+    for (const auto& key : required_keys)
+        if (std::find(keys.begin(), keys.end(), key) == keys.end())
+            throw std::invalid_argument(format_string("Missing {} in the config file", key));
+}
+
+RunConfig read_config(const std::string& filename, bool verbose) {
+
+    const std::unordered_map<std::string, std::vector<double>> values = read_config_values(filename, verbose);
+    RunConfig config;
+    for (const auto& [key, key_values] : values)
+        if (!key_values.empty()) config.keys.push_back(key);
+
+    auto get_floats = [&](const std::string& key) {
+        config.require({ key });
+        return std::vector<float>(values.at(key).begin(), values.at(key).end());
+    };
+    auto get_ints = [&](const std::string& key) {
+        config.require({ key });
+        std::vector<int> ints;
+        for (double value : values.at(key)) {
+            if (value != std::floor(value)) throw std::invalid_argument(format_string("{} must be an integer, got {}", key, value));
+            ints.push_back(static_cast<int>(value));
+        }
+        return ints;
+    };
+    auto get_int = [&](const std::string& key) { return get_ints(key)[0]; };
+    auto has = [&](const std::string& key) { return std::find(config.keys.begin(), config.keys.end(), key) != config.keys.end(); };
+
+    config.n_panels = get_int("N_PANELS");
+    config.n_crystals = get_int("N_CRYSTALS");
+    config.n_rows_premerge = get_int("N_ROWS_PREMERGE");
+    config.n_cols_premerge = get_int("N_COLS_PREMERGE");
+    config.n_pixels_premerge = get_int("N_PIXELS_PREMERGE");
+    config.n_readout_pixels = get_int("N_READOUT_PIXELS");
+    config.n_readout_groups = get_int("N_READOUT_GROUPS");
+    config.n_rows = get_int("N_ROWS");
+    config.n_cols = get_int("N_COLS");
+    config.n_pixels = get_int("N_PIXELS");
+    config.row_merge_fold = get_int("ROW_MERGE_FOLD");
+    config.col_merge_fold = get_int("COL_MERGE_FOLD");
+    config.row_merge_index = get_int("ROW_MERGE_INDEX");
+    config.col_merge_index = get_int("COL_MERGE_INDEX");
+    config.adu_min = get_int("ADU_MIN");
+    config.adu_max = get_int("ADU_MAX");
+    config.n_bins = get_int("N_BINS");
+    config.secondary_thresholds = get_floats("SECONDARY_THRESHOLD");
+    config.max_event_pixels = get_int("MAX_EVENT_PIXELS");
+    config.max_frames_size = get_int("MAX_FRAMES_SIZE");
+    config.n_threads = get_int("N_THREADS");
+    if (has("PIN_THREADS")) config.thread_pinning = get_int("PIN_THREADS") != 0;
+    if (has("PANEL_CRYSTAL_ROWS")) config.panel_crystal_rows = get_int("PANEL_CRYSTAL_ROWS");
+    if (has("PANEL_CRYSTAL_COLS")) config.panel_crystal_cols = get_int("PANEL_CRYSTAL_COLS");
+    if (has("PANEL_CRYSTAL_LAYOUT")) config.panel_crystal_layout = get_ints("PANEL_CRYSTAL_LAYOUT");
+    if (has("CLUSTER_ENERGY_MIN")) config.cluster_energy_min = get_floats("CLUSTER_ENERGY_MIN")[0];
+    if (has("CLUSTER_ENERGY_MAX")) config.cluster_energy_max = get_floats("CLUSTER_ENERGY_MAX")[0];
+    if (has("CLUSTER_ENERGY_BINS")) config.cluster_energy_bins = get_int("CLUSTER_ENERGY_BINS");
+    if (has("MAX_MULTIPLICITY")) config.max_multiplicity = get_int("MAX_MULTIPLICITY");
+
+    // check the sizes, which are used to lay out the buffers
+    if (config.n_crystals <= 0 || config.n_rows <= 0 || config.n_cols <= 0 || config.n_rows_premerge <= 0 || config.n_cols_premerge <= 0)
+        throw std::invalid_argument("The numbers of crystals, rows and columns must be positive");
+    if (config.n_pixels != config.n_rows * config.n_cols || config.n_pixels_premerge != config.n_rows_premerge * config.n_cols_premerge)
+        throw std::invalid_argument("N_PIXELS and N_PIXELS_PREMERGE must be the numbers of rows times the numbers of columns");
+    if (config.n_readout_pixels * config.n_readout_groups != config.n_cols_premerge)
+        throw std::invalid_argument("N_READOUT_PIXELS times N_READOUT_GROUPS must be N_COLS_PREMERGE");
+    if (config.row_merge_fold <= 0 || config.col_merge_fold <= 0 || config.row_merge_index < 0 || config.row_merge_index >= config.row_merge_fold
+        || config.col_merge_index < 0 || config.col_merge_index >= config.col_merge_fold)
+        throw std::invalid_argument("The merge folds must be positive and the merge indices within the folds");
+    if (config.n_pixels != config.n_pixels_premerge && (config.n_rows * config.row_merge_fold != config.n_rows_premerge || config.n_cols * config.col_merge_fold != config.n_cols_premerge))
+        throw std::invalid_argument("N_ROWS and N_COLS must be the premerge numbers divided by the merge folds");
+    if (config.adu_min >= config.adu_max || config.n_bins <= 0)
+        throw std::invalid_argument("ADU_MIN must be less than ADU_MAX and N_BINS positive");
+    if (static_cast<int>(config.secondary_thresholds.size()) < config.n_crystals)
+        throw std::invalid_argument(format_string("SECONDARY_THRESHOLD must have a value for each of the {} crystals", config.n_crystals));
+    if (config.max_event_pixels <= 0 || config.max_frames_size <= 0 || config.n_threads <= 0)
+        throw std::invalid_argument("MAX_EVENT_PIXELS, MAX_FRAMES_SIZE and N_THREADS must be positive");
+
+    config.pixel_order.resize(config.n_pixels_premerge);
+    compute_pixel_order(config.n_cols_premerge, config.n_rows_premerge, config.n_readout_pixels, config.n_readout_groups,
+        config.n_pixels_premerge, config.n_pixels, config.row_merge_fold, config.col_merge_fold, config.row_merge_index, config.col_merge_index,
+        config.n_cols, config.pixel_order.data());
 
-std::unordered_map<std::string, std::vector<int>> global_config;
\ No newline at end of file
+    std::vector<int> crystal_ids(config.n_crystals);
+    for (int crystal_id = 0; crystal_id < config.n_crystals; crystal_id++) crystal_ids[crystal_id] = crystal_id;
+    config.set_active_crystals(crystal_ids);
+
+    return config;
+}
+
+// the planes are in the order of the crystal ids
+void RunConfig::set_active_crystals(const std::vector<int>& crystal_ids) {
+    crystals_planes.assign(n_crystals, -1);
+    for (auto crystal_id : crystal_ids) {
+        if (crystal_id < 0 || crystal_id >= n_crystals)
+            throw std::invalid_argument(format_string("Invalid crystal id {}, there are {} crystals", crystal_id, n_crystals));
+        crystals_planes[crystal_id] = 0;
+    }
+    planes_crystals.clear();
+    for (int crystal_id = 0; crystal_id < n_crystals; crystal_id++) {
+        if (crystals_planes[crystal_id] < 0) continue;
+        crystals_planes[crystal_id] = static_cast<int>(planes_crystals.size());
+        planes_crystals.push_back(crystal_id);
+    }
+}
@@ -8,6 +8,13 @@
 #include <string.h>
 #include "header.hpp"
 
+// the raw file is read by chunks of this many frames
+static const size_t RAWFILE_CHUNK_FRAMES = 2000;
+
+size_t rawfile_read_buffer_bytes(const RunConfig& config) {
+    return RAWFILE_CHUNK_FRAMES * config.frame_size() * sizeof(uint16_t);
+}
+
 // calculate the index order
 // the raw data is in order like this:
 // (Frame 1) (Frame 2) (Frame 3) ... (Frame 10000)
@@ -69,20 +76,13 @@ int compute_pixel_order(int n_cols_premerge, int n_rows_premerge, int n_readout_
     return 0;
 }
 
-int read_rawfile_to_crystals_frames_images(const std::string& rawfile, const int start_frame_id, const int end_frame_id, uint16_t* crystals_frames_images) {
+int read_rawfile_to_crystals_frames_images(const RunConfig& config, const std::string& rawfile, const int start_frame_id, const int end_frame_id, uint16_t* crystals_frames_images) {
 
     auto start_time = std::chrono::high_resolution_clock::now();
 
-    static std::vector<int> pixel_order_vec(global_config["N_PIXELS_PREMERGE"][0]);
-    compute_pixel_order(
-        global_config["N_COLS_PREMERGE"][0], global_config["N_ROWS_PREMERGE"][0],
-        global_config["N_READOUT_PIXELS"][0], global_config["N_READOUT_GROUPS"][0],
-        global_config["N_PIXELS_PREMERGE"][0], global_config["N_PIXELS"][0],
-        global_config["ROW_MERGE_FOLD"][0], global_config["COL_MERGE_FOLD"][0],
-        global_config["ROW_MERGE_INDEX"][0], global_config["COL_MERGE_INDEX"][0],
-        global_config["N_COLS"][0],
-        pixel_order_vec.data()
-    );
+    const std::vector<int>& pixel_order_vec = config.pixel_order;
+    const int n_crystals = config.n_crystals;
+    const int n_pixels_premerge = config.n_pixels_premerge;
 
     // retrive the only filename from the path
     size_t last_slash_idx = rawfile.find_last_of("\\/");
@@ -95,11 +95,13 @@ int read_rawfile_to_crystals_frames_images(const std::string& rawfile, const int
 
     // 预分配三维存储结构
     int n_frames_to_read = end_frame_id - start_frame_id;
-    const size_t n_frame_pixels = global_config["N_CRYSTALS"][0] * global_config["N_PIXELS_PREMERGE"][0];
+    const size_t n_frame_pixels = config.frame_size();
 
     // 分块处理参数设置
-    const size_t n_chunk_frames = 2000;
-    std::vector<uint16_t> read_buffer(n_chunk_frames * n_frame_pixels);
+    const size_t n_chunk_frames = RAWFILE_CHUNK_FRAMES;
+    // the read buffer is taken from the pool, so every flow reuses the one of the previous flow
+    PooledBuffer read_buffer(rawfile_read_buffer_bytes(config));
+    uint16_t* read_values = static_cast<uint16_t*>(read_buffer.data());
 
     // 主处理循环
     std::ifstream file(rawfile, std::ios::binary);
@@ -109,24 +111,25 @@ int read_rawfile_to_crystals_frames_images(const std::string& rawfile, const int
         const size_t bytes_to_read = n_current_chunk_frames * n_frame_pixels * sizeof(uint16_t);
 
         // 读取当前块数据
-        file.read(reinterpret_cast<char*>(read_buffer.data()), bytes_to_read);
+        file.read(reinterpret_cast<char*>(read_values), bytes_to_read);
 
         // 并行处理当前块
-        #pragma omp parallel for num_threads(global_config["N_THREADS"][0])
+        #pragma omp parallel for num_threads(config.n_threads)
         for (int current_frame_i = 0; current_frame_i < n_current_chunk_frames; ++current_frame_i) {
-            const uint16_t* frame_start = read_buffer.data() + current_frame_i * global_config["N_CRYSTALS"][0] * global_config["N_PIXELS_PREMERGE"][0];
+            const uint16_t* frame_start = read_values + current_frame_i * n_frame_pixels;
             const size_t global_frame_i = n_readed_frames + current_frame_i;
 
-            // 优化后的像素处理循环
-            for (int crystal_i = 0; crystal_i < global_config["N_CRYSTALS"][0]; ++crystal_i) {
-                const size_t frame_offset = (static_cast<size_t>(crystal_i) * global_config["MAX_FRAMES_SIZE"][0] + global_frame_i) * static_cast<size_t>(global_config["N_PIXELS"][0]);
+            // 优化后的像素处理循环, only the crystals with a plane in the flow are copied
+            for (int plane = 0; plane < config.n_planes(); ++plane) {
+                const int crystal_i = config.planes_crystals[plane];
+                const size_t frame_offset = (static_cast<size_t>(plane) * config.max_frames_size + global_frame_i) * static_cast<size_t>(config.n_pixels);
                 uint16_t* target_frame = crystals_frames_images + frame_offset;
 
                 // 使用预计算索引加速访问
-                for (int pixel_preorder_i = 0; pixel_preorder_i < global_config["N_PIXELS_PREMERGE"][0]; ++pixel_preorder_i) {
+                for (int pixel_preorder_i = 0; pixel_preorder_i < n_pixels_premerge; ++pixel_preorder_i) {
                     int mapped = pixel_order_vec[pixel_preorder_i];
                     if (mapped != -1) {
-                        target_frame[mapped] = frame_start[pixel_preorder_i * global_config["N_CRYSTALS"][0] + crystal_i];
+                        target_frame[mapped] = frame_start[pixel_preorder_i * n_crystals + crystal_i];
                         // std::cout << format_string("\rCrystal {}, Frame {}, Pixel {}: Value {}", crystal_i, global_frame_i, pixel_order[pixel_preorder_i], target_frame[pixel_order[pixel_preorder_i]]) << std::endl;
                     }
                 }
@@ -143,8 +146,8 @@ int read_rawfile_to_crystals_frames_images(const std::string& rawfile, const int
 
     // set crystals_frames_images to zero if not all frames are read
     if (end_frame_id - start_frame_id != n_frames_to_read) {
-        size_t start_zero = static_cast<size_t>(end_frame_id - start_frame_id) * global_config["N_PIXELS"][0];
-        size_t zero_count = static_cast<size_t>(n_frames_to_read - (end_frame_id - start_frame_id)) * global_config["N_PIXELS"][0];
+        size_t start_zero = static_cast<size_t>(end_frame_id - start_frame_id) * config.n_pixels;
+        size_t zero_count = static_cast<size_t>(n_frames_to_read - (end_frame_id - start_frame_id)) * config.n_pixels;
         memset(crystals_frames_images + start_zero, 0, zero_count * sizeof(uint16_t));
     }
 
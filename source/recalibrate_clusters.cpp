@@ -0,0 +1,154 @@
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <filesystem>
+#include <chrono>
+#include <limits>
+#include <stdexcept>
+#include <omp.h>
+
+#include "header.hpp"
+
+// records walked by one task when the file has no index
+static const size_t RECALIBRATION_CHUNK_RECORDS = 4096;
+
+// the index of the first record in [begin, end) of a mapped cluster file with a pixel id out of the calibration, -1 if none
+static long long find_invalid_record(const uint8_t* begin, const uint8_t* end, const int n_pixels) {
+    const uint8_t* position = begin;
+    for (long long record_i = 0; position + 8 <= end; record_i++) {
+        int num_pixels;
+        std::memcpy(&num_pixels, position + 4, 4);
+        const uint16_t* pixel_ids = reinterpret_cast<const uint16_t*>(position + 8);
+        for (int pixel_i = 0; pixel_i < num_pixels; pixel_i++)
+            if (pixel_ids[pixel_i] >= n_pixels) return record_i;
+        position += 8 + static_cast<size_t>(num_pixels) * 8;
+    }
+    return -1;
+}
+
+// recompute the energies of all records in [begin, end) of a mapped cluster file
+// records start at multiples of 8 bytes, so the pixel ids, adus and energies of every record are aligned.
+// the total energies are summed in the order of the pixels, as ClusterWriter and query_clusters do, so that the energy
+// ranges of the index agree with the totals of the queries
+static void recalibrate_records(uint8_t* begin, const uint8_t* end, const float* pixels_slopes, const float* pixels_offsets,
+    float& min_energy, float& max_energy) {
+
+    uint8_t* position = begin;
+    while (position + 8 <= end) {
+        int num_pixels;
+        std::memcpy(&num_pixels, position + 4, 4);
+        const uint16_t* pixel_ids = reinterpret_cast<const uint16_t*>(position + 8);
+        const uint16_t* adus = pixel_ids + num_pixels;
+        float* energies = reinterpret_cast<float*>(position + 8 + num_pixels * 4);
+
+        #pragma omp simd
+        for (int pixel_i = 0; pixel_i < num_pixels; pixel_i++) {
+            const float energy = pixels_slopes[pixel_ids[pixel_i]] * adus[pixel_i] + pixels_offsets[pixel_ids[pixel_i]];
+            energies[pixel_i] = energy > 0 ? energy : 0;
+        }
+        float total_energy = 0;
+        for (int pixel_i = 0; pixel_i < num_pixels; pixel_i++) total_energy += energies[pixel_i];
+        min_energy = std::min(min_energy, total_energy);
+        max_energy = std::max(max_energy, total_energy);
+        position += 8 + static_cast<size_t>(num_pixels) * 8;
+    }
+}
+
+// replace the energies of cluster files by adu * slope + offset (at least 0) with the pixels_calibrations of a new calibration file,
+// as raw2clusters computes them. the files are rewritten in place, or copied into output_folder first if it is given.
+// the files are memory-mapped and walked in parallel chunks: the blocks of the index when there is one (whose energy ranges
+// are updated), otherwise chunks found by a quick scan over the record headers.
+int recalibrate_clusters(const RunConfig& config, const std::vector<std::string>& cluster_files, const std::string& calibration_file, const std::string& output_folder) {
+
+    std::vector<std::vector<float>> pixels_calibrations, pixels_peaks;
+    std::vector<uint8_t> pixels_isvalids;
+    std::vector<float> pixels_thresholds;
+    read_pixels_calibrations(calibration_file, pixels_calibrations, pixels_peaks, pixels_isvalids, pixels_thresholds);
+    const int n_pixels = static_cast<int>(pixels_calibrations.size());
+    std::vector<float> pixels_slopes(n_pixels), pixels_offsets(n_pixels);
+    for (int pixel_id = 0; pixel_id < n_pixels; pixel_id++) {
+        pixels_slopes[pixel_id] = pixels_calibrations[pixel_id][0];
+        pixels_offsets[pixel_id] = pixels_calibrations[pixel_id][1];
+    }
+
+    if (!output_folder.empty() && !std::filesystem::exists(output_folder))
+        std::filesystem::create_directories(output_folder);
+
+    for (const auto& cluster_file : cluster_files) {
+        auto start_time = std::chrono::high_resolution_clock::now();
+
+        std::string target_file = cluster_file;
+        std::string index_file = cluster_file + ".idx";
+        bool indexed = std::filesystem::exists(index_file);
+        if (!output_folder.empty()) {
+            target_file = (std::filesystem::path(output_folder) / std::filesystem::path(cluster_file).filename()).string();
+            std::filesystem::copy_file(cluster_file, target_file, std::filesystem::copy_options::overwrite_existing);
+            if (indexed) {
+                std::filesystem::copy_file(index_file, target_file + ".idx", std::filesystem::copy_options::overwrite_existing);
+                index_file = target_file + ".idx";
+            }
+        }
+
+        MappedFile mapped(target_file, true);
+        if (mapped.size() == 0) continue;
+
+        // find the byte offsets of the chunks
+        ClusterIndex index;
+        std::vector<uint64_t> chunks_offsets;
+        if (indexed) {
+            read_cluster_index(index_file, index);
+            if (index.n_bytes != mapped.size()) throw std::runtime_error("Cluster file does not match its index: " + target_file);
+            for (const auto& block : index.blocks) chunks_offsets.push_back(block.byte_offset);
+        } else {
+            size_t position = 0, n_records = 0;
+            while (position + 8 <= mapped.size()) {
+                if (n_records++ % RECALIBRATION_CHUNK_RECORDS == 0) chunks_offsets.push_back(position);
+                int num_pixels;
+                std::memcpy(&num_pixels, mapped.data() + position + 4, 4);
+                position += 8 + static_cast<size_t>(num_pixels) * 8;
+            }
+            if (position != mapped.size()) throw std::runtime_error("Corrupted cluster file: " + target_file);
+        }
+        chunks_offsets.push_back(mapped.size());
+        const int n_chunks = static_cast<int>(chunks_offsets.size()) - 1;
+
+        // the pixel ids are checked before any energy is written, an exception cannot leave the parallel loop
+        std::vector<long long> chunks_invalid_records(n_chunks, -1);
+        #pragma omp parallel for schedule(dynamic) num_threads(config.n_threads)
+        for (int chunk_i = 0; chunk_i < n_chunks; chunk_i++)
+            chunks_invalid_records[chunk_i] = find_invalid_record(mapped.data() + chunks_offsets[chunk_i], mapped.data() + chunks_offsets[chunk_i + 1], n_pixels);
+        for (int chunk_i = 0; chunk_i < n_chunks; chunk_i++) {
+            if (chunks_invalid_records[chunk_i] < 0) continue;
+            const uint64_t first_record = indexed ? index.blocks[chunk_i].first_record : static_cast<uint64_t>(chunk_i) * RECALIBRATION_CHUNK_RECORDS;
+            throw std::out_of_range(format_string("Pixel id out of the calibration in {}, record {}", target_file, first_record + chunks_invalid_records[chunk_i]));
+        }
+
+        // recalibrate the chunks in parallel
+        std::vector<float> chunks_min_energies(n_chunks, 0), chunks_max_energies(n_chunks, 0);
+        #pragma omp parallel for schedule(dynamic) num_threads(config.n_threads)
+        for (int chunk_i = 0; chunk_i < n_chunks; chunk_i++) {
+            float min_energy = std::numeric_limits<float>::max(), max_energy = std::numeric_limits<float>::lowest();
+            recalibrate_records(mapped.data() + chunks_offsets[chunk_i], mapped.data() + chunks_offsets[chunk_i + 1],
+                pixels_slopes.data(), pixels_offsets.data(), min_energy, max_energy);
+            chunks_min_energies[chunk_i] = min_energy;
+            chunks_max_energies[chunk_i] = max_energy;
+        }
+
+        // the energy ranges of the index blocks have changed
+        if (indexed) {
+            for (int chunk_i = 0; chunk_i < n_chunks; chunk_i++) {
+                index.blocks[chunk_i].min_energy = chunks_min_energies[chunk_i];
+                index.blocks[chunk_i].max_energy = chunks_max_energies[chunk_i];
+            }
+            write_cluster_index(index_file, index);
+        }
+
+        auto end_time = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double> elapsed = end_time - start_time;
+        std::cout << format_string("Recalibrated {} ({} chunks, {} MB) in {} s", target_file, n_chunks, mapped.size() / (1024.0 * 1024.0), elapsed.count()) << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,313 @@
+#include <vector>
+#include <string>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <streambuf>
+#include <stdexcept>
+#include <filesystem>
+#include <system_error>
+#include <condition_variable>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <afunix.h>
+#else
+#include <cerrno>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#endif
+
+#include "header.hpp"
+
+// the protocol: a client connects and sends the arguments of one command, each followed by a newline, and an empty line.
+// the server answers with a line if other jobs are before it in the queue, then the output of the command as it is printed,
+// and a last line "exit {code}" before it closes the connection. the job "shutdown" stops the server after the jobs before it.
+
+// connections waiting to be accepted, and the size limit of a job and the time to send it
+static const int SERVE_BACKLOG = 16;
+static const size_t MAX_JOB_BYTES = static_cast<size_t>(1) << 20;
+static const int RECEIVE_TIMEOUT_SECONDS = 10;
+// the wait after a failed accept(), doubled while it keeps failing (e.g. when the process is out of file descriptors)
+static const int MIN_ACCEPT_BACKOFF_MS = 10;
+static const int MAX_ACCEPT_BACKOFF_MS = 1000;
+
+#ifdef _WIN32
+
+using socket_t = SOCKET;
+static const socket_t NO_SOCKET = INVALID_SOCKET;
+static const int SEND_FLAGS = 0;
+
+static void close_socket(const socket_t socket) {
+    closesocket(socket);
+}
+
+static void stop_accepting(const socket_t socket) {
+    closesocket(socket);
+}
+
+static int last_socket_error() {
+    return WSAGetLastError();
+}
+
+static bool interrupted(const int error) {
+    return error == WSAEINTR;
+}
+
+static void set_receive_timeout(const socket_t socket, const int seconds) {
+    const DWORD timeout = seconds * 1000;
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+}
+
+#else
+
+using socket_t = int;
+static const socket_t NO_SOCKET = -1;
+static const int SEND_FLAGS = MSG_NOSIGNAL;  // a closed client gives an error instead of SIGPIPE
+
+static void close_socket(const socket_t socket) {
+    close(socket);
+}
+
+// closing the socket does not wake up accept() in the other thread, shutting it down does
+static void stop_accepting(const socket_t socket) {
+    shutdown(socket, SHUT_RDWR);
+}
+
+static int last_socket_error() {
+    return errno;
+}
+
+static bool interrupted(const int error) {
+    return error == EINTR;
+}
+
+static void set_receive_timeout(const socket_t socket, const int seconds) {
+    timeval timeout{};
+    timeout.tv_sec = seconds;
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+#endif
+
+static bool send_text(const socket_t client, const std::string& text) {
+    for (size_t n_sent = 0; n_sent < text.size();) {
+        const int n = send(client, text.data() + n_sent, static_cast<int>(text.size() - n_sent), SEND_FLAGS);
+        if (n <= 0) return false;
+        n_sent += n;
+    }
+    return true;
+}
+
+// the arguments of a job, empty if the client sent no complete job in time
+static std::vector<std::string> receive_job(const socket_t client) {
+    set_receive_timeout(client, RECEIVE_TIMEOUT_SECONDS);
+    std::vector<std::string> args;
+    std::string line;
+    char c;
+    for (size_t n_bytes = 0; n_bytes < MAX_JOB_BYTES && recv(client, &c, 1, 0) == 1; n_bytes++) {
+        if (c == '\r') continue;
+        if (c != '\n') {
+            line.push_back(c);
+            continue;
+        }
+        if (line.empty()) return args;
+        args.push_back(line);
+        line.clear();
+    }
+    return {};
+}
+
+// the output of a job sent to its client line by line, the threads of the job may print at the same time.
+// if the client is gone the output is dropped and the job goes on
+class SocketStreambuf : public std::streambuf {
+public:
+    explicit SocketStreambuf(const socket_t client) : client(client) {}
+    ~SocketStreambuf() { sync(); }
+
+protected:
+    int overflow(int c) override {
+        if (c == traits_type::eof()) return traits_type::not_eof(c);
+        const char text = static_cast<char>(c);
+        xsputn(&text, 1);
+        return c;
+    }
+    std::streamsize xsputn(const char* text, std::streamsize n) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.append(text, static_cast<size_t>(n));
+        if (pending.find('\n') != std::string::npos) send_pending();
+        return n;
+    }
+    int sync() override {
+        std::lock_guard<std::mutex> lock(mutex);
+        send_pending();
+        return 0;
+    }
+
+private:
+    void send_pending() {
+        if (connected && !pending.empty()) connected = send_text(client, pending);
+        pending.clear();
+    }
+    socket_t client;
+    bool connected = true;
+    std::string pending;
+    std::mutex mutex;
+};
+
+int serve(const std::string& socket_path, const std::function<int(const std::vector<std::string>&)>& run_job) {
+
+#ifdef _WIN32
+    WSADATA wsa_data;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) throw std::runtime_error("Cannot start Winsock");
+#endif
+
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socket_path.empty() || socket_path.size() >= sizeof(address.sun_path))
+        throw std::invalid_argument(format_string("Invalid socket path: {}", socket_path));
+    std::strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+    // a socket file left by a server which did not stop is removed
+    std::error_code error;
+    std::filesystem::remove(socket_path, error);
+    const socket_t server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server == NO_SOCKET) throw std::runtime_error("Cannot create a Unix socket");
+    if (bind(server, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 || listen(server, SERVE_BACKLOG) != 0) {
+        close_socket(server);
+        throw std::runtime_error(format_string("Cannot listen on {}", socket_path));
+    }
+#ifndef _WIN32
+    chmod(socket_path.c_str(), S_IRUSR | S_IWUSR);  // the jobs write files as the user of the server, only they may send them
+#endif
+    std::cout << "Serving jobs on " << socket_path << std::endl;
+
+    struct Job {
+        socket_t client;
+        std::vector<std::string> args;
+    };
+    std::deque<Job> jobs;
+    bool running = false, stopping = false;
+    int n_receiving = 0;
+    std::mutex mutex;
+    std::condition_variable queued, received;
+
+    // every connection is read by a thread of its own, so a slow client does not hold up the others. at most SERVE_BACKLOG
+    // connections are read at the same time, and the server waits for them before it stops
+    auto receive = [&](const socket_t client) {
+        std::vector<std::string> args = receive_job(client);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (args.empty() || stopping) {
+            send_text(client, format_string("{}\nexit 1\n", stopping ? "The server is stopping" : "Empty job"));
+            close_socket(client);
+        } else {
+            const size_t n_before = jobs.size() + running;
+            if (n_before > 0) send_text(client, format_string("Queued behind {} jobs\n", n_before));
+            jobs.push_back({ client, std::move(args) });
+            queued.notify_one();
+        }
+        n_receiving--;
+        received.notify_all();
+    };
+
+    // the connections are accepted by another thread and the jobs are run by this one, which is the first of the pinned OpenMP threads
+    // the errors are logged to std::clog, since a job sends std::cout and std::cerr to its client
+    std::thread receiver([&]() {
+        int backoff_ms = MIN_ACCEPT_BACKOFF_MS;
+        while (true) {
+            const socket_t client = accept(server, nullptr, nullptr);
+            const int error = client == NO_SOCKET ? last_socket_error() : 0;
+            std::unique_lock<std::mutex> lock(mutex);
+            if (client == NO_SOCKET) {
+                if (stopping) return;
+                if (interrupted(error)) continue;
+                lock.unlock();
+                std::clog << format_string("Cannot accept a connection (error {}), retrying in {} ms", error, backoff_ms) << std::endl;
+                std::this_thread::sleep_for(std::chrono::milliseconds(backoff_ms));
+                backoff_ms = std::min(backoff_ms * 2, MAX_ACCEPT_BACKOFF_MS);
+                continue;
+            }
+            backoff_ms = MIN_ACCEPT_BACKOFF_MS;
+            received.wait(lock, [&]() { return n_receiving < SERVE_BACKLOG; });
+            n_receiving++;
+            lock.unlock();
+            try {
+                std::thread(receive, client).detach();
+            } catch (const std::system_error&) {
+                receive(client);
+            }
+        }
+    });
+
+    for (size_t job_i = 0;; job_i++) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            queued.wait(lock, [&]() { return !jobs.empty(); });
+            job = std::move(jobs.front());
+            jobs.pop_front();
+            running = true;
+        }
+
+        std::string command_line;
+        for (const auto& arg : job.args) command_line += (command_line.empty() ? "" : " ") + arg;
+        std::cout << format_string("Job {}: {}", job_i, command_line) << std::endl;
+
+        if (job.args[0] == "shutdown") {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            send_text(job.client, "Stopping the server\nexit 0\n");
+            close_socket(job.client);
+            for (const auto& other : jobs) {
+                send_text(other.client, "The server is stopping\nexit 1\n");
+                close_socket(other.client);
+            }
+            jobs.clear();
+            break;
+        }
+
+        // the output of the command goes to the client, an error ends the job but not the server
+        const auto start = std::chrono::steady_clock::now();
+        int exit_code = 1;
+        {
+            SocketStreambuf output(job.client);
+            std::streambuf* cout_buffer = std::cout.rdbuf(&output);
+            std::streambuf* cerr_buffer = std::cerr.rdbuf(&output);
+            try {
+                exit_code = run_job(job.args);
+            } catch (const std::exception& exception) {
+                std::cout << "Error: " << exception.what() << std::endl;
+            }
+            std::cout << "exit " << exit_code << std::endl;
+            std::cout.rdbuf(cout_buffer);
+            std::cerr.rdbuf(cerr_buffer);
+        }
+        close_socket(job.client);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << format_string("Job {} finished with exit code {} in {} s", job_i, exit_code, seconds) << std::endl;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        running = false;
+    }
+
+    stop_accepting(server);
+    receiver.join();
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        received.wait(lock, [&]() { return n_receiving == 0; });
+    }
+#ifndef _WIN32
+    close_socket(server);
+#endif
+    std::filesystem::remove(socket_path, error);
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    std::cout << "Stopped serving jobs on " << socket_path << std::endl;
+    return 0;
+}
@@ -0,0 +1,156 @@
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <algorithm>
+#include <stdexcept>
+
+#include "header.hpp"
+
+ClusterStitcher::ClusterStitcher(const RunConfig& config, const std::vector<int>& crystal_ids, const std::vector<std::vector<float>>& crystals_thresholds,
+    const int connectivity) : connectivity(connectivity), crystals_thresholds(crystals_thresholds) {
+
+    config.require({ "PANEL_CRYSTAL_ROWS", "PANEL_CRYSTAL_COLS", "PANEL_CRYSTAL_LAYOUT" });
+
+    n_rows = config.n_rows;
+    n_cols = config.n_cols;
+    n_tile_rows = config.panel_crystal_rows;
+    n_tile_cols = config.panel_crystal_cols;
+    const std::vector<int>& layout = config.panel_crystal_layout;
+    if (static_cast<int>(layout.size()) != n_tile_rows * n_tile_cols)
+        throw std::invalid_argument(format_string("PANEL_CRYSTAL_LAYOUT must list {} crystal ids", n_tile_rows * n_tile_cols));
+    if (static_cast<size_t>(n_tile_rows) * n_rows * n_tile_cols * n_cols > std::numeric_limits<uint16_t>::max() + size_t(1))
+        throw std::invalid_argument("The panel has too many pixels for 16-bit pixel ids");
+    n_panel_rows = n_tile_rows * n_rows;
+    n_panel_cols = n_tile_cols * n_cols;
+
+    std::vector<int> crystals_tiles(config.n_crystals, -1);
+    for (int tile = 0; tile < static_cast<int>(layout.size()); tile++) {
+        if (layout[tile] < 0) continue;
+        if (layout[tile] >= static_cast<int>(crystals_tiles.size()) || crystals_tiles[layout[tile]] != -1)
+            throw std::invalid_argument(format_string("Invalid crystal id {} in PANEL_CRYSTAL_LAYOUT", layout[tile]));
+        crystals_tiles[layout[tile]] = tile;
+    }
+
+    // checked here since stitch() runs in parallel regions, which an exception cannot leave
+    for (const int crystal_id : crystal_ids) {
+        const int tile = crystal_id >= 0 && crystal_id < config.n_crystals ? crystals_tiles[crystal_id] : -1;
+        if (tile < 0) throw std::invalid_argument(format_string("Crystal {} is not in PANEL_CRYSTAL_LAYOUT", crystal_id));
+        crystals_tile_rows.push_back(tile / n_tile_cols);
+        crystals_tile_cols.push_back(tile % n_tile_cols);
+    }
+    if (crystals_thresholds.size() != crystal_ids.size())
+        throw std::invalid_argument("The stitched crystals need one list of thresholds each");
+}
+
+// the clusters of all crystals are walked frame by frame as a k-way merge of the frame ordered streams.
+// a frame with clusters of a single crystal is copied, otherwise the pixels on the crystal edges are looked up among the
+// edge pixels of the other crystals and touching clusters are joined with a union-find. the stitched clusters of a frame
+// are written in the order of their first member (by crystal, then by the order of the clusters).
+int ClusterStitcher::stitch(const std::vector<const ClusterBatch*>& crystals_batches, ClusterBatch& panel_batch) const {
+
+    const int n_crystals = static_cast<int>(crystals_batches.size());
+    auto panel_pixel_id = [&](int crystal_i, int pixel_id) {
+        return (crystals_tile_rows[crystal_i] * n_rows + pixel_id / n_cols) * n_panel_cols + crystals_tile_cols[crystal_i] * n_cols + pixel_id % n_cols;
+    };
+    auto add_cluster_pixels = [&](int crystal_i, size_t cluster_i) {
+        const ClusterBatch& batch = *crystals_batches[crystal_i];
+        for (uint32_t pixel_i = batch.offsets[cluster_i]; pixel_i < batch.offsets[cluster_i + 1]; pixel_i++)
+            panel_batch.add_pixel(panel_pixel_id(crystal_i, batch.pixel_ids[pixel_i]), batch.adus[pixel_i], batch.energies[pixel_i]);
+    };
+
+    std::vector<size_t> cursors(n_crystals, 0);
+    std::vector<std::pair<int, size_t>> members;              // (crystal_i, cluster_i) of the clusters of the frame
+    std::vector<std::pair<int, int>> edge_pixels;             // (panel pixel id, member) of the pixels on the crystal edges
+    std::vector<int> parents;
+    std::vector<char> emitteds;
+    std::vector<char> panel_pixels_addeds(static_cast<size_t>(n_panel_rows) * n_panel_cols, false);
+    auto find = [&](int member) {
+        while (parents[member] != member) member = parents[member] = parents[parents[member]];
+        return member;
+    };
+
+    while (true) {
+        // the next frame is the smallest frame id at the cursors
+        int frame_id = std::numeric_limits<int>::max();
+        for (int crystal_i = 0; crystal_i < n_crystals; crystal_i++)
+            if (cursors[crystal_i] < crystals_batches[crystal_i]->size())
+                frame_id = std::min(frame_id, crystals_batches[crystal_i]->frame_ids[cursors[crystal_i]]);
+        if (frame_id == std::numeric_limits<int>::max()) break;
+
+        members.clear();
+        int n_frame_crystals = 0;
+        for (int crystal_i = 0; crystal_i < n_crystals; crystal_i++) {
+            const ClusterBatch& batch = *crystals_batches[crystal_i];
+            const size_t n_members = members.size();
+            for (size_t& cluster_i = cursors[crystal_i]; cluster_i < batch.size() && batch.frame_ids[cluster_i] == frame_id; cluster_i++)
+                members.emplace_back(crystal_i, cluster_i);
+            n_frame_crystals += members.size() > n_members;
+        }
+
+        if (n_frame_crystals == 1) {
+            for (const auto& member : members) {
+                add_cluster_pixels(member.first, member.second);
+                panel_batch.close_cluster(frame_id);
+            }
+            continue;
+        }
+
+        // collect the above-threshold pixels on the crystal edges
+        const int n_members = static_cast<int>(members.size());
+        edge_pixels.clear();
+        for (int member = 0; member < n_members; member++) {
+            const ClusterBatch& batch = *crystals_batches[members[member].first];
+            const std::vector<float>& thresholds = crystals_thresholds[members[member].first];
+            for (uint32_t pixel_i = batch.offsets[members[member].second]; pixel_i < batch.offsets[members[member].second + 1]; pixel_i++) {
+                if (batch.adus[pixel_i] < thresholds[batch.pixel_ids[pixel_i]]) continue;
+                const int row = batch.pixel_ids[pixel_i] / n_cols, col = batch.pixel_ids[pixel_i] % n_cols;
+                if (row == 0 || row == n_rows - 1 || col == 0 || col == n_cols - 1)
+                    edge_pixels.emplace_back(panel_pixel_id(members[member].first, batch.pixel_ids[pixel_i]), member);
+            }
+        }
+        std::sort(edge_pixels.begin(), edge_pixels.end());
+
+        // join the clusters whose edge pixels are adjacent across two crystals
+        parents.resize(n_members);
+        std::iota(parents.begin(), parents.end(), 0);
+        for (const auto& edge_pixel : edge_pixels) {
+            const int row = edge_pixel.first / n_panel_cols, col = edge_pixel.first % n_panel_cols;
+            for (int d_row = -1; d_row <= 1; d_row++) {
+                for (int d_col = -1; d_col <= 1; d_col++) {
+                    if ((d_row == 0 && d_col == 0) || (connectivity == 4 && d_row != 0 && d_col != 0)) continue;
+                    const int new_row = row + d_row, new_col = col + d_col;
+                    if (new_row < 0 || new_row >= n_panel_rows || new_col < 0 || new_col >= n_panel_cols) continue;
+                    if (new_row / n_rows == row / n_rows && new_col / n_cols == col / n_cols) continue;  // same crystal
+                    auto it = std::lower_bound(edge_pixels.begin(), edge_pixels.end(), std::make_pair(new_row * n_panel_cols + new_col, -1));
+                    for (; it != edge_pixels.end() && it->first == new_row * n_panel_cols + new_col; it++)
+                        parents[find(it->second)] = find(edge_pixel.second);
+                }
+            }
+        }
+
+        // write the stitched clusters, the clusters of a crystal may share halo pixels which are only written once
+        emitteds.assign(n_members, false);
+        for (int member = 0; member < n_members; member++) {
+            const int root = find(member);
+            if (emitteds[root]) continue;
+            emitteds[root] = true;
+            const size_t begin = panel_batch.pixel_ids.size();
+            for (int other = member; other < n_members; other++) {
+                if (find(other) != root) continue;
+                const ClusterBatch& batch = *crystals_batches[members[other].first];
+                for (uint32_t pixel_i = batch.offsets[members[other].second]; pixel_i < batch.offsets[members[other].second + 1]; pixel_i++) {
+                    const int panel_pixel = panel_pixel_id(members[other].first, batch.pixel_ids[pixel_i]);
+                    if (panel_pixels_addeds[panel_pixel]) continue;
+                    panel_pixels_addeds[panel_pixel] = true;
+                    panel_batch.add_pixel(panel_pixel, batch.adus[pixel_i], batch.energies[pixel_i]);
+                }
+            }
+            for (size_t pixel_i = begin; pixel_i < panel_batch.pixel_ids.size(); pixel_i++) panel_pixels_addeds[panel_batch.pixel_ids[pixel_i]] = false;
+            panel_batch.close_cluster(frame_id);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,136 @@
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+
+#include "header.hpp"
+
+ClusterTemporalLinker::ClusterTemporalLinker(const int window, const std::vector<float>& pixels_thresholds)
+    : window(window), pixels_thresholds(pixels_thresholds) {
+    pixels_last_frame_ids.assign(pixels_thresholds.size(), std::numeric_limits<int>::min());
+    pixels_events.assign(pixels_thresholds.size(), -1);
+    pixels_entries.assign(pixels_thresholds.size(), -1);
+}
+
+// the hits of a pixel in several frames of the event are one entry with the sum of their ADUs (saturated) and energies
+int ClusterTemporalLinker::write_event(const Event& event, ClusterBatch& events) {
+    const size_t begin = events.pixel_ids.size();
+    for (size_t hit_i = 0; hit_i < event.pixel_ids.size(); hit_i++) {
+        const int pixel_id = event.pixel_ids[hit_i];
+        if (pixels_entries[pixel_id] < 0) {
+            pixels_entries[pixel_id] = static_cast<int>(events.pixel_ids.size() - begin);
+            events.add_pixel(pixel_id, event.adus[hit_i], event.energies[hit_i]);
+            continue;
+        }
+        const size_t entry = begin + pixels_entries[pixel_id];
+        events.adus[entry] = static_cast<uint16_t>(std::min<int>(events.adus[entry] + event.adus[hit_i], std::numeric_limits<uint16_t>::max()));
+        events.energies[entry] += event.energies[hit_i];
+    }
+    for (size_t entry = begin; entry < events.pixel_ids.size(); entry++) pixels_entries[events.pixel_ids[entry]] = -1;
+    events.close_cluster(event.first_frame_id);
+    return 0;
+}
+
+// the open events whose last hit is more than window frames before frame_id are closed. the closed events are written in the
+// order of their first frames, once no open event starts before them, so an event may be written in a later batch
+int ClusterTemporalLinker::close_events(const int frame_id, ClusterBatch& events) {
+    size_t n_open = 0;
+    int first_open_frame_id = std::numeric_limits<int>::max();
+    for (auto event_i : open_events) {
+        const Event& event = events_pool[event_i];
+        if (static_cast<long long>(frame_id) - event.last_frame_id <= window) {
+            open_events[n_open++] = event_i;
+            first_open_frame_id = std::min(first_open_frame_id, event.first_frame_id);
+            continue;
+        }
+        closed_events.push_back(event_i);
+    }
+    open_events.resize(n_open);
+
+    std::stable_sort(closed_events.begin(), closed_events.end(), [&](int a, int b) { return events_pool[a].first_frame_id < events_pool[b].first_frame_id; });
+    size_t n_written = 0;
+    for (; n_written < closed_events.size() && events_pool[closed_events[n_written]].first_frame_id <= first_open_frame_id; n_written++) {
+        write_event(events_pool[closed_events[n_written]], events);
+        free_events.push_back(closed_events[n_written]);
+    }
+    closed_events.erase(closed_events.begin(), closed_events.begin() + n_written);
+    return 0;
+}
+
+int ClusterTemporalLinker::link(const ClusterBatch& batch, ClusterBatch& events) {
+
+    int frame_id = std::numeric_limits<int>::min();
+    for (size_t cluster_i = 0; cluster_i < batch.size(); cluster_i++) {
+        if (batch.frame_ids[cluster_i] != frame_id) {
+            frame_id = batch.frame_ids[cluster_i];
+            close_events(frame_id, events);
+        }
+        const uint32_t begin = batch.offsets[cluster_i], end = batch.offsets[cluster_i + 1];
+
+        // the open events hit by the above-threshold pixels of the cluster in the previous frames of the window
+        linked_events.clear();
+        for (uint32_t pixel_i = begin; pixel_i < end; pixel_i++) {
+            const int pixel_id = batch.pixel_ids[pixel_i];
+            if (batch.adus[pixel_i] < pixels_thresholds[pixel_id]) continue;
+            const int last_frame_id = pixels_last_frame_ids[pixel_id];
+            if (last_frame_id < frame_id && static_cast<long long>(frame_id) - last_frame_id <= window)
+                if (std::find(linked_events.begin(), linked_events.end(), pixels_events[pixel_id]) == linked_events.end())
+                    linked_events.push_back(pixels_events[pixel_id]);
+        }
+
+        // start a new event, or join the first linked event and merge the other ones into it
+        int event_i;
+        if (linked_events.empty()) {
+            if (free_events.empty()) {
+                event_i = static_cast<int>(events_pool.size());
+                events_pool.emplace_back();
+            } else {
+                event_i = free_events.back();
+                free_events.pop_back();
+            }
+            Event& event = events_pool[event_i];
+            event.first_frame_id = frame_id;
+            event.pixel_ids.clear();
+            event.adus.clear();
+            event.energies.clear();
+            open_events.push_back(event_i);
+        } else {
+            event_i = linked_events[0];
+            for (size_t linked_i = 1; linked_i < linked_events.size(); linked_i++) {
+                const int other_i = linked_events[linked_i];
+                Event& event = events_pool[event_i];
+                Event& other = events_pool[other_i];
+                event.first_frame_id = std::min(event.first_frame_id, other.first_frame_id);
+                event.last_frame_id = std::max(event.last_frame_id, other.last_frame_id);
+                for (size_t hit_i = 0; hit_i < other.pixel_ids.size(); hit_i++) {
+                    if (pixels_events[other.pixel_ids[hit_i]] == other_i) pixels_events[other.pixel_ids[hit_i]] = event_i;
+                    event.pixel_ids.push_back(other.pixel_ids[hit_i]);
+                    event.adus.push_back(other.adus[hit_i]);
+                    event.energies.push_back(other.energies[hit_i]);
+                }
+                open_events.erase(std::find(open_events.begin(), open_events.end(), other_i));
+                free_events.push_back(other_i);
+            }
+        }
+
+        Event& event = events_pool[event_i];
+        event.last_frame_id = frame_id;
+        for (uint32_t pixel_i = begin; pixel_i < end; pixel_i++) {
+            const int pixel_id = batch.pixel_ids[pixel_i];
+            event.pixel_ids.push_back(batch.pixel_ids[pixel_i]);
+            event.adus.push_back(batch.adus[pixel_i]);
+            event.energies.push_back(batch.energies[pixel_i]);
+            if (batch.adus[pixel_i] < pixels_thresholds[pixel_id]) continue;
+            pixels_last_frame_ids[pixel_id] = frame_id;
+            pixels_events[pixel_id] = event_i;
+        }
+    }
+    return 0;
+}
+
+int ClusterTemporalLinker::finish(ClusterBatch& events) {
+    close_events(std::numeric_limits<int>::max(), events);
+    std::fill(pixels_last_frame_ids.begin(), pixels_last_frame_ids.end(), std::numeric_limits<int>::min());
+    return 0;
+}
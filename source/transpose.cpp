@@ -0,0 +1,176 @@
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <filesystem>
+#include <chrono>
+#include <stdexcept>
+#include <omp.h>
+
+#include "header.hpp"
+
+// file layout (little endian):
+// header: char[4] "TPXS", uint32 version, uint32 n_crystals, uint32 n_pixels, uint32 block_frames, uint32 reserved,
+//         uint64 n_frames, uint64 rawfile_size, uint64 pixel_order_hash, int64 rawfile_mtime
+// blocks: for each block of frames, for each crystal and pixel, uint16 values[frames in the block]
+static const char TRANSPOSED_MAGIC[4] = { 'T', 'P', 'X', 'S' };
+static const uint32_t TRANSPOSED_VERSION = 2;
+static const size_t TRANSPOSED_HEADER_SIZE = 56;
+
+// number of frames and pixels transposed at once, which fit in the cache
+static const int TRANSPOSE_TILE = 64;
+
+struct TransposedHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t n_crystals;
+    uint32_t n_pixels;
+    uint32_t block_frames;
+    uint32_t reserved;
+    uint64_t n_frames;
+    uint64_t rawfile_size;
+    uint64_t pixel_order_hash;
+    int64_t rawfile_mtime;
+};
+static_assert(sizeof(TransposedHeader) == TRANSPOSED_HEADER_SIZE, "TransposedHeader must be packed");
+
+// a transposed file is stale once the raw file is rewritten or the pixels are mapped differently (merge indexes, folds or
+// readout order), even if the sizes are the same. the pixel order is hashed with FNV-1a
+static uint64_t pixel_order_hash(const RunConfig& config) {
+    uint64_t hash = 14695981039346656037ull;
+    for (const int pixel_id : config.pixel_order) {
+        const uint32_t value = static_cast<uint32_t>(pixel_id);
+        for (int byte_i = 0; byte_i < 4; byte_i++) {
+            hash ^= (value >> (8 * byte_i)) & 0xFF;
+            hash *= 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+static int64_t rawfile_mtime(const std::string& rawfile) {
+    return static_cast<int64_t>(std::filesystem::last_write_time(rawfile).time_since_epoch().count());
+}
+
+bool TransposedRawfile::available(const RunConfig& config, const std::string& rawfile) {
+    const std::string filename = filename_of(rawfile);
+    if (!std::filesystem::exists(filename) || !std::filesystem::exists(rawfile)) return false;
+
+    TransposedHeader header;
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.read(reinterpret_cast<char*>(&header), TRANSPOSED_HEADER_SIZE)) return false;
+    return std::memcmp(header.magic, TRANSPOSED_MAGIC, 4) == 0 && header.version == TRANSPOSED_VERSION
+        && header.n_crystals == static_cast<uint32_t>(config.n_crystals)
+        && header.n_pixels == static_cast<uint32_t>(config.n_pixels)
+        && header.rawfile_size == std::filesystem::file_size(rawfile)
+        && header.pixel_order_hash == pixel_order_hash(config)
+        && header.rawfile_mtime == rawfile_mtime(rawfile)
+        && std::filesystem::file_size(filename) == TRANSPOSED_HEADER_SIZE + header.n_frames * header.n_crystals * header.n_pixels * sizeof(uint16_t);
+}
+
+TransposedRawfile::TransposedRawfile(const std::string& rawfile) : mapped(filename_of(rawfile), false) {
+    TransposedHeader header;
+    if (mapped.size() < TRANSPOSED_HEADER_SIZE) throw std::runtime_error("Not a transposed raw file: " + filename_of(rawfile));
+    std::memcpy(&header, mapped.data(), TRANSPOSED_HEADER_SIZE);
+    if (std::memcmp(header.magic, TRANSPOSED_MAGIC, 4) != 0 || header.version != TRANSPOSED_VERSION)
+        throw std::runtime_error("Not a transposed raw file: " + filename_of(rawfile));
+    n_crystals = header.n_crystals;
+    n_pixels = header.n_pixels;
+    block_frames = header.block_frames;
+    total_frames = header.n_frames;
+}
+
+int TransposedRawfile::read_pixel(const int crystal_id, const int pixel_id, uint16_t* values) const {
+    const uint8_t* data = mapped.data() + TRANSPOSED_HEADER_SIZE;
+    const size_t block_size = static_cast<size_t>(block_frames) * n_crystals * n_pixels * sizeof(uint16_t);
+    for (uint64_t start_frame_id = 0; start_frame_id < total_frames; start_frame_id += block_frames) {
+        const size_t n_block_frames = std::min<uint64_t>(block_frames, total_frames - start_frame_id);
+        const size_t position = (start_frame_id / block_frames) * block_size
+            + (static_cast<size_t>(crystal_id) * n_pixels + pixel_id) * n_block_frames * sizeof(uint16_t);
+        std::memcpy(values + start_frame_id, data + position, n_block_frames * sizeof(uint16_t));
+    }
+    return 0;
+}
+
+// the frames container and the values of the pixels of one crystal
+FlowMemory transpose_memory(const RunConfig& config) {
+    FlowMemory memory;
+    memory.frame_bytes = static_cast<size_t>(config.n_planes() + 1) * config.n_pixels * sizeof(uint16_t);
+    return memory;
+}
+
+// write {rawfile}.tpx for each raw file, one flow of MAX_FRAMES_SIZE frames is one block
+int transpose(const RunConfig& config, const std::vector<std::string>& rawfiles) {
+
+    const int n_crystals = config.n_crystals;
+    const int max_frames = config.max_frames_size;
+    const int n_pixels = config.n_pixels;
+    const size_t n_frame_pixels = config.frame_size();
+    FlowBuffer crystals_frames_images(config);
+    PooledBuffer pixels_buffer(static_cast<size_t>(n_pixels) * max_frames * sizeof(uint16_t));
+    uint16_t* pixels_values = static_cast<uint16_t*>(pixels_buffer.data());
+
+    for (const auto& rawfile : rawfiles) {
+        auto start_time = std::chrono::high_resolution_clock::now();
+        if (!std::filesystem::is_regular_file(rawfile))
+            throw std::runtime_error("ERROR: Not a regular file: " + rawfile);
+        const size_t rawfile_size = std::filesystem::file_size(rawfile);
+        const int64_t mtime = rawfile_mtime(rawfile);
+        const size_t n_frames = rawfile_size / n_frame_pixels / sizeof(uint16_t);
+
+        // the header is written last, so an interrupted transpose leaves a file that is not available
+        const std::string filename = TransposedRawfile::filename_of(rawfile);
+        std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) throw std::runtime_error("Cannot open: " + filename);
+        std::vector<char> empty_header(TRANSPOSED_HEADER_SIZE, 0);
+        file.write(empty_header.data(), TRANSPOSED_HEADER_SIZE);
+
+        int n_flow_times = (n_frames + max_frames - 1) / max_frames;
+        for (int flow_i = 0; flow_i < n_flow_times; flow_i++) {
+            int start_frame_id = flow_i * max_frames;
+            int end_frame_id = static_cast<int>(std::min(static_cast<size_t>(start_frame_id) + max_frames, n_frames));
+            const int frames_in_chunk = end_frame_id - start_frame_id;
+            read_rawfile_to_crystals_frames_images(config, rawfile, start_frame_id, end_frame_id, crystals_frames_images.data());
+
+            // transpose each crystal by tiles of frames and pixels
+            for (int crystal_id = 0; crystal_id < n_crystals; crystal_id++) {
+                const uint16_t* frames_ptr = crystals_frames_images.data() + config.plane_offset(crystal_id);
+                #pragma omp parallel for collapse(2) schedule(static) num_threads(config.n_threads)
+                for (int frame_tile = 0; frame_tile < frames_in_chunk; frame_tile += TRANSPOSE_TILE) {
+                    for (int pixel_tile = 0; pixel_tile < n_pixels; pixel_tile += TRANSPOSE_TILE) {
+                        const int frame_end = std::min(frame_tile + TRANSPOSE_TILE, frames_in_chunk);
+                        const int pixel_end = std::min(pixel_tile + TRANSPOSE_TILE, n_pixels);
+                        for (int frame_i = frame_tile; frame_i < frame_end; frame_i++)
+                            for (int pixel_id = pixel_tile; pixel_id < pixel_end; pixel_id++)
+                                pixels_values[static_cast<size_t>(pixel_id) * frames_in_chunk + frame_i] = frames_ptr[static_cast<size_t>(frame_i) * n_pixels + pixel_id];
+                    }
+                }
+                file.write(reinterpret_cast<const char*>(pixels_values), static_cast<size_t>(n_pixels) * frames_in_chunk * sizeof(uint16_t));
+            }
+        }
+
+        TransposedHeader header;
+        std::memcpy(header.magic, TRANSPOSED_MAGIC, 4);
+        header.version = TRANSPOSED_VERSION;
+        header.n_crystals = n_crystals;
+        header.n_pixels = n_pixels;
+        header.block_frames = max_frames;
+        header.reserved = 0;
+        header.n_frames = n_frames;
+        header.rawfile_size = rawfile_size;
+        header.pixel_order_hash = pixel_order_hash(config);
+        header.rawfile_mtime = mtime;
+        file.seekp(0);
+        file.write(reinterpret_cast<const char*>(&header), TRANSPOSED_HEADER_SIZE);
+        file.close();
+        if (!file) throw std::runtime_error("Cannot write: " + filename);
+
+        auto end_time = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double> elapsed = end_time - start_time;
+        std::cout << format_string("Transposed {} frames of {} into {} in {} s", n_frames, rawfile, filename, elapsed.count()) << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,183 @@
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+#include "header.hpp"
+
+// each bucket is written to disk only when this many bytes are collected
+static const size_t BUCKET_BUFFER_SIZE = 1 << 20;
+
+// index file layout (little endian):
+// header: char[4] "CIDX", uint32 version, uint32 block_records, uint32 n_files, uint64 n_blocks, uint64 n_records, uint64 n_bytes
+// files:  n_files x { uint64 byte_offset, uint64 first_record, uint32 path_length, char path[path_length] }
+// blocks: n_blocks x ClusterIndexBlock (40 bytes)
+static const char CLUSTER_INDEX_MAGIC[4] = { 'C', 'I', 'D', 'X' };
+static const uint32_t CLUSTER_INDEX_VERSION = 1;
+
+int write_cluster_index(const std::string& filename, const ClusterIndex& index) {
+    std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) throw std::runtime_error("Cannot open: " + filename);
+
+    const uint32_t n_files = static_cast<uint32_t>(index.files.size());
+    const uint64_t n_blocks = index.blocks.size();
+    file.write(CLUSTER_INDEX_MAGIC, 4);
+    file.write(reinterpret_cast<const char*>(&CLUSTER_INDEX_VERSION), 4);
+    file.write(reinterpret_cast<const char*>(&index.block_records), 4);
+    file.write(reinterpret_cast<const char*>(&n_files), 4);
+    file.write(reinterpret_cast<const char*>(&n_blocks), 8);
+    file.write(reinterpret_cast<const char*>(&index.n_records), 8);
+    file.write(reinterpret_cast<const char*>(&index.n_bytes), 8);
+    for (const auto& index_file : index.files) {
+        const uint32_t path_length = static_cast<uint32_t>(index_file.rawfile.size());
+        file.write(reinterpret_cast<const char*>(&index_file.byte_offset), 8);
+        file.write(reinterpret_cast<const char*>(&index_file.first_record), 8);
+        file.write(reinterpret_cast<const char*>(&path_length), 4);
+        file.write(index_file.rawfile.data(), path_length);
+    }
+    static_assert(sizeof(ClusterIndexBlock) == 40, "ClusterIndexBlock must be packed");
+    file.write(reinterpret_cast<const char*>(index.blocks.data()), n_blocks * sizeof(ClusterIndexBlock));
+    return 0;
+}
+
+int read_cluster_index(const std::string& filename, ClusterIndex& index) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) throw std::runtime_error("Cannot open: " + filename);
+
+    char magic[4];
+    uint32_t version, n_files;
+    uint64_t n_blocks;
+    file.read(magic, 4);
+    file.read(reinterpret_cast<char*>(&version), 4);
+    if (!file || std::memcmp(magic, CLUSTER_INDEX_MAGIC, 4) != 0 || version != CLUSTER_INDEX_VERSION)
+        throw std::runtime_error("Not a cluster index file: " + filename);
+    file.read(reinterpret_cast<char*>(&index.block_records), 4);
+    file.read(reinterpret_cast<char*>(&n_files), 4);
+    file.read(reinterpret_cast<char*>(&n_blocks), 8);
+    file.read(reinterpret_cast<char*>(&index.n_records), 8);
+    file.read(reinterpret_cast<char*>(&index.n_bytes), 8);
+    index.files.resize(n_files);
+    for (auto& index_file : index.files) {
+        uint32_t path_length;
+        file.read(reinterpret_cast<char*>(&index_file.byte_offset), 8);
+        file.read(reinterpret_cast<char*>(&index_file.first_record), 8);
+        file.read(reinterpret_cast<char*>(&path_length), 4);
+        index_file.rawfile.resize(path_length);
+        file.read(index_file.rawfile.data(), path_length);
+    }
+    index.blocks.resize(n_blocks);
+    file.read(reinterpret_cast<char*>(index.blocks.data()), n_blocks * sizeof(ClusterIndexBlock));
+    if (!file) throw std::runtime_error("Truncated cluster index file: " + filename);
+    return 0;
+}
+
+ClusterWriter::ClusterWriter(const std::string& folder, const std::vector<int>& crystal_ids, int max_event_pixels,
+    const std::string& suffix, bool clear_file, const std::string& stem) : max_event_pixels(max_event_pixels), indexed(clear_file) {
+
+    int n_crystals = 0;
+    for (auto crystal_id : crystal_ids) n_crystals = std::max(n_crystals, crystal_id + 1);
+    crystals_buckets.resize(n_crystals);
+
+    // open every file once, in append mode unless the files should be cleared
+    // the index only describes a file written from its beginning, so a stale index of an appended file is removed
+    const auto mode = std::ios::binary | (clear_file ? std::ios::trunc : std::ios::app);
+    for (auto crystal_id : crystal_ids) {
+        crystals_buckets[crystal_id] = std::vector<Bucket>(max_event_pixels + 1);
+        for (int pixel_n = 1; pixel_n <= max_event_pixels + 1; pixel_n++) {
+            Bucket& bucket = crystals_buckets[crystal_id][pixel_n - 1];
+            bucket.filename = pixel_n <= max_event_pixels
+                ? format_string("{}\\{}_{}_pixel_{}{}.bin", folder, stem, crystal_id, pixel_n, suffix)
+                : format_string("{}\\{}_{}_pixel_large{}.bin", folder, stem, crystal_id, suffix);
+            bucket.stream.open(bucket.filename, mode);
+            if (!bucket.stream.is_open()) throw std::runtime_error("Cannot open: " + bucket.filename);
+            bucket.buffer.reserve(BUCKET_BUFFER_SIZE);
+            if (!indexed) std::filesystem::remove(bucket.filename + ".idx");
+        }
+    }
+}
+
+ClusterWriter::~ClusterWriter() {
+    close();
+}
+
+int ClusterWriter::begin_rawfile(const std::string& rawfile) {
+    for (auto& buckets : crystals_buckets)
+        for (auto& bucket : buckets)
+            bucket.index.files.push_back({ bucket.index.n_bytes, bucket.index.n_records, rawfile });
+    return 0;
+}
+
+int ClusterWriter::flush_bucket(Bucket& bucket) {
+    bucket.stream.write(bucket.buffer.data(), bucket.buffer.size());
+    bucket.buffer.clear();
+    return 0;
+}
+
+int ClusterWriter::flush() {
+    for (auto& buckets : crystals_buckets)
+        for (auto& bucket : buckets) {
+            flush_bucket(bucket);
+            bucket.stream.flush();
+        }
+    return 0;
+}
+
+int ClusterWriter::close() {
+    if (closed) return 0;
+    flush();
+    for (auto& buckets : crystals_buckets)
+        for (auto& bucket : buckets) {
+            bucket.stream.close();
+            if (indexed) write_cluster_index(bucket.filename + ".idx", bucket.index);
+        }
+    closed = true;
+    return 0;
+}
+
+// record of one cluster: int frame_id, int num_pixels, uint16 pixel_ids[num_pixels], uint16 adus[num_pixels], float energies[num_pixels]
+int ClusterWriter::write(int crystal_id, const ClusterBatch& batch) {
+
+    std::vector<Bucket>& buckets = crystals_buckets[crystal_id];
+    if (buckets.empty()) throw std::runtime_error(format_string("No cluster files opened for crystal {}", crystal_id));
+
+    for (size_t cluster_i = 0; cluster_i < batch.size(); cluster_i++) {
+
+        const int num_pixels = static_cast<int>(batch.cluster_size(cluster_i));
+        const size_t offset = batch.offsets[cluster_i];
+        Bucket& bucket = buckets[std::min(num_pixels, max_event_pixels + 1) - 1];
+
+        const size_t record_size = 8 + num_pixels * (sizeof(uint16_t) + sizeof(uint16_t) + sizeof(float));
+        size_t position = bucket.buffer.size();
+        bucket.buffer.resize(position + record_size);
+        char* record = bucket.buffer.data() + position;
+        std::memcpy(record, &batch.frame_ids[cluster_i], 4);
+        std::memcpy(record + 4, &num_pixels, 4);
+        std::memcpy(record + 8, batch.pixel_ids.data() + offset, num_pixels * sizeof(uint16_t));
+        std::memcpy(record + 8 + num_pixels * 2, batch.adus.data() + offset, num_pixels * sizeof(uint16_t));
+        std::memcpy(record + 8 + num_pixels * 4, batch.energies.data() + offset, num_pixels * sizeof(float));
+
+        // a new index block starts when the last one is full or belongs to the previous raw file
+        ClusterIndex& index = bucket.index;
+        const int frame_id = batch.frame_ids[cluster_i];
+        float total_energy = 0;
+        for (int pixel_i = 0; pixel_i < num_pixels; pixel_i++) total_energy += batch.energies[offset + pixel_i];
+        const uint32_t file_index = index.files.empty() ? 0 : static_cast<uint32_t>(index.files.size() - 1);
+        if (index.blocks.empty() || index.blocks.back().n_records == index.block_records || index.blocks.back().file_index != file_index)
+            index.blocks.push_back({ index.n_bytes, index.n_records, 0, file_index, frame_id, frame_id, total_energy, total_energy });
+        ClusterIndexBlock& block = index.blocks.back();
+        block.n_records++;
+        block.min_frame_id = std::min(block.min_frame_id, frame_id);
+        block.max_frame_id = std::max(block.max_frame_id, frame_id);
+        block.min_energy = std::min(block.min_energy, total_energy);
+        block.max_energy = std::max(block.max_energy, total_energy);
+        index.n_records++;
+        index.n_bytes += record_size;
+
+        if (bucket.buffer.size() >= BUCKET_BUFFER_SIZE) flush_bucket(bucket);
+    }
+    return 0;
+}
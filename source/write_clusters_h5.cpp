@@ -0,0 +1,110 @@
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+#include "highfive/HighFive.hpp"
+
+#include "header.hpp"
+
+// number of elements per chunk of every column, and the compression level
+static const hsize_t COLUMN_CHUNK_SIZE = 1 << 16;
+static const unsigned COLUMN_DEFLATE_LEVEL = 4;
+
+template <typename T>
+static void create_column(HighFive::File& file, const std::string& name) {
+    HighFive::DataSetCreateProps props;
+    props.add(HighFive::Chunking(std::vector<hsize_t>{ COLUMN_CHUNK_SIZE }));
+    props.add(HighFive::Shuffle());
+    props.add(HighFive::Deflate(COLUMN_DEFLATE_LEVEL));
+    HighFive::DataSpace space({ 0 }, { HighFive::DataSpace::UNLIMITED });
+    file.createDataSet<T>(name, space, props);
+}
+
+// append the values to the end of a column, and clear them
+template <typename T>
+static void append_column(HighFive::File& file, const std::string& name, std::vector<T>& values) {
+    if (values.empty()) return;
+    auto dset = file.getDataSet(name);
+    const size_t n_rows = dset.getElementCount();
+    dset.resize({ n_rows + values.size() });
+    dset.select({ n_rows }, { values.size() }).write_raw(values.data());
+    values.clear();
+}
+
+ClusterH5Writer::ClusterH5Writer(const std::string& folder, const std::vector<int>& crystal_ids, const std::string& suffix,
+    const std::string& stem) {
+
+    int n_crystals = 0;
+    for (auto crystal_id : crystal_ids) n_crystals = std::max(n_crystals, crystal_id + 1);
+    crystals_columns.resize(n_crystals);
+
+    for (auto crystal_id : crystal_ids) {
+        std::string cluster_file = format_string("{}\\{}_{}{}.h5", folder, stem, crystal_id, suffix);
+        auto file = std::make_unique<HighFive::File>(cluster_file, HighFive::File::ReadWrite | HighFive::File::Create | HighFive::File::Truncate);
+        create_column<int>(*file, "frame_id");
+        create_column<uint16_t>(*file, "file_index");
+        create_column<uint16_t>(*file, "size");
+        create_column<uint64_t>(*file, "offset");
+        create_column<uint16_t>(*file, "pixel_id");
+        create_column<uint16_t>(*file, "adu");
+        create_column<float>(*file, "energy");
+        crystals_columns[crystal_id].file = std::move(file);
+    }
+}
+
+ClusterH5Writer::~ClusterH5Writer() {
+    close();
+}
+
+int ClusterH5Writer::begin_rawfile(const std::string& rawfile) {
+    rawfiles.push_back(rawfile);
+    return 0;
+}
+
+int ClusterH5Writer::write(int crystal_id, const ClusterBatch& batch) {
+
+    CrystalColumns& columns = crystals_columns[crystal_id];
+    if (!columns.file) throw std::runtime_error(format_string("No cluster file opened for crystal {}", crystal_id));
+
+    const uint16_t file_index = static_cast<uint16_t>(rawfiles.empty() ? 0 : rawfiles.size() - 1);
+    const uint64_t first_offset = columns.n_pixels_written + columns.pixel_ids.size();
+    for (size_t cluster_i = 0; cluster_i < batch.size(); cluster_i++) {
+        columns.frame_ids.push_back(batch.frame_ids[cluster_i]);
+        columns.file_indices.push_back(file_index);
+        columns.sizes.push_back(static_cast<uint16_t>(batch.cluster_size(cluster_i)));
+        columns.offsets.push_back(first_offset + batch.offsets[cluster_i]);
+    }
+    columns.pixel_ids.insert(columns.pixel_ids.end(), batch.pixel_ids.begin(), batch.pixel_ids.end());
+    columns.adus.insert(columns.adus.end(), batch.adus.begin(), batch.adus.end());
+    columns.energies.insert(columns.energies.end(), batch.energies.begin(), batch.energies.end());
+    return 0;
+}
+
+int ClusterH5Writer::flush() {
+    for (auto& columns : crystals_columns) {
+        if (!columns.file) continue;
+        columns.n_pixels_written += columns.pixel_ids.size();
+        append_column(*columns.file, "frame_id", columns.frame_ids);
+        append_column(*columns.file, "file_index", columns.file_indices);
+        append_column(*columns.file, "size", columns.sizes);
+        append_column(*columns.file, "offset", columns.offsets);
+        append_column(*columns.file, "pixel_id", columns.pixel_ids);
+        append_column(*columns.file, "adu", columns.adus);
+        append_column(*columns.file, "energy", columns.energies);
+        columns.file->flush();
+    }
+    return 0;
+}
+
+int ClusterH5Writer::close() {
+    if (closed) return 0;
+    flush();
+    for (auto& columns : crystals_columns) {
+        if (!columns.file) continue;
+        columns.file->createDataSet("rawfiles", rawfiles);
+        columns.file.reset();
+    }
+    closed = true;
+    return 0;
+}
@@ -0,0 +1,150 @@
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+#include "highfive/HighFive.hpp"
+
+#include "header.hpp"
+
+// the frames are stored in chunks of this many frames, the frame ids and file indices in chunks of this many values
+static const hsize_t TRIGGERED_CHUNK_FRAMES = 64;
+static const hsize_t TRIGGERED_CHUNK_VALUES = 4096;
+static const unsigned TRIGGERED_DEFLATE_LEVEL = 4;
+
+TriggeredFramesWriter::TriggeredFramesWriter(const std::string& folder, const std::vector<int>& crystal_ids, const std::string& suffix,
+    const FrameTrigger& trigger, const int n_pixels) : trigger(trigger), n_pixels(static_cast<size_t>(n_pixels)) {
+
+    if (trigger.min_size < 1 || trigger.pre < 0 || trigger.post < 0)
+        throw std::invalid_argument("The trigger needs a minimum cluster size of at least 1 and non-negative numbers of pre and post frames");
+
+    int n_crystals = 0;
+    for (auto crystal_id : crystal_ids) n_crystals = std::max(n_crystals, crystal_id + 1);
+    crystals_frames.resize(n_crystals);
+
+    for (auto crystal_id : crystal_ids) {
+        std::string frames_file = format_string("{}\\triggered_frames_crystal_{}{}.h5", folder, crystal_id, suffix);
+        auto file = std::make_unique<HighFive::File>(frames_file, HighFive::File::ReadWrite | HighFive::File::Create | HighFive::File::Truncate);
+
+        HighFive::DataSetCreateProps frames_props;
+        frames_props.add(HighFive::Chunking(std::vector<hsize_t>{ TRIGGERED_CHUNK_FRAMES, this->n_pixels }));
+        frames_props.add(HighFive::Shuffle());
+        frames_props.add(HighFive::Deflate(TRIGGERED_DEFLATE_LEVEL));
+        file->createDataSet<uint16_t>("frames", HighFive::DataSpace({ 0, this->n_pixels }, { HighFive::DataSpace::UNLIMITED, this->n_pixels }), frames_props);
+
+        HighFive::DataSetCreateProps values_props;
+        values_props.add(HighFive::Chunking(std::vector<hsize_t>{ TRIGGERED_CHUNK_VALUES }));
+        values_props.add(HighFive::Deflate(TRIGGERED_DEFLATE_LEVEL));
+        file->createDataSet<int>("frame_id", HighFive::DataSpace({ 0 }, { HighFive::DataSpace::UNLIMITED }), values_props);
+        file->createDataSet<uint16_t>("file_index", HighFive::DataSpace({ 0 }, { HighFive::DataSpace::UNLIMITED }), values_props);
+        crystals_frames[crystal_id].file = std::move(file);
+    }
+}
+
+TriggeredFramesWriter::~TriggeredFramesWriter() {
+    close();
+}
+
+// the frame ids start again from 0 in every raw file, so nothing is carried over from the previous one
+int TriggeredFramesWriter::begin_rawfile(const std::string& rawfile) {
+    rawfiles.push_back(rawfile);
+    for (auto& frames : crystals_frames) {
+        frames.tail_images.clear();
+        frames.tail_frame_ids.clear();
+        frames.last_written_frame_id = -1;
+        frames.post_end_frame_id = -1;
+    }
+    return 0;
+}
+
+int TriggeredFramesWriter::add_flow(const int crystal_id, const uint16_t* frames_images, const int start_frame_id, const int n_frames,
+    const std::vector<const ClusterBatch*>& batches) {
+
+    CrystalFrames& frames = crystals_frames[crystal_id];
+    if (!frames.file) throw std::runtime_error(format_string("No triggered frames file opened for crystal {}", crystal_id));
+
+    // the kept frames of the previous flow come right before this flow, selecteds[frame_id - first_frame_id] marks the frames to write
+    const int n_tail_frames = static_cast<int>(frames.tail_frame_ids.size());
+    const int first_frame_id = start_frame_id - n_tail_frames;
+    const int end_frame_id = start_frame_id + n_frames;
+    selecteds.assign(n_tail_frames + n_frames, false);
+    auto select = [&](int low, int high) {
+        low = std::max(low, first_frame_id);
+        high = std::min(high, end_frame_id - 1);
+        for (int frame_id = low; frame_id <= high; frame_id++) selecteds[frame_id - first_frame_id] = true;
+    };
+
+    // the post frames of the triggers of the previous flow, then the triggers of this flow
+    select(start_frame_id, frames.post_end_frame_id);
+    for (const ClusterBatch* batch : batches) {
+        int last_trigger_frame_id = -1;
+        for (size_t cluster_i = 0; cluster_i < batch->size(); cluster_i++) {
+            const int frame_id = batch->frame_ids[cluster_i];
+            if (frame_id == last_trigger_frame_id || static_cast<int>(batch->cluster_size(cluster_i)) < trigger.min_size) continue;
+            float energy = 0;
+            for (uint32_t pixel_i = batch->offsets[cluster_i]; pixel_i < batch->offsets[cluster_i + 1]; pixel_i++)
+                energy += batch->energies[pixel_i];
+            if (energy < trigger.energy_min || energy >= trigger.energy_max) continue;
+            select(frame_id - trigger.pre, frame_id + trigger.post);
+            frames.post_end_frame_id = std::max(frames.post_end_frame_id, frame_id + trigger.post);
+            last_trigger_frame_id = frame_id;
+        }
+    }
+
+    // stage the selected frames which are not written yet, in the order of the frames
+    const uint16_t file_index = static_cast<uint16_t>(rawfiles.empty() ? 0 : rawfiles.size() - 1);
+    auto frame_image = [&](int frame_id) {
+        return frame_id < start_frame_id
+            ? frames.tail_images.data() + static_cast<size_t>(frame_id - first_frame_id) * n_pixels
+            : frames_images + static_cast<size_t>(frame_id - start_frame_id) * n_pixels;
+    };
+    for (int frame_id = std::max(first_frame_id, frames.last_written_frame_id + 1); frame_id < end_frame_id; frame_id++) {
+        if (!selecteds[frame_id - first_frame_id]) continue;
+        const uint16_t* image = frame_image(frame_id);
+        frames.images.insert(frames.images.end(), image, image + n_pixels);
+        frames.frame_ids.push_back(frame_id);
+        frames.file_indices.push_back(file_index);
+        frames.last_written_frame_id = frame_id;
+    }
+
+    // keep the last pre frames for the triggers at the start of the next flow
+    const int n_kept_frames = std::min(trigger.pre, n_tail_frames + n_frames);
+    std::vector<uint16_t> tail_images;
+    std::vector<int> tail_frame_ids;
+    for (int frame_id = end_frame_id - n_kept_frames; frame_id < end_frame_id; frame_id++) {
+        const uint16_t* image = frame_image(frame_id);
+        tail_images.insert(tail_images.end(), image, image + n_pixels);
+        tail_frame_ids.push_back(frame_id);
+    }
+    frames.tail_images.swap(tail_images);
+    frames.tail_frame_ids.swap(tail_frame_ids);
+
+    // append the staged frames to the datasets
+    const size_t n_staged = frames.frame_ids.size();
+    if (n_staged == 0) return 0;
+    auto frames_dset = frames.file->getDataSet("frames");
+    const size_t n_rows = frames_dset.getDimensions()[0];
+    frames_dset.resize({ n_rows + n_staged, n_pixels });
+    frames_dset.select({ n_rows, 0 }, { n_staged, n_pixels }).write_raw(frames.images.data());
+    auto frame_ids_dset = frames.file->getDataSet("frame_id");
+    frame_ids_dset.resize({ n_rows + n_staged });
+    frame_ids_dset.select({ n_rows }, { n_staged }).write_raw(frames.frame_ids.data());
+    auto file_indices_dset = frames.file->getDataSet("file_index");
+    file_indices_dset.resize({ n_rows + n_staged });
+    file_indices_dset.select({ n_rows }, { n_staged }).write_raw(frames.file_indices.data());
+    frames.images.clear();
+    frames.frame_ids.clear();
+    frames.file_indices.clear();
+    return 0;
+}
+
+int TriggeredFramesWriter::close() {
+    if (closed) return 0;
+    for (auto& frames : crystals_frames) {
+        if (!frames.file) continue;
+        frames.file->createDataSet("rawfiles", rawfiles);
+        frames.file.reset();
+    }
+    closed = true;
+    return 0;
+}
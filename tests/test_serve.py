@@ -0,0 +1,59 @@
+# checks that alpha serve survives jobs without options, run from the repository folder after building alpha:
+#   python tests/test_serve.py
+# the executable and the config can be set with the ALPHA and ALPHA_CONFIG environment variables
+import os
+import socket
+import subprocess
+import tempfile
+import time
+import unittest
+
+# the server runs in a temporary folder, which receives the outputs of the jobs
+ALPHA = os.path.abspath(os.environ.get("ALPHA", "alpha.exe"))
+CONFIG = os.path.abspath(os.environ.get("ALPHA_CONFIG", "config.txt"))
+
+
+def send_job(socket_path, args):
+    client = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    client.connect(socket_path)
+    client.sendall("".join(arg + "\n" for arg in args).encode() + b"\n")
+    output = b""
+    while True:
+        data = client.recv(4096)
+        if not data:
+            break
+        output += data
+    client.close()
+    return output.decode()
+
+
+class TestServe(unittest.TestCase):
+
+    def setUp(self):
+        self.folder = tempfile.TemporaryDirectory()
+        self.socket_path = os.path.join(self.folder.name, "alpha.sock")
+        self.server = subprocess.Popen([ALPHA, "--config", CONFIG, "serve", self.socket_path], cwd=self.folder.name,
+                                       stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+        for _ in range(100):
+            if os.path.exists(self.socket_path):
+                break
+            time.sleep(0.1)
+        self.assertTrue(os.path.exists(self.socket_path), "the server did not start")
+
+    def tearDown(self):
+        if self.server.poll() is None:
+            self.server.kill()
+        self.server.communicate()
+        self.folder.cleanup()
+
+    def test_command_without_options(self):
+        for command in ["raw2frames", "query-clusters", "unknown-command"]:
+            output = send_job(self.socket_path, [command])
+            self.assertRegex(output.splitlines()[-1], r"^exit \d+$", command)
+            self.assertIsNone(self.server.poll(), "the server stopped after " + command)
+        self.assertEqual(send_job(self.socket_path, ["shutdown"]).splitlines()[-1], "exit 0")
+        self.assertEqual(self.server.wait(timeout=10), 0)
+
+
+if __name__ == "__main__":
+    unittest.main()